@@ -0,0 +1,11 @@
+#! /bin/sh
+set -ex
+${CC:-gcc} -O2 -DNDEBUG -DPTS_LBSEARCH_NO_MAIN \
+    -W -Wall -Wextra \
+    -Werror=missing-declarations -Werror=implicit-function-declaration \
+    -ansi ${CFLAGS} -c -o pts_lbsearch_lib.o ./pts_lbsearch.c
+rm -f libptslbsearch.a
+ar rcs libptslbsearch.a pts_lbsearch_lib.o
+rm -f pts_lbsearch_lib.o
+ls -l libptslbsearch.a
+: compile_lib.sh OK.
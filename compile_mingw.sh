@@ -1,6 +1,8 @@
 #! /bin/sh
+# Run as `CC=x86_64-w64-mingw32-gcc ./compile_mingw.sh' for a 64-bit .exe,
+# which can also map (flag -m) files larger than about 1GB.
 set -ex
-i686-w64-mingw32-gcc -s -O2 \
+${CC:-i686-w64-mingw32-gcc} -s -O2 \
     -W -Wall -Wextra \
     -Werror=missing-declarations -Werror=implicit-function-declaration \
     -ansi -o pts_lbsearch.exe ./pts_lbsearch.c
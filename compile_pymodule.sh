@@ -0,0 +1,14 @@
+#! /bin/sh
+# Builds the Python extension module _pts_lbsearch used by pts_line_bisect.py.
+# Run as `PYTHON=python3 ./compile_pymodule.sh' for another Python.
+set -ex
+PYTHON="${PYTHON:-python2.7}"
+PYINCLUDE="$("$PYTHON" -c \
+    'import sysconfig; print(sysconfig.get_paths()["include"])')"
+${CC:-gcc} -shared -fPIC -O2 -DNDEBUG -DPTS_LBSEARCH_NO_MAIN \
+    -W -Wall -Wextra \
+    -Werror=missing-declarations -Werror=implicit-function-declaration \
+    -I"$PYINCLUDE" ${CFLAGS} -o _pts_lbsearch.so \
+    ./pts_lbsearch_pymodule.c ./pts_lbsearch.c
+ls -l _pts_lbsearch.so
+: compile_pymodule.sh OK.
@@ -23,12 +23,17 @@
  *
  * Nice properties of this implementation:
  *
- * * no dynamic memory allocation (except possibly for stdio.h)
+ * * no dynamic memory allocation (except possibly for stdio.h, and for
+ *   the key list in batch mode, flag -B)
  * * no unnecessary lseek(2) or read(2) system calls
  * * no unnecessary comparisons for long strings
+ * * batch mode (flag -B) for answering many queries with a single open(2),
+ *   reusing the read buffer and the search window across sorted keys
  * * very small memory usage: only a few dozen of offsets and flags in addition
  *   to a single file read buffer (of 8K by default)
  * * no printf
+ * * usable as a library (compile_lib.sh, pts_lbsearch.h), which never
+ *   calls exit(3) on errors
  * * compiles without warnings in C and C++
  *   (gcc -std=c89; gcc -std=c99; gcc -std=c11;
  *   gcc -ansi; g++ -std=c++98; g++ -std=c++11; g++ -std=ansi; also
@@ -45,6 +50,10 @@
 /* TODO(pts): What is the Win32 (MinGW) equivalent? */
 #define _FILE_OFFSET_BITS 64
 #endif
+#ifndef _GNU_SOURCE
+/* For MAP_ANONYMOUS and madvise(2) with gcc -ansi. */
+#define _GNU_SOURCE 1
+#endif
 
 #ifdef __XTINY__
 #include <xtiny.h>
@@ -64,15 +73,90 @@
 #include <stdio.h>  /* Not strictly needed. */
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef HAVE_ZLIB  /* For BGZF input: compile with -DHAVE_ZLIB, link with -lz. */
+#include <zlib.h>
+#endif
+#if !defined(__MSDOS__) && !defined(_WIN32) && !defined(_WIN64)
+#include <sys/mman.h>
+#include <sys/time.h>
+#define HAVE_GETTIMEOFDAY 1
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#define HAVE_INOTIFY 1  /* For flag -f. */
+#define HAVE_SENDFILE 1
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(__GNUC__) && !defined(PTS_LBSEARCH_NO_MAIN)
+#define HAVE_IO_URING 1  /* For flag -A. */
+#endif
+#endif
+#endif
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+#if !defined(HAVE_PTHREAD) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_PTHREAD 1  /* In libc, no need for -pthread. */
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define HAVE_MEMMEM 1  /* For flag -G. */
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define HAVE_KQUEUE 1  /* For flag -f. */
+#endif
+#include <poll.h>
+#define HAVE_POLL 1
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAVE_UNIX_SOCKET 1  /* For flag -S. */
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#define HAVE_HTTP 1  /* For http:// URLs. */
+#if defined(MAP_ANONYMOUS) || defined(MAP_ANON)
+#define YF_HAVE_MMAP 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+#elif defined(_WIN32) || defined(_WIN64)
+#define WIN32_LEAN_AND_MEAN 1
+#include <io.h>  /* _get_osfhandle and setmode. */
+#include <windows.h>
+#define HAVE_WIN32_MAP 1  /* For flag -m: CreateFileMapping. */
+#endif
 #endif
 
+#include "pts_lbsearch.h"
+
 /* Win32 compatibility */
 /* TODO(pts): Verify that it works on Win32. */
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
+#if !defined(O_RANDOM) && defined(_O_RANDOM)
+#define O_RANDOM _O_RANDOM
+#endif
+#ifndef O_RANDOM  /* FILE_FLAG_RANDOM_ACCESS on Win32: no read-ahead. */
+#define O_RANDOM 0
+#endif
 
 #ifndef STATIC
 #define STATIC static
@@ -107,6 +191,27 @@ struct AssertYfReadBufSizeIsSmall_Struct {
       YF_READ_BUF_SIZE + 0ULL;
 };
 
+/* Counters for flag -v. The counters are always updated (it's cheap), the
+ * wall times are measured only if is_timed is true.
+ */
+struct yfstats {
+  off_t lseek_count;
+  off_t read_count;
+  off_t read_bytes;
+  off_t scan_bytes;  /* Bytes skipped by get_fofs to find a line start. */
+  off_t probe_count;  /* Iterations of bisect_way. */
+  off_t cache_hit_count;
+  off_t cache_miss_count;
+  off_t start_usec;  /* Wall time of the start bisection. */
+  off_t end_usec;  /* Wall time of the end bisection. */
+  off_t print_usec;
+  off_t prefetch_count;  /* posix_fadvise(2) calls for flag -P. */
+  off_t lcache_hit_count;  /* Line cache, flag -C. */
+  off_t lcache_miss_count;
+  off_t inflate_count;  /* BGZF blocks decompressed. */
+  ybool is_timed;
+};
+
 typedef struct yfile {
   char *p;
   /* Invariant: *yf->rend == '\0'. */
@@ -114,12 +219,59 @@ typedef struct yfile {
   int fd;
   off_t ofs;  /* File offset at the beginning of rbuf. */
   off_t size;
-  char rbuf[YF_READ_BUF_SIZE + 2];
+  /* NULL, or the entire file mmap(2)ed by yfmap. If not NULL, then p and
+   * rend point to map, rend == map + size, and rbuf is unused.
+   */
+  char *map;
+  size_t map_size;
+  /* Read buffer of block_size + 2 bytes: rbuf_default, or aligned within
+   * rbuf_alloc, see yfsetbuf.
+   */
+  char *rbuf;
+  char *rbuf_alloc;
+  int block_size;  /* A power of 2. */
+  ybool is_direct;  /* Read full, aligned blocks for O_DIRECT. */
+  /* Number of bisection levels below the current probe to prefetch
+   * (flag -P), or 0.
+   */
+  int prefetch_depth;
+  ybool is_interpolated;  /* Interpolation search (flag -u). */
+  ybool is_block_aligned;  /* Block-aligned probes (flag -r). */
+  struct lcache *lcache;  /* NULL, or the line cache (flag -C). */
+  struct lbofs *lbofs;  /* NULL, or the line-offset index (flag -l). */
+  struct bgzf *bgzf;  /* NULL, or the block index of compressed input. */
+  struct yhttp *http;  /* NULL, or the connection of remote input. */
+  /* NULL, or reads instead of read(2), for compressed or remote input:
+   * copies n bytes at ofs to buf, returns the number of bytes copied (less
+   * than n only at EOF), or -1 on error (with yf->err set).
+   */
+  int (*read_at)(struct yfile *yf, off_t ofs, char *buf, int n);
+  /* NULL (compare entire lines), or the key of the lines (flags -k, -w and
+   * -g). Not owned by yf.
+   */
+  const struct keyspec *keyspec;
+  char *kbuf;  /* malloc()ed buffer for the key of a line, or NULL. */
+  size_t kbuf_alloc;
+  /* The first error (an lbs_error), or LBS_OK. Errors are sticky: after an
+   * error, yfgetc always returns EOF.
+   */
+  int err;
+  int err_errno;  /* The errno of err. */
+  struct yfstats stats;
+  char rbuf_default[YF_READ_BUF_SIZE + 2];
 } yfile;
 
-STATIC __attribute__((noreturn)) void die5_code(
+/* The line-offset index (flag -l) of a yfile, see lbofs_open. */
+struct lbofs {
+  yfile yf;  /* Reading the .lbofs file. */
+  off_t count;  /* Number of lines. */
+  int width;  /* Size of an entry in bytes: 5 or 8. */
+};
+
+#ifndef PTS_LBSEARCH_NO_MAIN
+STATIC void write5_stderr(
     const char *msg1, const char *msg2, const char *msg3, const char *msg4,
-    const char *msg5, int exit_code) {
+    const char *msg5) {
   const size_t msg1_size = strlen(msg1), msg2_size = strlen(msg2);
   const size_t msg3_size = strlen(msg3), msg4_size = strlen(msg4);
   const size_t msg5_size = strlen(msg5);  /* !! */
@@ -128,6 +280,12 @@ STATIC __attribute__((noreturn)) void die5_code(
   (void)!write(STDERR_FILENO, msg3, msg3_size);
   (void)!write(STDERR_FILENO, msg4, msg4_size);
   (void)!write(STDERR_FILENO, msg5, msg5_size);
+}
+
+STATIC __attribute__((noreturn)) void die5_code(
+    const char *msg1, const char *msg2, const char *msg3, const char *msg4,
+    const char *msg5, int exit_code) {
+  write5_stderr(msg1, msg2, msg3, msg4, msg5);
   exit(exit_code);
 }
 
@@ -140,520 +298,5508 @@ STATIC __attribute__((noreturn)) void die1(const char *msg1) {
   die5_code(msg1, "", "", "", "\n", 2);
 }
 
-/** Constructor. Opens and initializes yf.
- * If size != (off_t)-1, then it will be imposed as a limit.
+/** Exits with an error message if there was an error in yf (opened by
+ * yfopen(yf, pathname, ...)).
  */
-STATIC void yfopen(yfile *yf, const char *pathname, off_t size) {
-  int fd = open(pathname, O_RDONLY | O_BINARY, 0);
-  if (fd < 0) {
+STATIC void yfcheck(const yfile *yf, const char *pathname) {
+  if (yf->err == LBS_OK) return;
+  errno = yf->err_errno;
+  if (yf->err == LBS_ERR_NOT_SEEKABLE) {
+    die1("error: input not seekable, cannot binary search");
+  } else if (yf->err == LBS_ERR_OPEN) {
     die2_strerror("error: open ", pathname);
-    exit(2);
+  } else if (yf->err == LBS_ERR_NOMEM) {
+    die1("error: out of memory");
+  } else if (yf->err == LBS_ERR_REMOTE) {
+    die5_code("error: unexpected HTTP response: ", pathname, "", "", "\n", 2);
+  } else if (yf->err == LBS_ERR_FORMAT) {
+    die5_code("error: unsupported or corrupt compressed input: ", pathname,
+              "", "", "\n", 2);
+  } else {
+    write5_stderr("error: ", lbs_strerror(yf->err), " ", "", "");
+    die2_strerror(pathname, "");
   }
-  if (size == -1) {
-    size = lseek(fd, 0, SEEK_END);
-    if (size + 1ULL == 0ULL) {
-      if (errno == ESPIPE) {
-        die1("error: input not seekable, cannot binary search");
-      } else {
-        die2_strerror("error: lseek end", "");
-      }
-    }
+}
+#endif
+
+/** Records error err (an lbs_error) with the current errno in yf, unless
+ * there was an error already.
+ */
+STATIC void yfseterr(yfile *yf, int err) {
+  if (yf->err == LBS_OK) {
+    yf->err = err;
+    yf->err_errno = errno;
   }
-  yf->p = yf->rend = yf->rbuf + YF_READ_BUF_SIZE + 1;
-  *yf->p = '\0';
-  yf->p[-1] = '\0';
-  yf->fd = fd;
-  yf->size = size;
-  yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
 }
 
-STATIC void yfclose(yfile *yf) {
-  if (yf->fd >= 0) {
-    close(yf->fd);
-    yf->fd = -1;
+/** Returns the wall time in microseconds if yf->stats.is_timed, otherwise
+ * 0. Only differences of the return values are meaningful.
+ */
+STATIC off_t yfstats_usec(const yfile *yf) {
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+  if (yf->stats.is_timed && gettimeofday(&tv, NULL) == 0) {
+    return tv.tv_sec * (off_t)1000000 + tv.tv_usec;
   }
-  yf->p = yf->rend = yf->rbuf + YF_READ_BUF_SIZE + 1;
-  yf->size = 0;
-  yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
+#else
+  (void)yf;
+#endif
+  return 0;
 }
 
-#if 0
-/* Constructor. Opens a file which always returns EOF. */
-STATIC void yfopen_devnull(yfile *yf) {
-  yf->fd = -1;
-  yfclose(yf);
-  *yf->p = '\0';
-  yf->p[-1] = '\0';
+STATIC off_t get_u64le(const char *p) {
+  unsigned long long u = 0;
+  int i;
+  for (i = 8; i-- > 0;) {
+    u = u << 8 | *(const unsigned char*)(p + i);
+  }
+  return (off_t)u;
 }
-#endif
 
-STATIC off_t yfgetsize(yfile *yf) {
-  return yf->size;
+/* Returns a malloc()ed string: pathname + ext (e.g. ".lbidx") + suffix, or
+ * NULL if out of memory.
+ */
+STATIC char *get_lbidx_pathname(const char *pathname, const char *ext,
+                                const char *suffix) {
+  const size_t size = strlen(pathname), ext_size = strlen(ext);
+  const size_t suffix_size = strlen(suffix);
+  char *result = (char*)malloc(size + ext_size + suffix_size + 1);
+  if (!result) return NULL;
+  memcpy(result, pathname, size);
+  memcpy(result + size, ext, ext_size);
+  memcpy(result + size + ext_size, suffix, suffix_size + 1);
+  return result;
 }
 
-#if 0
-STATIC off_t yftell(yfile *yf) {
-  return yf->p - yf->rbuf + yf->ofs;
+/* --- Block-compressed input (BGZF)
+ *
+ * A BGZF file (as written by bgzip(1) of htslib, also a valid .gz file) is
+ * a series of gzip members (blocks) of at most 64 KiB each, with the
+ * compressed size of the block in the `BC' extra field of its gzip header.
+ * If the filename ends with .gz or .bgz, yfopen builds an index of the
+ * blocks (from <pathname>.gzi, written by bgzip -i, if it's up to date,
+ * otherwise by reading the header of each block), and yfgetc then fills
+ * the read buffer by decompressing blocks instead of read(2)ing the file.
+ * The last BGZF_CACHE_SIZE decompressed blocks are kept, so that each
+ * probe near the end of the bisection decompresses at most one block.
+ * Decompression needs zlib (-DHAVE_ZLIB -lz), without it compressed input
+ * fails with LBS_ERR_FORMAT.
+ */
+
+#ifdef HAVE_ZLIB
+
+#define BGZF_MAX_BLOCK_SIZE 65536  /* Both compressed and uncompressed. */
+#define BGZF_HEADER_SIZE 18  /* With the BC extra field only. */
+#define BGZF_FOOTER_SIZE 8  /* CRC32 and ISIZE. */
+#define BGZF_CACHE_SIZE 4
+
+struct bgzf {
+  /* Block i starts at offset cofs[i] of the file, and its data at offset
+   * uofs[i] of the uncompressed data, for 0 <= i < count. Empty blocks are
+   * omitted. cofs[count] is the file size, uofs[count] is the uncompressed
+   * size.
+   */
+  off_t *cofs;
+  off_t *uofs;
+  off_t count;
+  off_t alloc;  /* Number of entries allocated in cofs and uofs. */
+  /* Cache of decompressed blocks: slot j contains block slot_block[j] (or
+   * nothing if -1) at slots + j * BGZF_MAX_BLOCK_SIZE.
+   */
+  off_t slot_block[BGZF_CACHE_SIZE];
+  off_t slot_used[BGZF_CACHE_SIZE];  /* Value of clock at the last use. */
+  off_t clock;
+  char *slots;
+  char *cbuf;  /* BGZF_MAX_BLOCK_SIZE bytes: the compressed block. */
+  z_stream zs;
+  ybool is_zs_ok;  /* zs has been initialized. */
+};
+
+STATIC unsigned long get_u32le(const char *p) {
+  const unsigned char *u = (const unsigned char*)p;
+  return u[0] | (unsigned long)u[1] << 8 | (unsigned long)u[2] << 16 |
+      (unsigned long)u[3] << 24;
 }
-#endif
 
-STATIC off_t yflimit(yfile *yf, off_t size) {
-  off_t ofs;
-  if (size + 0ULL < yf->size + 0ULL) {
-    yf->size = size;
-    /* Fix up yf->p and yf->rend if they are too large. */
-    if (yf->rend - yf->rbuf + yf->ofs + 0ULL > yf->size + 0ULL &&
-        yf->p != yf->rbuf + YF_READ_BUF_SIZE + 1) {
-      if (yf->p - yf->rbuf + yf->ofs + 0ULL > yf->size + 0ULL) {
-        /* TODO(pts): Do it without dropping all the caches. */
-        ofs = yf->p - yf->rbuf + yf->ofs;
-        yf->p = yf->rend = yf->rbuf + YF_READ_BUF_SIZE + 1;
-        yf->ofs = ofs - (YF_READ_BUF_SIZE + 1);
-      } else {
-        yf->rend = yf->size - yf->ofs + yf->rbuf;  /* Make it smaller. */
-        *yf->rend = '\0';
-      }
+/* Reads n bytes at ofs of the (compressed) file of yf to buf. Returns
+ * false on error (also setting yf->err) and at EOF.
+ */
+STATIC ybool bgzf_pread(yfile *yf, off_t ofs, char *buf, int n) {
+  int got;
+  ++yf->stats.lseek_count;
+  if (lseek(yf->fd, ofs, SEEK_SET) != ofs) {
+    yfseterr(yf, LBS_ERR_LSEEK);
+    return 0;
+  }
+  while (n > 0) {
+    ++yf->stats.read_count;
+    if ((got = read(yf->fd, buf, n)) <= 0) {
+      if (got < 0) yfseterr(yf, LBS_ERR_READ);
+      return 0;
     }
+    yf->stats.read_bytes += got;
+    buf += got;
+    n -= got;
   }
-  return yf->size;
+  return 1;
 }
 
-/* It's possible to seek beyond the file size. */
-STATIC void yfseek_set(yfile *yf, off_t ofs) {
-  char * const rbuf1 = yf->rbuf + YF_READ_BUF_SIZE + 1;
-  assert(ofs >= 0);
-  /* TODO(pts): Convert off_t to its unsigned equivalent? + 0U doesn't seem to
-   * make a difference. + 0ULL seems to solve it.
-   */
-  if (yf->p != rbuf1 && ofs - yf->ofs + 0ULL <= yf->rend - yf->rbuf + 0ULL) {
-    yf->p = ofs - yf->ofs + yf->rbuf;
-  } else {  /* Forget about the cached read buffer. */
-    yf->p = yf->rend = rbuf1;
-    yf->ofs = ofs - (YF_READ_BUF_SIZE + 1);
+/* Parses the gzip header of a BGZF block in buf[:BGZF_HEADER_SIZE], and
+ * sets *hsize_out to its size. Returns the size of the block, or 0 if it's
+ * not a BGZF block (or BC is not its first extra subfield).
+ */
+STATIC int bgzf_parse_header(const char *buf, int *hsize_out) {
+  const unsigned char *u = (const unsigned char*)buf;
+  const int xlen = u[10] | u[11] << 8, bsize = (u[16] | u[17] << 8) + 1;
+  if (u[0] != 0x1f || u[1] != 0x8b || u[2] != 8 || u[3] != 4 || xlen < 6 ||
+      u[12] != 'B' || u[13] != 'C' || u[14] != 2 || u[15] != 0 ||
+      bsize < 12 + xlen + BGZF_FOOTER_SIZE) {
+    return 0;
   }
+  *hsize_out = 12 + xlen;
+  return bsize;
 }
 
-STATIC void yfseek_cur(yfile *yf, off_t ofs) {
-  if (ofs + 0ULL <= yf->rend - yf->p + 0ULL) {  /* Shortcut for ofs >= 0. */
-    yf->p += ofs;
-  } else {
-    yfseek_set(yf, yf->p - yf->rbuf + yf->ofs + ofs);
+/* Appends a block to the index of yf, replacing the previous block if it's
+ * empty. Returns false if out of memory.
+ */
+STATIC ybool bgzf_add(yfile *yf, off_t cofs, off_t uofs) {
+  struct bgzf *bz = yf->bgzf;
+  off_t *p;
+  if (bz->count > 0 && bz->uofs[bz->count - 1] == uofs) --bz->count;
+  if (bz->count == bz->alloc) {
+    bz->alloc = bz->alloc ? bz->alloc << 1 : 256;
+    if (!(p = (off_t*)realloc(bz->cofs, bz->alloc * sizeof(off_t)))) {
+      goto nomem;
+    }
+    bz->cofs = p;
+    if (!(p = (off_t*)realloc(bz->uofs, bz->alloc * sizeof(off_t)))) {
+      goto nomem;
+    }
+    bz->uofs = p;
   }
+  bz->cofs[bz->count] = cofs;
+  bz->uofs[bz->count++] = uofs;
+  return 1;
+ nomem:
+  yfseterr(yf, LBS_ERR_NOMEM);
+  return 0;
 }
 
-/** Fast macro for yfgetc. */
-#define YFGETCHAR(yf) (*(yf)->p == '\0' ? yfgetc(yf) : \
-    (int)*(unsigned char*)(yf)->p++)
-
-/** Can only be called after a getchar returning non-EOF. */
-#define YFUNGET(yf) ((void)--(yf)->p)
+/* Adds the block starting at cofs (with its data at uncompressed offset
+ * uofs) and all blocks after it to the index of yf, and sets uofs[count].
+ * Each read(2) gets the ISIZE of a block and the header of the next one.
+ * Returns false on error.
+ */
+STATIC ybool bgzf_scan(yfile *yf, off_t cofs, off_t uofs) {
+  const off_t csize = yf->size;
+  char buf[4 + BGZF_HEADER_SIZE];
+  int bsize = 0, hsize, n;
+  if (cofs < csize && (!bgzf_pread(yf, cofs, buf + 4, BGZF_HEADER_SIZE) ||
+                       !(bsize = bgzf_parse_header(buf + 4, &hsize)))) {
+    goto bad;
+  }
+  while (cofs < csize) {
+    if (bsize > csize - cofs) goto bad;
+    if (!bgzf_add(yf, cofs, uofs)) return 0;
+    cofs += bsize;
+    n = csize - cofs >= BGZF_HEADER_SIZE ? 4 + BGZF_HEADER_SIZE : 4;
+    if (!bgzf_pread(yf, cofs - 4, buf, n)) goto bad;
+    uofs += get_u32le(buf);
+    if (n == 4) {
+      if (cofs != csize) goto bad;  /* Trailing garbage. */
+    } else if (!(bsize = bgzf_parse_header(buf + 4, &hsize))) {
+      goto bad;
+    }
+  }
+  if (!bgzf_add(yf, csize, uofs)) return 0;
+  --yf->bgzf->count;
+  return 1;
+ bad:
+  yfseterr(yf, LBS_ERR_FORMAT);
+  return 0;
+}
 
-/** Returns -1 on EOF, or 0..255. */
-STATIC int yfgetc(yfile *yf) {
-  if (yf->p == yf->rend) {
-    off_t a = yf->p - yf->rbuf + yf->ofs, b;  /* a = yftell(yf); */
-    int got, need;
-    if (a + 0ULL >= yf->size + 0ULL) return -1;  /* EOF. */
-    /* YF_READ_BUF_SIZE must be a power of 2 for this below. */
-    b = a & -YF_READ_BUF_SIZE;
-    yf->p = a - b + yf->rbuf;
-    if (yf->ofs != b) {
-      a = lseek(yf->fd, b, SEEK_SET);
-      if (a + 1ULL == 0ULL) {
-        if (errno == ESPIPE) {
-          die1("error: input not seekable, cannot binary search");
-        } else {
-          die2_strerror("error: lseek set", "");  /* !! merge */
-        }
-        exit(2);
-      }
-      if (a != b) {  /* Should not happen. */
-        die2_strerror("error: lseek set offset", "");
-        exit(2);
+/* Adds the blocks listed in <pathname>.gzi (as written by bgzip -i) to the
+ * index of yf, unless it's older than the file (opened as st). Stops at
+ * the first invalid entry.
+ */
+STATIC void bgzf_load_gzi(yfile *yf, const char *pathname,
+                          const struct stat *st) {
+  char *gzi_pathname = get_lbidx_pathname(pathname, ".gzi", "");
+  char buf[4096];
+  struct stat gst;
+  off_t count, cofs = 0, uofs = 0, c, u;
+  int fd, i, n;
+  if (!gzi_pathname) return;
+  fd = open(gzi_pathname, O_RDONLY | O_BINARY, 0);
+  free(gzi_pathname);
+  if (fd < 0) return;
+  if (fstat(fd, &gst) != 0 || gst.st_mtime < st->st_mtime ||
+      read(fd, buf, 8) != 8 || (count = get_u64le(buf)) < 0 ||
+      gst.st_size != 8 + count * 16 || !bgzf_add(yf, 0, 0)) {
+    close(fd);
+    return;
+  }
+  while (count > 0) {
+    n = count > (off_t)(sizeof(buf) / 16) ? (int)(sizeof(buf) / 16) :
+        (int)count;
+    if (read(fd, buf, n * 16) != n * 16) break;
+    for (i = 0; i < n; ++i) {
+      c = get_u64le(buf + i * 16);
+      u = get_u64le(buf + i * 16 + 8);
+      if (c <= cofs || u < uofs || c >= yf->size ||
+          u - uofs > BGZF_MAX_BLOCK_SIZE || !bgzf_add(yf, c, u)) {
+        count = n = 0;
+        break;
       }
-      yf->ofs = b;
-    }
-    need = b + YF_READ_BUF_SIZE + 0ULL > yf->size + 0ULL ?
-        yf->size - b : YF_READ_BUF_SIZE;
-    got = yf->fd < 0 ? 0 : read(yf->fd, yf->rbuf, need);
-    if (got < 0) {
-      die2_strerror("error: read", "");
+      cofs = c;
+      uofs = u;
     }
-    *(yf->rend = yf->rbuf + got) = '\0';
-    b += got;
-    if (got < need && b + 0ULL < yf->size + 0ULL) {
-      yf->size = b;
-    }
-    if (b + 0ULL <= a + 0ULL) {  /* yf->p is past the buffer. */
-      yf->p = yf->rend;
-      return -1;  /* EOF. */
+    count -= n;
+  }
+  close(fd);
+}
+
+/* Returns the decompressed data of block i of yf, or NULL on error. */
+STATIC const char *bgzf_get_block(yfile *yf, off_t i) {
+  struct bgzf *bz = yf->bgzf;
+  const off_t usize = bz->uofs[i + 1] - bz->uofs[i];
+  char *data;
+  int j, k, n, bsize, hsize;
+  for (j = 0; j < BGZF_CACHE_SIZE && bz->slot_block[j] != i; ++j) {}
+  if (j < BGZF_CACHE_SIZE) {
+    bz->slot_used[j] = ++bz->clock;
+    return bz->slots + j * BGZF_MAX_BLOCK_SIZE;
+  }
+  for (j = 0, k = 1; k < BGZF_CACHE_SIZE; ++k) {
+    if (bz->slot_used[k] < bz->slot_used[j]) j = k;
+  }
+  bz->slot_block[j] = -1;
+  data = bz->slots + j * BGZF_MAX_BLOCK_SIZE;
+  /* The block may be followed by empty blocks within this range. */
+  n = bz->cofs[i + 1] - bz->cofs[i] > BGZF_MAX_BLOCK_SIZE ?
+      BGZF_MAX_BLOCK_SIZE : (int)(bz->cofs[i + 1] - bz->cofs[i]);
+  if (n < BGZF_HEADER_SIZE || !bgzf_pread(yf, bz->cofs[i], bz->cbuf, n) ||
+      !(bsize = bgzf_parse_header(bz->cbuf, &hsize)) || bsize > n ||
+      usize > BGZF_MAX_BLOCK_SIZE) {
+    goto bad;
+  }
+  bz->zs.next_in = (Bytef*)bz->cbuf + hsize;
+  bz->zs.avail_in = bsize - hsize - BGZF_FOOTER_SIZE;
+  bz->zs.next_out = (Bytef*)data;
+  bz->zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+  if (inflateReset(&bz->zs) != Z_OK ||
+      inflate(&bz->zs, Z_FINISH) != Z_STREAM_END ||
+      BGZF_MAX_BLOCK_SIZE - bz->zs.avail_out != (unsigned)usize ||
+      get_u32le(bz->cbuf + bsize - 4) != (unsigned long)usize ||
+      get_u32le(bz->cbuf + bsize - 8) !=
+      crc32(0L, (Bytef*)data, (unsigned)usize)) {
+    goto bad;
+  }
+  ++yf->stats.inflate_count;
+  bz->slot_block[j] = i;
+  bz->slot_used[j] = ++bz->clock;
+  return data;
+ bad:
+  yfseterr(yf, LBS_ERR_FORMAT);
+  return NULL;
+}
+
+/* Copies n bytes at uncompressed offset ofs of yf to buf. Returns the
+ * number of bytes copied (less than n only at EOF), or -1 on error.
+ */
+STATIC int bgzf_read(yfile *yf, off_t ofs, char *buf, int n) {
+  const struct bgzf *bz = yf->bgzf;
+  const char *data;
+  off_t a, b, mid;
+  int got = 0, k;
+  while (got < n && ofs < bz->uofs[bz->count]) {
+    for (a = 0, b = bz->count; b - a > 1;) {  /* Find the block of ofs. */
+      mid = a + ((b - a) >> 1);
+      if (bz->uofs[mid] <= ofs) {
+        a = mid;
+      } else {
+        b = mid;
+      }
     }
+    if (!(data = bgzf_get_block(yf, a))) return -1;
+    k = bz->uofs[a + 1] - ofs > n - got ? n - got :
+        (int)(bz->uofs[a + 1] - ofs);
+    memcpy(buf + got, data + (ofs - bz->uofs[a]), k);
+    got += k;
+    ofs += k;
   }
-  return *(unsigned char*)yf->p++;
+  return got;
 }
 
-/* If len <= 0 or at EOF, just returns 0. Otherwise, it makes sure that the
- * read buffer of yf contains it least 1 byte available (by calling
- * yfgetc(yf) if needed), and returns min(available, len), thus the return
- * value is at least 1. Also sets *buf_out so that (*buf_out[:result]) is
- * the next available bytes with the read buffer. It doesn't skip over these
- * bytes though, the caller can do it by yfseek_cur(yf, result) later.
+STATIC void bgzf_close(yfile *yf) {
+  struct bgzf *bz = yf->bgzf;
+  if (bz->is_zs_ok) inflateEnd(&bz->zs);
+  free(bz->cofs);
+  free(bz->uofs);
+  free(bz->slots);
+  free(bz->cbuf);
+  free(bz);
+  yf->bgzf = NULL;
+}
+
+#endif  /* HAVE_ZLIB */
+
+/* Returns true iff pathname ends with suffix. */
+STATIC ybool has_suffix(const char *pathname, const char *suffix) {
+  const size_t size = strlen(pathname), suffix_size = strlen(suffix);
+  return size >= suffix_size &&
+      0 == memcmp(pathname + size - suffix_size, suffix, suffix_size);
+}
+
+/** If pathname (just opened to yf) ends with .gz or .bgz, makes yf read
+ * the uncompressed data. Sets yf->err to LBS_ERR_FORMAT if it's not BGZF
+ * (or zlib is not available).
  */
-STATIC int yfpeek(yfile *yf, off_t len, const char **buf_out) {
-  int available;
-  if (len <= 0) return 0;
-  available = yf->rend - yf->p;  /* This fits to an int. */
-  if (available <= 0 && yfgetc(yf) >= 0) {
-    --yf->p;  /* YFUNGET(yf). */
-    available = yf->rend - yf->p;
+STATIC void yfopen_bgzf(yfile *yf, const char *pathname) {
+#ifdef HAVE_ZLIB
+  struct bgzf *bz;
+  struct stat st;
+  int j;
+#endif
+  if (yf->err != LBS_OK ||
+      !(has_suffix(pathname, ".gz") || has_suffix(pathname, ".bgz"))) {
+    return;
   }
-  *buf_out = yf->p;
-  return len + 0ULL > available + 0ULL ? available : (int)len;
+#ifdef HAVE_ZLIB
+  if (!(bz = (struct bgzf*)malloc(sizeof(*bz)))) goto nomem;
+  memset(bz, '\0', sizeof(*bz));
+  yf->bgzf = bz;  /* yfclose frees it. */
+  for (j = 0; j < BGZF_CACHE_SIZE; ++j) {
+    bz->slot_block[j] = -1;
+  }
+  if (!(bz->slots = (char*)malloc(BGZF_CACHE_SIZE * BGZF_MAX_BLOCK_SIZE)) ||
+      !(bz->cbuf = (char*)malloc(BGZF_MAX_BLOCK_SIZE)) ||
+      inflateInit2(&bz->zs, -15) != Z_OK) {  /* Raw deflate data. */
+    goto nomem;
+  }
+  bz->is_zs_ok = 1;
+  yf->read_at = bgzf_read;
+  if (fstat(yf->fd, &st) == 0) bgzf_load_gzi(yf, pathname, &st);
+  if (bz->count > 0) --bz->count;  /* Rescan the last block listed. */
+  if (bgzf_scan(yf, bz->count > 0 ? bz->cofs[bz->count] : 0,
+                bz->count > 0 ? bz->uofs[bz->count] : 0)) {
+    yf->size = bz->uofs[bz->count];
+  } else {
+    yf->size = 0;
+  }
+  return;
+ nomem:
+  yfseterr(yf, LBS_ERR_NOMEM);
+  yf->size = 0;
+#else
+  yfseterr(yf, LBS_ERR_FORMAT);
+  yf->size = 0;
+#endif
 }
 
-/* --- Bisection (binary search)
+/* --- Remote input (http:// URLs)
  *
- * The algorithms and data structures below are complex, tricky, and very
- * underdocumented. See (ARTICLE) above for a detailed explanation of both
- * design and implementation.
+ * If the pathname is an http:// URL (e.g. of S3-compatible object storage,
+ * possibly presigned), yfopen connects to the server, and yfgetc gets the
+ * data with HTTP/1.1 GET requests with a Range: header on a keep-alive
+ * connection. Each request costs a round trip, so data is requested in
+ * large blocks (HTTP_BLOCK_SIZE, which makes the last few probes of a
+ * bisection free), and the last HTTP_CACHE_SIZE blocks are kept. With flag
+ * -P, yfprefetch sends the requests for the next probe candidates right
+ * away, without waiting for the responses (HTTP pipelining), so that their
+ * round trips overlap. https:// is not supported, because it would need a
+ * TLS library (a local TLS proxy such as stunnel(8) can be used instead).
  */
 
-/* Returns the file offset of the line starting at ofs, or if no line
- * starts their, then the the offset of the next line.
+#ifdef HAVE_HTTP
+
+#define HTTP_BLOCK_SIZE 65536
+#define HTTP_CACHE_SIZE 16
+#define HTTP_MAX_IN_FLIGHT 8  /* Less than HTTP_CACHE_SIZE. */
+#define HTTP_TIMEOUT_SEC 60
+#define HTTP_IBUF_SIZE 8192  /* Also the maximum size of a header line. */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* SO_NOSIGPIPE is used instead (on macOS). */
+#endif
+
+struct yhttp {
+  /* malloc()ed: host (and :port) for the Host: header, host name, port
+   * and path (with the query string), each terminated by '\0'.
+   */
+  char *host;
+  const char *name;
+  const char *port;
+  const char *path;
+  char *req;  /* Buffer for a request. */
+  int sock;  /* -1 if not connected. */
+  int responses;  /* Number of responses read on sock. */
+  off_t size;  /* File size, from the first response, or -1. */
+  /* Requested blocks whose responses are not read yet, in request order. */
+  off_t queue[HTTP_MAX_IN_FLIGHT];
+  int queue_size;
+  /* Cache of blocks: slot j contains block slot_block[j] (or nothing if -1)
+   * at slots + j * HTTP_BLOCK_SIZE.
+   */
+  off_t slot_block[HTTP_CACHE_SIZE];
+  off_t slot_used[HTTP_CACHE_SIZE];  /* Value of clock at the last use. */
+  off_t clock;
+  char *slots;
+  int ipos, ilen;  /* ibuf[ipos:ilen] is received, but not processed. */
+  char ibuf[HTTP_IBUF_SIZE];
+};
+
+STATIC char *http_append(char *p, const char *s) {
+  const size_t size = strlen(s);
+  memcpy(p, s, size);
+  return p + size;
+}
+
+STATIC char *http_append_unsigned(char *p, off_t v) {
+  char tmp[24];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + (int)(v % 10);
+  } while ((v /= 10) != 0);
+  while (n > 0) *p++ = tmp[--n];
+  return p;
+}
+
+/* Parses the decimal number at *pp (moving *pp after it). Returns -1 if
+ * there are no digits, or if it's too large.
  */
-STATIC off_t get_fofs(yfile *yf, off_t ofs) {
+STATIC off_t http_parse_unsigned(const char **pp) {
+  const char *p = *pp;
+  off_t v = 0;
+  if (*p < '0' || *p > '9') return -1;
+  for (; *p >= '0' && *p <= '9'; ++p) {
+    if (v > (((off_t)1 << 62) - 1) / 5) return -1;
+    v = v * 10 + (*p - '0');
+  }
+  *pp = p;
+  return v;
+}
+
+/* Returns true iff line starts with prefix (ASCII lowercase),
+ * case-insensitively. Sets *value_out to the rest after spaces.
+ */
+STATIC ybool http_header_is(const char *line, const char *prefix,
+                            const char **value_out) {
   int c;
-  off_t size;
-  assert(ofs >= 0);
-  if (ofs == 0) return 0;
-  size = yfgetsize(yf);
-  if (ofs > size) return size;
-  --ofs;
-  yfseek_set(yf, ofs);
-  for (;;) {
-    if ((c = YFGETCHAR(yf)) < 0) return ofs;
-    ++ofs;
-    if (c == '\n') return ofs;
+  for (; *prefix; ++line, ++prefix) {
+    c = *line;
+    if ((c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c) != *prefix) return 0;
   }
+  while (*line == ' ' || *line == '\t') ++line;
+  *value_out = line;
+  return 1;
 }
 
-typedef enum compare_mode_t {
-  CM_LE,  /* True iff x <= y (where y is read from the file). */
-  CM_LT,  /* True iff x < y. */
-  CM_LP,  /* x* < y, where x* is x + a fake byte 256 and the end. */
-  CM_UNSET,  /* Not set yet. Most functions do not support it. */
-} compare_mode_t;
+STATIC void http_disconnect(struct yhttp *hp) {
+  if (hp->sock >= 0) close(hp->sock);
+  hp->sock = -1;
+  hp->ipos = hp->ilen = 0;
+}
 
-/* Compares x[:xsize] with a line read from yf. */
-STATIC ybool compare_line(yfile *yf, off_t fofs,
-                          const char *x, size_t xsize, compare_mode_t cm) {
-  int b, c;
-  yfseek_set(yf, fofs);
-  c = YFGETCHAR(yf);
-  if (c < 0) return 1;  /* Special casing of EOF at BOL. */
-  YFUNGET(yf);
-  /* TODO(pts): Possibly speed up the loop with yfpeek(...). */
-  for (;;) {
-    c = YFGETCHAR(yf);
-    if (c < 0 || c == '\n') {
-      return cm == CM_LE ? xsize == 0 : 0;
-    } else if (xsize == 0) {
-      return cm != CM_LP;
-    } else if ((b = (int)*(unsigned char*)x) != c) {
-      return b < c;
+STATIC ybool http_connect(yfile *yf) {
+  struct yhttp *hp = yf->http;
+  struct addrinfo hints, *res, *ai;
+  struct timeval tv;
+  int s = -1, one = 1;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hp->name, hp->port, &hints, &res) != 0) {
+    errno = EHOSTUNREACH;
+    yfseterr(yf, LBS_ERR_OPEN);
+    return 0;
+  }
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+      continue;
     }
-    ++x;
-    --xsize;
+    if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    close(s);
+    s = -1;
   }
+  if (s < 0) yfseterr(yf, LBS_ERR_OPEN);
+  freeaddrinfo(res);
+  if (s < 0) return 0;
+  tv.tv_sec = HTTP_TIMEOUT_SEC;
+  tv.tv_usec = 0;
+  (void)setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+  (void)setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+  (void)setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one,
+                   sizeof(one));
+#ifdef SO_NOSIGPIPE
+  (void)setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&one,
+                   sizeof(one));
+#endif
+  hp->sock = s;
+  hp->responses = 0;
+  return 1;
 }
 
-struct cache_entry {
-  off_t ofs;
-  off_t fofs;
-  ybool cmp_result;
-};
+/* Sends the request for block on the connection. Returns false on error. */
+STATIC ybool http_send(struct yhttp *hp, off_t block) {
+  const off_t start = block * HTTP_BLOCK_SIZE;
+  char *p = hp->req;
+  size_t size;
+  ssize_t got;
+  p = http_append(p, "GET ");
+  p = http_append(p, hp->path);
+  p = http_append(p, " HTTP/1.1\r\nHost: ");
+  p = http_append(p, hp->host);
+  p = http_append(p, "\r\nRange: bytes=");
+  p = http_append_unsigned(p, start);
+  *p++ = '-';
+  p = http_append_unsigned(p, start + HTTP_BLOCK_SIZE - 1);
+  p = http_append(p, "\r\nUser-Agent: pts_lbsearch\r\n\r\n");
+  for (size = p - hp->req, p = hp->req; size > 0; p += got, size -= got) {
+    if ((got = send(hp->sock, p, size, MSG_NOSIGNAL)) <= 0) return 0;
+  }
+  return 1;
+}
 
-struct cache {
-  struct cache_entry e[2];
-  /* 0: 0,1 are used, 0 is active;
-   * 1: 0,1 are used, 1 is active;
-   * 2: 0 is used and active, 1 is unused;
+/* Reconnects, and sends the requests in the queue again. */
+STATIC ybool http_reconnect(yfile *yf) {
+  struct yhttp *hp = yf->http;
+  int k;
+  http_disconnect(hp);
+  if (!http_connect(yf)) return 0;
+  for (k = 0; k < hp->queue_size; ++k) {
+    if (!http_send(hp, hp->queue[k])) {
+      yfseterr(yf, LBS_ERR_READ);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Requests block, and appends it to the queue, which must not be full.
+ * Returns false on error.
+ */
+STATIC ybool http_request(yfile *yf, off_t block) {
+  struct yhttp *hp = yf->http;
+  assert(hp->queue_size < HTTP_MAX_IN_FLIGHT);
+  hp->queue[hp->queue_size++] = block;
+  if (hp->sock >= 0 && http_send(hp, block)) return 1;
+  /* The server may have closed the idle keep-alive connection. */
+  return http_reconnect(yf);
+}
+
+/* Returns a '\0'-terminated line (without the CRLF) from the connection, or
+ * NULL on error (or EOF).
+ */
+STATIC char *http_getline(struct yhttp *hp) {
+  char *line, *q;
+  ssize_t got;
+  for (;;) {
+    line = hp->ibuf + hp->ipos;
+    if ((q = (char*)memchr(line, '\n', hp->ilen - hp->ipos)) != NULL) {
+      hp->ipos = q + 1 - hp->ibuf;
+      if (q > line && q[-1] == '\r') --q;
+      *q = '\0';
+      return line;
+    }
+    if (hp->ipos > 0) {  /* Move the partial line to the beginning. */
+      memmove(hp->ibuf, line, hp->ilen - hp->ipos);
+      hp->ilen -= hp->ipos;
+      hp->ipos = 0;
+    }
+    if (hp->ilen == HTTP_IBUF_SIZE) return NULL;  /* Line too long. */
+    got = recv(hp->sock, hp->ibuf + hp->ilen, HTTP_IBUF_SIZE - hp->ilen, 0);
+    if (got <= 0) return NULL;
+    hp->ilen += got;
+  }
+}
+
+/* Reads the response for the first block in the queue to data. Returns
+ * the size of the block, -1 on error, or -2 if the connection got closed
+ * (or reset) before the end of the response.
+ */
+STATIC int http_read_response(yfile *yf, char *data) {
+  struct yhttp *hp = yf->http;
+  const char *line, *value;
+  off_t content_length = -1, size = -1, expected;
+  int status, n;
+  ssize_t got;
+  ybool is_close = 0;
+  if (!(line = http_getline(hp))) goto closed;
+  if (0 != strncmp(line, "HTTP/1.", 7) || line[8] != ' ') return -1;
+  value = line + 9;
+  if ((status = (int)http_parse_unsigned(&value)) < 0) return -1;
+  while ((line = http_getline(hp)) && *line != '\0') {
+    if (http_header_is(line, "content-length:", &value)) {
+      content_length = http_parse_unsigned(&value);
+    } else if (http_header_is(line, "content-range:", &value)) {
+      if ((value = strchr(value, '/')) != NULL) {
+        ++value;
+        size = http_parse_unsigned(&value);
+      }
+    } else if (http_header_is(line, "connection:", &value)) {
+      is_close = strstr(value, "close") != NULL;
+    } else if (http_header_is(line, "transfer-encoding:", &value)) {
+      return -1;  /* Chunked encoding is not supported. */
+    }
+  }
+  if (!line) goto closed;
+  if (content_length < 0 || content_length > HTTP_BLOCK_SIZE) return -1;
+  for (n = 0; n < content_length; n += got) {
+    if (hp->ipos < hp->ilen) {
+      got = content_length - n < hp->ilen - hp->ipos ?
+          (int)(content_length - n) : hp->ilen - hp->ipos;
+      memcpy(data + n, hp->ibuf + hp->ipos, got);
+      hp->ipos += got;
+    } else if ((got = recv(hp->sock, data + n, content_length - n, 0)) <=
+               0) {
+      return -2;
+    }
+  }
+  ++hp->responses;
+  ++yf->stats.read_count;
+  yf->stats.read_bytes += n;
+  if (is_close) http_disconnect(hp);
+  if (status == 416 && size == 0 && hp->size < 0) {
+    n = 0;  /* Range not satisfiable, because the file is empty. */
+  } else if (status != 206) {
+    return -1;
+  }
+  if (hp->size < 0) hp->size = size;
+  if (size != hp->size || size < 0) return -1;  /* File changed. */
+  expected = size - hp->queue[0] * HTTP_BLOCK_SIZE;
+  if (expected > HTTP_BLOCK_SIZE) expected = HTTP_BLOCK_SIZE;
+  return n == expected ? n : -1;
+ closed:  /* Unless the line was too long. */
+  return hp->ipos == 0 && hp->ilen == HTTP_IBUF_SIZE ? -1 : -2;
+}
+
+/* Reads the response for the first block in the queue to the cache, and
+ * removes it from the queue. Returns its data, or NULL on error.
+ */
+STATIC const char *http_receive(yfile *yf) {
+  struct yhttp *hp = yf->http;
+  char *data;
+  int j, k, got;
+  for (j = 0, k = 1; k < HTTP_CACHE_SIZE; ++k) {
+    if (hp->slot_used[k] < hp->slot_used[j]) j = k;
+  }
+  hp->slot_block[j] = -1;
+  data = hp->slots + j * HTTP_BLOCK_SIZE;
+  if (hp->sock < 0 && !http_reconnect(yf)) return NULL;
+  /* If the server has closed the keep-alive connection after some
+   * responses, send the rest of the requests again on a new connection.
+   */
+  while ((got = http_read_response(yf, data)) == -2 && hp->responses > 0) {
+    if (!http_reconnect(yf)) return NULL;
+  }
+  if (got < 0) {
+    http_disconnect(hp);
+    hp->queue_size = 0;
+    yfseterr(yf, LBS_ERR_REMOTE);
+    return NULL;
+  }
+  hp->slot_block[j] = hp->queue[0];
+  hp->slot_used[j] = ++hp->clock;
+  memmove(hp->queue, hp->queue + 1, --hp->queue_size * sizeof(off_t));
+  return data;
+}
+
+/* Returns the data of block of yf, or NULL on error. */
+STATIC const char *http_get_block(yfile *yf, off_t block) {
+  struct yhttp *hp = yf->http;
+  const char *data;
+  off_t head;
+  int j;
+  for (j = 0; j < HTTP_CACHE_SIZE && hp->slot_block[j] != block; ++j) {}
+  if (j < HTTP_CACHE_SIZE) {
+    hp->slot_used[j] = ++hp->clock;
+    return hp->slots + j * HTTP_BLOCK_SIZE;
+  }
+  for (j = 0; j < hp->queue_size && hp->queue[j] != block; ++j) {}
+  if (j == hp->queue_size) {  /* Not requested yet. */
+    if (j == HTTP_MAX_IN_FLIGHT && !http_receive(yf)) return NULL;
+    if (!http_request(yf, block)) return NULL;
+  }
+  do {  /* Receive the responses before it, and then it. */
+    head = hp->queue[0];
+    if (!(data = http_receive(yf))) return NULL;
+  } while (head != block);
+  return data;
+}
+
+/* Copies n bytes at offset ofs of the remote file of yf to buf. Returns the
+ * number of bytes copied (less than n only at EOF), or -1 on error.
+ */
+STATIC int http_read(yfile *yf, off_t ofs, char *buf, int n) {
+  const char *data;
+  off_t block;
+  int got = 0, k;
+  for (; got < n && ofs < yf->http->size; got += k, ofs += k) {
+    block = ofs / HTTP_BLOCK_SIZE;
+    if (!(data = http_get_block(yf, block))) return -1;
+    k = (block + 1) * HTTP_BLOCK_SIZE - ofs;
+    if (k > n - got) k = n - got;
+    if (k > yf->http->size - ofs) k = (int)(yf->http->size - ofs);
+    memcpy(buf + got, data + (ofs - block * HTTP_BLOCK_SIZE), k);
+  }
+  return got;
+}
+
+/* Requests the block containing ofs (for flag -P), unless it's already
+ * cached or requested, or too many requests are in flight.
+ */
+STATIC void http_prefetch(yfile *yf, off_t ofs) {
+  struct yhttp *hp = yf->http;
+  const off_t block = ofs / HTTP_BLOCK_SIZE;
+  int j;
+  if (ofs >= hp->size || hp->queue_size == HTTP_MAX_IN_FLIGHT ||
+      yf->err != LBS_OK) {
+    return;
+  }
+  for (j = 0; j < HTTP_CACHE_SIZE && hp->slot_block[j] != block; ++j) {}
+  if (j < HTTP_CACHE_SIZE) return;
+  for (j = 0; j < hp->queue_size && hp->queue[j] != block; ++j) {}
+  if (j < hp->queue_size) return;
+  ++yf->stats.prefetch_count;
+  (void)http_request(yf, block);
+}
+
+STATIC void http_close(yfile *yf) {
+  struct yhttp *hp = yf->http;
+  http_disconnect(hp);
+  free(hp->host);
+  free(hp->req);
+  free(hp->slots);
+  free(hp);
+  yf->http = NULL;
+}
+
+/** Makes yf (just opened by yfopen_fd(yf, -1, 0)) read the remote file of
+ * the http:// URL url. On error, yf->err is set (LBS_ERR_OPEN if the
+ * server can't be connected to).
+ */
+STATIC void yfopen_http(yfile *yf, const char *url) {
+  const char *host = url + 7, *path = host + strcspn(host, "/?");
+  const size_t host_size = path - host;
+  const size_t path_size = *path == '/' ? strlen(path) : strlen(path) + 1;
+  struct yhttp *hp;
+  char *p, *colon;
+  int j;
+  if (!(hp = (struct yhttp*)malloc(sizeof(*hp)))) goto nomem;
+  memset(hp, '\0', sizeof(*hp));
+  yf->http = hp;  /* yfclose frees it. */
+  hp->sock = -1;
+  hp->size = -1;
+  for (j = 0; j < HTTP_CACHE_SIZE; ++j) {
+    hp->slot_block[j] = -1;
+  }
+  if (!(hp->host = p = (char*)malloc(host_size * 2 + path_size + 4)) ||
+      !(hp->req = (char*)malloc(host_size + path_size + 128)) ||
+      !(hp->slots = (char*)malloc(HTTP_CACHE_SIZE * HTTP_BLOCK_SIZE))) {
+    goto nomem;
+  }
+  memcpy(p, host, host_size);
+  p[host_size] = '\0';
+  hp->name = p += host_size + 1;
+  memcpy(p, host, host_size);
+  p[host_size] = '\0';
+  if ((colon = strchr(p, ':')) != NULL) {
+    *colon = '\0';
+    hp->port = colon + 1;
+  } else {
+    hp->port = "80";
+  }
+  hp->path = p += host_size + 1;
+  if (*path != '/') *p++ = '/';  /* E.g. http://host?query */
+  strcpy(p, path);
+  yf->read_at = http_read;
+  if (has_suffix(hp->path, ".gz") || has_suffix(hp->path, ".bgz")) {
+    yfseterr(yf, LBS_ERR_FORMAT);  /* BGZF is not read over HTTP. */
+    yf->size = 0;
+    return;
+  }
+  if (!http_connect(yf) || !http_request(yf, 0) || !http_receive(yf)) {
+    yf->size = 0;
+    return;
+  }
+  yf->size = hp->size;
+  return;
+ nomem:
+  yfseterr(yf, LBS_ERR_NOMEM);
+}
+
+#endif  /* HAVE_HTTP */
+
+/** Constructor. Initializes yf to read from fd, which is owned by yf
+ * afterwards. If size != (off_t)-1, then it will be imposed as a limit.
+ */
+STATIC void yfopen_fd(yfile *yf, int fd, off_t size) {
+  yf->rbuf = yf->rbuf_default;
+  yf->rbuf_alloc = NULL;
+  yf->block_size = YF_READ_BUF_SIZE;
+  yf->is_direct = 0;
+  yf->prefetch_depth = 0;
+  yf->is_interpolated = 0;
+  yf->is_block_aligned = 0;
+  yf->lcache = NULL;
+  yf->lbofs = NULL;
+  yf->bgzf = NULL;
+  yf->http = NULL;
+  yf->read_at = NULL;
+  yf->keyspec = NULL;
+  yf->kbuf = NULL;
+  yf->kbuf_alloc = 0;
+  yf->err = LBS_OK;
+  yf->err_errno = 0;
+  if (size == -1) {
+    size = lseek(fd, 0, SEEK_END);
+    if (size + 1ULL == 0ULL) {
+      yfseterr(yf, errno == ESPIPE ? LBS_ERR_NOT_SEEKABLE : LBS_ERR_LSEEK);
+      size = 0;
+    }
+  }
+  yf->p = yf->rend = yf->rbuf + yf->block_size + 1;
+  *yf->p = '\0';
+  yf->p[-1] = '\0';
+  yf->fd = fd;
+  yf->size = size;
+  yf->ofs = -(yf->block_size + 1);  /* So yftell(f) would return 0. */
+  yf->map = NULL;
+  yf->map_size = 0;
+  memset(&yf->stats, 0, sizeof(yf->stats));
+}
+
+/** Constructor. Opens and initializes yf.
+ * If size != (off_t)-1, then it will be imposed as a limit. On error, yf is
+ * still initialized (as an empty file), and yf->err is set.
+ */
+STATIC void yfopen(yfile *yf, const char *pathname, off_t size) {
+  int fd;
+#ifdef HAVE_HTTP
+  if (0 == strncmp(pathname, "http://", 7)) {
+    yfopen_fd(yf, -1, 0);
+    yfopen_http(yf, pathname);
+    return;
+  }
+#endif
+  /* O_RANDOM: bisection reads blocks all over the file. */
+  fd = open(pathname, O_RDONLY | O_BINARY | O_RANDOM, 0);
+  yfopen_fd(yf, fd, fd < 0 ? 0 : size);
+  if (fd < 0) {
+    yfseterr(yf, LBS_ERR_OPEN);
+  } else {
+    yfopen_bgzf(yf, pathname);
+  }
+}
+
+#define YF_MIN_BLOCK_SIZE 512
+#define YF_MAX_BLOCK_SIZE (1 << 26)
+#define YF_DIRECT_ALIGN 4096  /* Enough for O_DIRECT on Linux. */
+
+/** Changes the read block size of yf (opened by yfopen, but not read yet)
+ * to block_size, which must be a power of 2 between YF_MIN_BLOCK_SIZE and
+ * YF_MAX_BLOCK_SIZE. If is_direct is true, enables O_DIRECT (F_NOCACHE on
+ * macOS), so that reads bypass the page cache: for that the buffer is
+ * aligned, and only full blocks (at least YF_DIRECT_ALIGN bytes) are read.
+ * Returns false if is_direct was requested, but O_DIRECT is not supported.
+ * Sets yf->err to LBS_ERR_NOMEM (and keeps the old buffer) if out of memory.
+ */
+STATIC ybool yfsetbuf(yfile *yf, int block_size, ybool is_direct) {
+  const ybool is_direct_requested = is_direct;
+  char *rbuf_alloc;
+  assert(yf->fd < 0 || yf->p == yf->rbuf + yf->block_size + 1);
+  assert((block_size & (block_size - 1)) == 0);
+  assert(block_size >= YF_MIN_BLOCK_SIZE && block_size <= YF_MAX_BLOCK_SIZE);
+  if (is_direct && (yf->read_at || yf->fd < 0)) {
+    is_direct = 0;  /* The file is not read with read(2). */
+  } else if (is_direct) {
+#if defined(O_DIRECT) && defined(F_GETFL) && defined(F_SETFL)
+    const int flags = fcntl(yf->fd, F_GETFL);
+    if (flags == -1 || fcntl(yf->fd, F_SETFL, flags | O_DIRECT) != 0) {
+      is_direct = 0;
+    }
+#elif defined(F_NOCACHE)
+    if (fcntl(yf->fd, F_NOCACHE, 1) != 0) is_direct = 0;
+#else
+    is_direct = 0;
+#endif
+    if (block_size < YF_DIRECT_ALIGN) block_size = YF_DIRECT_ALIGN;
+  }
+  if (block_size == yf->block_size && !is_direct) {
+    return is_direct == is_direct_requested;
+  }
+  if (!(rbuf_alloc = (char*)malloc(block_size + 2 + YF_DIRECT_ALIGN))) {
+    yfseterr(yf, LBS_ERR_NOMEM);  /* Sticky, so nothing will be read. */
+    return is_direct == is_direct_requested;
+  }
+  yf->is_direct = is_direct;
+  if (yf->rbuf_alloc) free(yf->rbuf_alloc);
+  yf->rbuf_alloc = rbuf_alloc;
+  /* Align to YF_DIRECT_ALIGN. */
+  yf->rbuf = rbuf_alloc +
+      (YF_DIRECT_ALIGN - (size_t)rbuf_alloc % YF_DIRECT_ALIGN) %
+      YF_DIRECT_ALIGN;
+  yf->block_size = block_size;
+  yf->p = yf->rend = yf->rbuf + block_size + 1;
+  *yf->p = '\0';
+  yf->p[-1] = '\0';
+  yf->ofs = -(block_size + 1);  /* So yftell(f) would return 0. */
+  return is_direct == is_direct_requested;
+}
+
+/** Tries to mmap(2) the entire file opened by yfopen. Returns true on
+ * success. On failure (e.g. for pipes, empty files, if the file doesn't fit
+ * to the address space, or if mmap(2) is not available) it returns false,
+ * and yf keeps using read(2).
+ *
+ * The mapping is private and writable, so that yflimit can maintain the
+ * invariant *yf->rend == '\0' (modified pages are copied, the file is never
+ * written). The page after the end is zero-filled anonymous memory, so
+ * map[size] is always readable. If the file gets truncated while mapped, the
+ * process may receive SIGBUS.
+ *
+ * On Win32 the file is mapped with CreateFileMapping and MapViewOfFile
+ * (copy-on-write), and the zero-filled rest of the last page provides
+ * map[size], so files of a multiple of the page size are not mapped.
+ */
+STATIC ybool yfmap(yfile *yf) {
+#ifdef YF_HAVE_MMAP
+  const long page_size = sysconf(_SC_PAGESIZE);
+  const off_t size = yf->size;
+  size_t map_size;
+  char *map;
+  if (yf->map) return 1;
+  if (yf->fd < 0 || yf->read_at || size <= 0 || page_size <= 0 ||
+      (off_t)(size_t)size != size ||
+      (map_size = ((size_t)size + page_size) & -(size_t)page_size) <=
+      (size_t)size) {
+    return 0;
+  }
+  /* Reserve the address range with a trailing zero page, then map the
+   * file over the beginning of it.
+   */
+  map = (char*)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == (char*)MAP_FAILED) return 0;
+  if ((char*)mmap(map, (size_t)size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_FIXED, yf->fd, 0) != map) {
+    munmap(map, map_size);
+    return 0;
+  }
+  yf->map = map;
+  yf->map_size = map_size;
+  yf->ofs = 0;
+  yf->p = map;
+  yf->rend = map + size;
+  return 1;
+#else
+#ifdef HAVE_WIN32_MAP
+  const off_t size = yf->size;
+  SYSTEM_INFO si;
+  HANDLE fh, mh;
+  char *map;
+  if (yf->map) return 1;
+  GetSystemInfo(&si);
+  if (yf->fd < 0 || yf->read_at || size <= 0 ||
+      (off_t)(size_t)size != size || (size_t)size % si.dwPageSize == 0 ||
+      (fh = (HANDLE)_get_osfhandle(yf->fd)) == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  /* Maximum size 0 means the current file size. */
+  if (!(mh = CreateFileMapping(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL))) {
+    return 0;
+  }
+  map = (char*)MapViewOfFile(mh, FILE_MAP_COPY, 0, 0, (size_t)size);
+  CloseHandle(mh);  /* The view keeps the mapping object alive. */
+  if (!map) return 0;
+  yf->map = map;
+  yf->map_size = (size_t)size;
+  yf->ofs = 0;
+  yf->p = map;
+  yf->rend = map + size;
+  return 1;
+#else
+  (void)yf;
+  return 0;
+#endif
+#endif
+}
+
+/** Tells the kernel about the upcoming access pattern of the mmap(2)ed
+ * file: random (is_sequential = false) for bisection, sequential for
+ * print_range. No-op if the file is not mmap(2)ed.
+ */
+STATIC void yfadvise(yfile *yf, ybool is_sequential) {
+#if defined(YF_HAVE_MMAP) && defined(MADV_RANDOM) && defined(MADV_SEQUENTIAL)
+  if (yf->map) {
+    (void)madvise(yf->map, yf->map_size,
+                  is_sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+  }
+#else
+  (void)yf; (void)is_sequential;
+#endif
+}
+
+STATIC void yfclose(yfile *yf) {
+#ifdef YF_HAVE_MMAP
+  if (yf->map) {
+    munmap(yf->map, yf->map_size);
+    yf->map = NULL;
+    yf->map_size = 0;
+  }
+#endif
+#ifdef HAVE_WIN32_MAP
+  if (yf->map) {
+    UnmapViewOfFile(yf->map);
+    yf->map = NULL;
+    yf->map_size = 0;
+  }
+#endif
+#ifdef HAVE_ZLIB
+  if (yf->bgzf) bgzf_close(yf);
+#endif
+#ifdef HAVE_HTTP
+  if (yf->http) http_close(yf);
+#endif
+  if (yf->fd >= 0) {
+    close(yf->fd);
+    yf->fd = -1;
+  }
+  if (yf->lcache) {
+    free(yf->lcache);
+    yf->lcache = NULL;
+  }
+  if (yf->kbuf) {
+    free(yf->kbuf);
+    yf->kbuf = NULL;
+    yf->kbuf_alloc = 0;
+  }
+  if (yf->lbofs) {
+    yfclose(&yf->lbofs->yf);
+    free(yf->lbofs);
+    yf->lbofs = NULL;
+  }
+  if (yf->rbuf_alloc) {
+    free(yf->rbuf_alloc);
+    yf->rbuf_alloc = NULL;
+    yf->rbuf = yf->rbuf_default;
+    yf->block_size = YF_READ_BUF_SIZE;
+    *(yf->rbuf + yf->block_size) = '\0';
+  }
+  yf->p = yf->rend = yf->rbuf + yf->block_size + 1;
+  yf->size = 0;
+  yf->ofs = -(yf->block_size + 1);  /* So yftell(f) would return 0. */
+}
+
+#if 0
+/* Constructor. Opens a file which always returns EOF. */
+STATIC void yfopen_devnull(yfile *yf) {
+  yf->fd = -1;
+  yfclose(yf);
+  *yf->p = '\0';
+  yf->p[-1] = '\0';
+}
+#endif
+
+STATIC off_t yfgetsize(yfile *yf) {
+  return yf->size;
+}
+
+#if 0
+STATIC off_t yftell(yfile *yf) {
+  return yf->p - yf->rbuf + yf->ofs;
+}
+#endif
+
+STATIC off_t yflimit(yfile *yf, off_t size) {
+  off_t ofs;
+  if (size + 0ULL < yf->size + 0ULL) {
+    yf->size = size;
+    if (yf->map) {
+      yf->rend = yf->map + size;
+      *yf->rend = '\0';  /* Copy-on-write, doesn't change the file. */
+      if (yf->p > yf->rend) yf->p = yf->rend;
+      return size;
+    }
+    /* Fix up yf->p and yf->rend if they are too large. */
+    if (yf->rend - yf->rbuf + yf->ofs + 0ULL > yf->size + 0ULL &&
+        yf->p != yf->rbuf + yf->block_size + 1) {
+      if (yf->p - yf->rbuf + yf->ofs + 0ULL > yf->size + 0ULL) {
+        /* TODO(pts): Do it without dropping all the caches. */
+        ofs = yf->p - yf->rbuf + yf->ofs;
+        yf->p = yf->rend = yf->rbuf + yf->block_size + 1;
+        yf->ofs = ofs - (yf->block_size + 1);
+      } else {
+        yf->rend = yf->size - yf->ofs + yf->rbuf;  /* Make it smaller. */
+        *yf->rend = '\0';
+      }
+    }
+  }
+  return yf->size;
+}
+
+#ifndef PTS_LBSEARCH_NO_MAIN
+/** Extends the size of yf (not mmap(2)ed) to size, after the file has been
+ * appended to (flag -f).
+ */
+STATIC void yfgrow(yfile *yf, off_t size) {
+  char * const rbuf1 = yf->rbuf + yf->block_size + 1;
+  off_t ofs;
+  assert(!yf->map);
+  if (size <= yf->size) return;
+  yf->size = size;
+  if (yf->p != rbuf1 && yf->rend - yf->rbuf < yf->block_size) {
+    /* The last block was short, it will be read again with the new data. */
+    ofs = yf->p - yf->rbuf + yf->ofs;
+    yf->p = yf->rend = rbuf1;
+    yf->ofs = ofs - (yf->block_size + 1);
+  }
+}
+#endif
+
+/* It's possible to seek beyond the file size. */
+STATIC void yfseek_set(yfile *yf, off_t ofs) {
+  char * const rbuf1 = yf->rbuf + yf->block_size + 1;
+  assert(ofs >= 0);
+  if (yf->map) {  /* Seeking beyond EOF is the same as seeking to EOF. */
+    yf->p = ofs + 0ULL < yf->size + 0ULL ? yf->map + ofs : yf->rend;
+    return;
+  }
+  /* TODO(pts): Convert off_t to its unsigned equivalent? + 0U doesn't seem to
+   * make a difference. + 0ULL seems to solve it.
+   */
+  if (yf->p != rbuf1 && ofs - yf->ofs + 0ULL <= yf->rend - yf->rbuf + 0ULL) {
+    yf->p = ofs - yf->ofs + yf->rbuf;
+  } else {  /* Forget about the cached read buffer. */
+    yf->p = yf->rend = rbuf1;
+    yf->ofs = ofs - (yf->block_size + 1);
+  }
+}
+
+STATIC void yfseek_cur(yfile *yf, off_t ofs) {
+  if (ofs + 0ULL <= yf->rend - yf->p + 0ULL) {  /* Shortcut for ofs >= 0. */
+    yf->p += ofs;
+  } else if (yf->map) {
+    yf->p = yf->rend;  /* Seeking beyond EOF. */
+  } else {
+    yfseek_set(yf, yf->p - yf->rbuf + yf->ofs + ofs);
+  }
+}
+
+/** Fast macro for yfgetc. */
+#define YFGETCHAR(yf) (*(yf)->p == '\0' ? yfgetc(yf) : \
+    (int)*(unsigned char*)(yf)->p++)
+
+/** Can only be called after a getchar returning non-EOF. */
+#define YFUNGET(yf) ((void)--(yf)->p)
+
+/** Records err, and drops the read buffer (which may be inconsistent with
+ * yf->ofs now). Returns -1 (EOF).
+ */
+STATIC int yfgetc_error(yfile *yf, int err) {
+  yfseterr(yf, err);
+  yf->p = yf->rend = yf->rbuf + yf->block_size + 1;
+  return -1;
+}
+
+/** Makes the got bytes just read to yf->rbuf from offset b (a multiple of
+ * yf->block_size) the read buffer, without changing yf->p. Returns the
+ * offset after the last byte.
+ */
+STATIC off_t yfsetblock(yfile *yf, off_t b, int got) {
+  const int need = b + yf->block_size + 0ULL > yf->size + 0ULL ?
+      yf->size - b : yf->block_size;
+  if (!yf->read_at) {  /* yf->read_at counts its own reads. */
+    if (yf->fd >= 0) ++yf->stats.read_count;
+    yf->stats.read_bytes += got;
+  }
+  if (got > need) got = need;
+  yf->ofs = b;
+  *(yf->rend = yf->rbuf + got) = '\0';
+  b += got;
+  if (got < need && b + 0ULL < yf->size + 0ULL) {
+    yf->size = b;
+  }
+  return b;
+}
+
+/** Returns -1 on EOF (or error, see yf->err), or 0..255. */
+STATIC int yfgetc(yfile *yf) {
+  if (yf->p == yf->rend) {
+    off_t a, b;
+    int got, need;
+    if (yf->map || yf->err != LBS_OK) return -1;  /* EOF. */
+    a = yf->p - yf->rbuf + yf->ofs;  /* a = yftell(yf); */
+    if (a + 0ULL >= yf->size + 0ULL) return -1;  /* EOF. */
+    /* yf->block_size must be a power of 2 for this below. */
+    b = a & -(off_t)yf->block_size;
+    yf->p = a - b + yf->rbuf;
+    if (yf->ofs != b && !yf->read_at) {
+      ++yf->stats.lseek_count;
+      a = lseek(yf->fd, b, SEEK_SET);
+      if (a + 1ULL == 0ULL) {
+        return yfgetc_error(
+            yf, errno == ESPIPE ? LBS_ERR_NOT_SEEKABLE : LBS_ERR_LSEEK);
+      }
+      if (a != b) return yfgetc_error(yf, LBS_ERR_LSEEK);  /* Can't happen. */
+      yf->ofs = b;
+    }
+    need = b + yf->block_size + 0ULL > yf->size + 0ULL ?
+        yf->size - b : yf->block_size;
+    /* O_DIRECT needs aligned size, so we read more, and ignore the rest. */
+    got = yf->read_at ? yf->read_at(yf, b, yf->rbuf, need) :
+        yf->fd < 0 ? 0 :
+        read(yf->fd, yf->rbuf, yf->is_direct ? yf->block_size : need);
+    if (got < 0) return yfgetc_error(yf, LBS_ERR_READ);
+    b = yfsetblock(yf, b, got);
+    if (b + 0ULL <= a + 0ULL) {  /* yf->p is past the buffer. */
+      yf->p = yf->rend;
+      return -1;  /* EOF. */
+    }
+  }
+  return *(unsigned char*)yf->p++;
+}
+
+/* If len <= 0 or at EOF, just returns 0. Otherwise, it makes sure that the
+ * read buffer of yf contains it least 1 byte available (by calling
+ * yfgetc(yf) if needed), and returns min(available, len), thus the return
+ * value is at least 1. Also sets *buf_out so that (*buf_out[:result]) is
+ * the next available bytes with the read buffer. It doesn't skip over these
+ * bytes though, the caller can do it by yfseek_cur(yf, result) later.
+ */
+STATIC int yfpeek(yfile *yf, off_t len, const char **buf_out) {
+  int available;
+  if (len <= 0) return 0;
+  /* This fits to an int, except for yf->map. */
+  available = yf->map && yf->rend - yf->p > 0x40000000 ?
+      0x40000000 : yf->rend - yf->p;
+  if (available <= 0 && yfgetc(yf) >= 0) {
+    --yf->p;  /* YFUNGET(yf). */
+    available = yf->rend - yf->p;
+  }
+  *buf_out = yf->p;
+  return len + 0ULL > available + 0ULL ? available : (int)len;
+}
+
+/** Returns true iff reading the byte at ofs from yf wouldn't cause a
+ * read(2): it's in the read buffer (or yf is mmap(2)ed), or it's at EOF, or
+ * there was an error.
+ */
+STATIC ybool yfhas(const yfile *yf, off_t ofs) {
+  return yf->map || yf->err != LBS_OK || ofs + 0ULL >= yf->size + 0ULL ||
+      (yf->p != yf->rbuf + yf->block_size + 1 && ofs >= yf->ofs &&
+       ofs - yf->ofs < yf->rend - yf->rbuf);
+}
+
+/** Tells the kernel that get_fofs will soon be called for ofs, so that it
+ * can start reading the block in the background (flag -P). The page cache
+ * is shared, so this also helps if yf is mmap(2)ed.
+ */
+STATIC void yfprefetch(yfile *yf, off_t ofs) {
+#ifdef POSIX_FADV_WILLNEED
+  if (ofs != 0) --ofs;  /* get_fofs starts reading at ofs - 1. */
+#ifdef HAVE_HTTP
+  if (yf->http) {
+    if (!yfhas(yf, ofs)) http_prefetch(yf, ofs);
+    return;
+  }
+#endif
+  /* No page cache for yf, or the offsets are not file offsets. */
+  if (yf->is_direct || yf->read_at) return;
+  /* yfhas is always true if yf is mmap(2)ed, but the page may be missing. */
+  if (yf->map ? ofs + 0ULL >= yf->size + 0ULL : yfhas(yf, ofs)) return;
+  ofs &= -(off_t)yf->block_size;
+  ++yf->stats.prefetch_count;
+  (void)posix_fadvise(yf->fd, ofs, yf->block_size, POSIX_FADV_WILLNEED);
+#else
+  (void)yf; (void)ofs;
+#endif
+}
+
+/* --- Bisection (binary search)
+ *
+ * The algorithms and data structures below are complex, tricky, and very
+ * underdocumented. See (ARTICLE) above for a detailed explanation of both
+ * design and implementation.
+ */
+
+/* Returns the file offset of the line starting at ofs, or if no line
+ * starts their, then the the offset of the next line.
+ */
+STATIC off_t get_fofs(yfile *yf, off_t ofs) {
+  int n;
+  off_t size;
+  const char *buf, *q;
+  assert(ofs >= 0);
+  if (ofs == 0) return 0;
+  size = yfgetsize(yf);
+  if (ofs > size) return size;
+  --ofs;
+  yfseek_set(yf, ofs);
+  /* Scan the read buffer with memchr(3) (usually vectorized in libc)
+   * rather than byte-by-byte with YFGETCHAR.
+   */
+  for (;;) {
+    if ((n = yfpeek(yf, size - ofs, &buf)) <= 0) {  /* EOF. */
+      return yf->err != LBS_OK ? size : ofs;  /* Pretend EOF after error. */
+    }
+    if ((q = (const char*)memchr(buf, '\n', n)) != NULL) n = q - buf + 1;
+    yfseek_cur(yf, n);
+    ofs += n;
+    yf->stats.scan_bytes += n;
+    if (q) return ofs;
+  }
+}
+
+typedef enum compare_mode_t {
+  CM_LE,  /* True iff x <= y (where y is read from the file). */
+  CM_LT,  /* True iff x < y. */
+  CM_LP,  /* x* < y, where x* is x + a fake byte 256 and the end. */
+  CM_UNSET,  /* Not set yet. Most functions do not support it. */
+} compare_mode_t;
+
+STATIC ybool compare_line_keyspec(yfile *yf, off_t fofs,
+                                  const char *x, size_t xsize,
+                                  compare_mode_t cm);
+
+/* Compares x[:xsize] with a line read from yf. */
+STATIC ybool compare_line(yfile *yf, off_t fofs,
+                          const char *x, size_t xsize, compare_mode_t cm) {
+  int c, n, d;
+  const char *buf, *q;
+  if (yf->keyspec) return compare_line_keyspec(yf, fofs, x, xsize, cm);
+  yfseek_set(yf, fofs);
+  c = YFGETCHAR(yf);
+  if (c < 0) return 1;  /* Special casing of EOF at BOL. */
+  YFUNGET(yf);
+  /* Compare the line span-by-span in the read buffer with memchr(3) and
+   * memcmp(3), which are usually vectorized in libc.
+   */
+  for (;;) {
+    n = yfpeek(yf, xsize == 0 ? 1 : xsize, &buf);
+    if (n <= 0) {  /* EOF. */
+      return cm == CM_LE ? xsize == 0 : 0;
+    } else if (xsize == 0) {
+      return *buf == '\n' ? cm == CM_LE : cm != CM_LP;
+    }
+    if ((q = (const char*)memchr(buf, '\n', n)) != NULL) n = q - buf;
+    if (n != 0 && (d = memcmp(x, buf, n)) != 0) return d < 0;
+    if (q) return 0;  /* The line is a proper prefix of x. */
+    yfseek_cur(yf, n);
+    x += n;
+    xsize -= n;
+  }
+}
+
+/* Same as compare_line, but with the line line[:line_size] in memory. */
+STATIC ybool compare_key(const char *x, size_t xsize,
+                         const char *line, size_t line_size,
+                         compare_mode_t cm) {
+  const int d = memcmp(x, line, xsize < line_size ? xsize : line_size);
+  if (d != 0) return d < 0;
+  if (xsize < line_size) return cm != CM_LP;  /* x is a prefix of line. */
+  return xsize == line_size ? cm == CM_LE : 0;
+}
+
+/* --- Key fields and numeric keys (flags -k, -T, -w and -g)
+ *
+ * By default, x is compared with entire lines, bytewise. With a keyspec,
+ * it's compared with the key of each line instead: field <n> (with -k<n>,
+ * separated by Tab, or by the byte after -T), like sort -t SEP -k<n>,<n>,
+ * or the entire line; only its first <n> bytes with -w<n> (fixed-width
+ * keys); and with -g as decimal numbers (leading blanks, optional '-',
+ * digits, optional '.' and fraction digits, no number is 0), like sort -n
+ * with LC_ALL=C. Lines with equal keys are equal in the search (so -e and
+ * -t find the range of a key), and with -p the key (not the line) must
+ * start with x. -p and -g are not used together.
+ *
+ * compare_line calls compare_line_keyspec only once per line, which copies
+ * the key to yf->kbuf with memchr(3) (skipping the other fields, and
+ * stopping at the end of the key, e.g. at the first non-number byte with
+ * -g), and then it's compared by compare_key or compare_numbers, so
+ * comparing an entire line doesn't check the mode at each byte.
+ */
+
+struct keyspec {
+  int field;  /* 1-based field number (flag -k<n>), or 0 for the line. */
+  char sep;  /* Field separator (flag -T<c>), '\t' by default. */
+  size_t width;  /* Only the first width bytes (flag -w<n>), or 0. */
+  ybool is_numeric;  /* Flag -g. */
+};
+
+/* Returns the length of the number at the start of p[:size] (with the
+ * leading blanks, see above), and sets *is_neg_out, *int_out and
+ * *int_size_out to its integer digits without leading zeros, and
+ * *frac_out and *frac_size_out to its fraction digits without trailing
+ * zeros.
+ */
+STATIC size_t parse_number(const char *p, size_t size, ybool *is_neg_out,
+                           const char **int_out, size_t *int_size_out,
+                           const char **frac_out, size_t *frac_size_out) {
+  const char *q = p, *pend = p + size, *r;
+  ybool is_neg = 0;
+  for (; q != pend && (*q == ' ' || *q == '\t'); ++q) {}
+  if (q != pend && *q == '-') {
+    is_neg = 1;
+    ++q;
+  }
+  for (; q != pend && *q == '0'; ++q) {}
+  for (*int_out = r = q; q != pend && *q >= '0' && *q <= '9'; ++q) {}
+  *int_size_out = q - r;
+  *frac_out = q;
+  *frac_size_out = 0;
+  if (q != pend && *q == '.') {
+    for (*frac_out = r = ++q; q != pend && *q >= '0' && *q <= '9'; ++q) {}
+    for (r = q; r != *frac_out && r[-1] == '0'; --r) {}
+    *frac_size_out = r - *frac_out;
+  }
+  /* -0 is 0. */
+  *is_neg_out = is_neg && (*int_size_out != 0 || *frac_size_out != 0);
+  return q - p;
+}
+
+/* Compares the numbers at the start of a[:asize] and b[:bsize]. Returns
+ * negative, 0 or positive, like memcmp.
+ */
+STATIC int compare_numbers(const char *a, size_t asize,
+                           const char *b, size_t bsize) {
+  const char *ai, *af, *bi, *bf;
+  size_t ais, afs, bis, bfs;
+  ybool is_aneg, is_bneg;
+  int d;
+  (void)parse_number(a, asize, &is_aneg, &ai, &ais, &af, &afs);
+  (void)parse_number(b, bsize, &is_bneg, &bi, &bis, &bf, &bfs);
+  if (is_aneg != is_bneg) return is_aneg ? -1 : 1;
+  if (ais != bis) {
+    d = ais < bis ? -1 : 1;
+  } else if ((d = memcmp(ai, bi, ais)) == 0 &&
+             (d = memcmp(af, bf, afs < bfs ? afs : bfs)) == 0) {
+    d = afs < bfs ? -1 : afs > bfs;
+  }
+  return is_aneg ? -d : d;
+}
+
+/* Same as compare_key, but compares x with the key line[:line_size] by ks
+ * (may be NULL for entire lines).
+ */
+STATIC ybool compare_key_keyspec(const struct keyspec *ks,
+                                 const char *x, size_t xsize,
+                                 const char *key, size_t key_size,
+                                 compare_mode_t cm) {
+  int d;
+  if (ks) {
+    if (ks->width != 0 && xsize > ks->width) xsize = ks->width;
+    if (ks->width != 0 && key_size > ks->width) key_size = ks->width;
+    if (ks->is_numeric) {
+      d = compare_numbers(x, xsize, key, key_size);
+      return cm == CM_LE ? d <= 0 : d < 0;
+    }
+  }
+  return compare_key(x, xsize, key, key_size, cm);
+}
+
+/* Appends buf[:n] to yf->kbuf[:*size_io]. Returns false on out of memory. */
+STATIC ybool yfappend_key(yfile *yf, const char *buf, size_t n,
+                          size_t *size_io) {
+  char *new_kbuf;
+  size_t alloc = yf->kbuf_alloc;
+  if (n == 0) return 1;  /* yf->kbuf may be NULL. */
+  if (alloc - *size_io < n) {
+    while ((alloc = alloc ? alloc << 1 : 64) - *size_io < n) {}
+    if (!(new_kbuf = (char*)realloc(yf->kbuf, alloc))) {
+      yfseterr(yf, LBS_ERR_NOMEM);
+      return 0;
+    }
+    yf->kbuf = new_kbuf;
+    yf->kbuf_alloc = alloc;
+  }
+  memcpy(yf->kbuf + *size_io, buf, n);
+  *size_io += n;
+  return 1;
+}
+
+/* Returns the size of the part of buf[:n] which can still be in the key of
+ * ks, which is already key_size bytes long.
+ */
+STATIC size_t get_key_span(const struct keyspec *ks, const char *buf,
+                           size_t n, size_t key_size) {
+  const char *q;
+  if (ks->width != 0 && n > ks->width - key_size) n = ks->width - key_size;
+  if (ks->field != 0 && (q = (const char*)memchr(buf, ks->sep, n)) != NULL) {
+    n = q - buf;
+  }
+  if (ks->is_numeric) {  /* Stop after the number. */
+    for (q = buf; q != buf + n && ((*q >= '0' && *q <= '9') || *q == '-' ||
+                                   *q == '.' || *q == ' ' || *q == '\t');
+         ++q) {}
+    n = q - buf;
+  }
+  return n;
+}
+
+/* Compares x[:xsize] with the key (by yf->keyspec) of the line at fofs. */
+STATIC ybool compare_line_keyspec(yfile *yf, off_t fofs,
+                                  const char *x, size_t xsize,
+                                  compare_mode_t cm) {
+  const struct keyspec *ks = yf->keyspec;
+  int fields_to_skip = ks->field > 1 ? ks->field - 1 : 0;
+  int n, m;
+  size_t key_size = 0;
+  const char *buf, *q;
+  ybool is_done = 0;
+  yfseek_set(yf, fofs);
+  if (YFGETCHAR(yf) < 0) return 1;  /* Special casing of EOF at BOL. */
+  YFUNGET(yf);
+  while (!is_done && (n = yfpeek(yf, yfgetsize(yf) - fofs, &buf)) > 0) {
+    if ((q = (const char*)memchr(buf, '\n', n)) != NULL) {
+      n = q - buf;
+      is_done = 1;
+    }
+    yfseek_cur(yf, n);
+    fofs += n;
+    for (; fields_to_skip > 0 && n > 0; --fields_to_skip) {
+      if (!(q = (const char*)memchr(buf, ks->sep, n))) break;
+      n -= q + 1 - buf;
+      buf = q + 1;
+    }
+    if (fields_to_skip > 0) continue;  /* Not at the field yet. */
+    if ((m = get_key_span(ks, buf, n, key_size)) < n) is_done = 1;
+    if (!yfappend_key(yf, buf, m, &key_size)) return 1;
+  }
+  /* kbuf is still NULL if all keys were empty so far. */
+  return compare_key_keyspec(ks, x, xsize, yf->kbuf ? yf->kbuf : "",
+                             key_size, cm);
+}
+
+/* Returns the key (by ks, may be NULL) of line[:line_size] in memory, and
+ * sets *key_size_out to its size.
+ */
+STATIC const char *get_line_key(const struct keyspec *ks, const char *line,
+                                size_t line_size, size_t *key_size_out) {
+  int fields_to_skip;
+  const char *q;
+  if (!ks) {
+    *key_size_out = line_size;
+    return line;
+  }
+  for (fields_to_skip = ks->field - 1; fields_to_skip > 0; --fields_to_skip) {
+    if (!(q = (const char*)memchr(line, ks->sep, line_size))) {
+      line += line_size;  /* Missing field, the key is empty. */
+      line_size = 0;
+      break;
+    }
+    line_size -= q + 1 - line;
+    line = q + 1;
+  }
+  *key_size_out = get_key_span(ks, line, line_size, 0);
+  return line;
+}
+
+/* --- Line cache (flag -C)
+ *
+ * The line cache of a yfile remembers the start offset and the first
+ * LCACHE_KEY_SIZE bytes of the last few lines found by the bisection, and
+ * it survives across searches and queries (unlike struct cache, whose
+ * cmp_result is valid only for a single x and cm). get_using_cache uses it
+ * to find the start of a line, and to compare the line with x if its
+ * prefix decides it, without reading the file. This helps if the same
+ * top-of-tree lines are read by many queries, e.g. in batch mode, or with
+ * the library; bisect_mid snaps the probes to a grid to make them the
+ * same. The least recently used entry is replaced.
+ */
+
+#define LCACHE_MAX_SIZE 64
+#define LCACHE_KEY_SIZE 32
+
+struct lcache {
+  int capacity;  /* At most LCACHE_MAX_SIZE. */
+  int count;
+  off_t clock;  /* Incremented on each use. */
+  /* A line starts at fofs[i], and no line starts in [ofs[i], fofs[i]).
+   * key[i][:key_size[i]] is the prefix of that line, and is_complete[i]
+   * means that it's the entire line (without the '\n').
+   */
+  off_t ofs[LCACHE_MAX_SIZE];
+  off_t fofs[LCACHE_MAX_SIZE];
+  off_t used[LCACHE_MAX_SIZE];  /* Value of clock at the last use. */
+  unsigned char key_size[LCACHE_MAX_SIZE];
+  ybool is_complete[LCACHE_MAX_SIZE];
+  char key[LCACHE_MAX_SIZE][LCACHE_KEY_SIZE];
+};
+
+/** Enables the line cache of yf (opened by yfopen, but not read yet) with
+ * capacity entries.
+ */
+STATIC void yfsetlcache(yfile *yf, int capacity) {
+  struct lcache *lc;
+  assert(capacity > 0 && capacity <= LCACHE_MAX_SIZE);
+  assert(!yf->lcache);
+  if (!(lc = (struct lcache*)malloc(sizeof(*lc)))) {
+    yfseterr(yf, LBS_ERR_NOMEM);
+    return;
+  }
+  lc->capacity = capacity;
+  lc->count = 0;
+  lc->clock = 0;
+  yf->lcache = lc;
+}
+
+/* Adds the line starting at fofs (>= ofs) to the line cache of yf, and
+ * returns the index of its entry, or -1 at EOF. Called right after
+ * get_fofs, so the prefix is usually in the read buffer.
+ */
+STATIC int lcache_add(yfile *yf, off_t ofs, off_t fofs) {
+  struct lcache *lc = yf->lcache;
+  const char *buf, *q;
+  int i, j, n;
+  if (fofs >= yfgetsize(yf)) return -1;  /* Special casing of EOF at BOL. */
+  for (i = 0; i < lc->count && lc->fofs[i] != fofs; ++i) {}
+  if (i < lc->count) {  /* Already cached, found from a larger ofs. */
+    lc->ofs[i] = ofs;
+    lc->used[i] = ++lc->clock;
+    return i;
+  }
+  yfseek_set(yf, fofs);
+  if ((n = yfpeek(yf, LCACHE_KEY_SIZE, &buf)) <= 0) return -1;
+  if (lc->count < lc->capacity) {
+    i = lc->count++;
+  } else {
+    for (i = 0, j = 1; j < lc->count; ++j) {
+      if (lc->used[j] < lc->used[i]) i = j;
+    }
+  }
+  if ((q = (const char*)memchr(buf, '\n', n)) != NULL) n = q - buf;
+  lc->ofs[i] = ofs;
+  lc->fofs[i] = fofs;
+  lc->used[i] = ++lc->clock;
+  lc->key_size[i] = n;
+  lc->is_complete[i] = q != NULL || fofs + n >= yfgetsize(yf);
+  memcpy(lc->key[i], buf, n);
+  return i;
+}
+
+/* Same as get_fofs, but uses the line cache of yf (if any). Sets *i_out to
+ * the index of the entry of the line in the line cache, or -1.
+ */
+STATIC off_t get_fofs_lcache(yfile *yf, off_t ofs, int *i_out) {
+  struct lcache *lc = yf->lcache;
+  off_t fofs;
+  int i;
+  if (!lc) {
+    *i_out = -1;
+    return get_fofs(yf, ofs);
+  }
+  for (i = 0; i < lc->count; ++i) {
+    if (lc->ofs[i] <= ofs && ofs <= lc->fofs[i]) {
+      ++yf->stats.lcache_hit_count;
+      lc->used[i] = ++lc->clock;
+      *i_out = i;
+      return lc->fofs[i];
+    }
+  }
+  ++yf->stats.lcache_miss_count;
+  fofs = get_fofs(yf, ofs);
+  *i_out = lcache_add(yf, ofs, fofs);
+  return fofs;
+}
+
+/* Same as compare_line, but uses entry i (or -1) of the line cache of yf
+ * if its prefix is enough to decide.
+ */
+STATIC ybool compare_line_lcache(yfile *yf, int i, off_t fofs,
+                                 const char *x, size_t xsize,
+                                 compare_mode_t cm) {
+  const struct lcache *lc = yf->lcache;
+  size_t key_size;
+  int d;
+  if (i >= 0 && !yf->keyspec) {  /* The prefix is not the key. */
+    key_size = lc->key_size[i];
+    if (lc->is_complete[i]) {
+      return compare_key(x, xsize, lc->key[i], key_size, cm);
+    }
+    d = memcmp(x, lc->key[i], xsize < key_size ? xsize : key_size);
+    if (d != 0) return d < 0;
+    if (xsize < key_size) return cm != CM_LP;  /* x is a prefix of line. */
+  }
+  return compare_line(yf, fofs, x, xsize, cm);
+}
+
+struct cache_entry {
+  off_t ofs;
+  off_t fofs;
+  ybool cmp_result;
+};
+
+/* Bounds for the bisection of the end of the interval by the lines read
+ * while bisecting its start (see bisect_interval). Each such line not
+ * smaller than x is also compared to y while it's still in the read buffer.
+ */
+struct end_bounds {
+  const char *y;
+  size_t ysize;
+  compare_mode_t cm;
+  off_t lo;  /* The end is at least lo. */
+  off_t hi;  /* The end is at most hi, or (off_t)-1. */
+  /* Lines starting at limit or later (flag -U) are not used, or (off_t)-1.
+   */
+  off_t limit;
+};
+
+struct cache {
+  struct cache_entry e[2];
+  /* 0: 0,1 are used, 0 is active;
+   * 1: 0,1 are used, 1 is active;
+   * 2: 0 is used and active, 1 is unused;
    * 3: 0,1 are unused.
    */
-  int active;
+  int active;
+  struct end_bounds *eb;  /* NULL, or updated on each line read. */
+};
+
+#define CACHE_HAS_0(a) ((a) != 3)
+#define CACHE_HAS_1(a) ((a) < 2)
+#define CACHE_GET_ACTIVE(a) ((a) & 1)  /* Valid only if CACHE_HAS_0(a). */
+
+/** Can be called again to clear the cache. */
+STATIC void cache_init(struct cache *cache) {
+  cache->active = 3;
+  cache->eb = NULL;
+}
+
+#ifdef HAVE_IO_URING
+/** Returns true iff get_using_cache wouldn't have to read for ofs. */
+STATIC ybool cache_has(const struct cache *cache, off_t ofs) {
+  const int a = cache->active;
+  return (CACHE_HAS_0(a) &&
+          cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) ||
+         (CACHE_HAS_1(a) &&
+          cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs);
+}
+#endif
+
+/* x[:xsize] must not contain '\n'. */
+STATIC const struct cache_entry *get_using_cache(
+    yfile *yf, struct cache *cache, off_t ofs,
+    const char *x, size_t xsize, compare_mode_t cm) {
+  int a = cache->active, i;
+  struct cache_entry *entry;
+  off_t fofs;
+  assert(ofs >= 0);
+  /* TODO(pts): Add tests for efficient and correct cache usage. */
+  /* TODO(pts): Add tests for code coverage. */
+  if (CACHE_HAS_0(a) &&
+      cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) {
+    ++yf->stats.cache_hit_count;
+    if (a == 1) cache->active = a = 0;
+  } else if (CACHE_HAS_1(a) &&
+             cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs) {
+    ++yf->stats.cache_hit_count;
+    if (a == 0) cache->active = a = 1;
+  } else {
+    ++yf->stats.cache_miss_count;
+    fofs = get_fofs_lcache(yf, ofs, &i);
+    assert(ofs <= fofs);
+    if (CACHE_HAS_0(a) && cache->e[0].fofs == fofs) {
+      if (a == 1) cache->active = a = 0;
+      if (cache->e[0].ofs > ofs) cache->e[0].ofs = ofs;
+    } else if (CACHE_HAS_1(a) && cache->e[1].fofs == fofs) {
+      if (a == 0) cache->active = a = 1;
+      if (cache->e[1].ofs > ofs) cache->e[1].ofs = ofs;
+    } else {
+      if (CACHE_HAS_0(a)) {
+        cache->active = a = CACHE_GET_ACTIVE(a) ^ 1;
+        entry = cache->e + a;
+      } else {
+        cache->active = a = 2;
+        entry = cache->e;
+      }
+      /* Fill newly activated cache entry. */
+      entry->fofs = fofs;
+      entry->ofs = ofs;
+      entry->cmp_result = compare_line_lcache(yf, i, fofs, x, xsize, cm);
+      if (cache->eb && entry->cmp_result &&
+          fofs + 0ULL < cache->eb->limit + 0ULL) {
+        struct end_bounds *eb = cache->eb;
+        if (compare_line_lcache(yf, i, fofs, eb->y, eb->ysize, eb->cm)) {
+          if (eb->hi + 0ULL > fofs + 0ULL) eb->hi = fofs;
+        } else if (eb->lo <= fofs) {
+          eb->lo = fofs + 1;  /* The line at fofs is before the end. */
+        }
+      }
+      return entry;  /* Shortcut, the return below would do the same. */
+    }
+  }
+  return cache->e + CACHE_GET_ACTIVE(a);
+}
+
+STATIC off_t get_fofs_using_cache(
+    yfile *yf, struct cache *cache, off_t ofs) {
+  int a = cache->active, i;
+  off_t fofs;
+  assert(ofs >= 0);
+  if (ofs == 0) return 0;
+  if (CACHE_HAS_0(a) &&
+      cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) {
+    ++yf->stats.cache_hit_count;
+    if (a == 1) cache->active = a = 0;
+    return cache->e[0].fofs;
+  } else if (CACHE_HAS_1(a) &&
+             cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs) {
+    ++yf->stats.cache_hit_count;
+    if (a == 0) cache->active = a = 1;
+    return cache->e[1].fofs;
+  } else {
+    ++yf->stats.cache_miss_count;
+    fofs = get_fofs_lcache(yf, ofs, &i);
+    assert(ofs <= fofs);
+    if (CACHE_HAS_0(a) && cache->e[0].fofs == fofs) {
+      if (a == 1) cache->active = a = 0;
+      if (cache->e[0].ofs > ofs) cache->e[0].ofs = ofs;
+    } else if (CACHE_HAS_1(a) && cache->e[1].fofs == fofs) {
+      if (a == 0) cache->active = a = 1;
+      if (cache->e[1].ofs > ofs) cache->e[1].ofs = ofs;
+    }
+    /* We don't update the cache, because we don't know cmp_result, and we
+     * are too lazy to compute it.
+     */
+    return fofs;
+  }
+}
+
+/* --- Sidecar index (flags -I and -x)
+ *
+ * The sidecar index file <sorted-text-file>.lbidx contains the start offset
+ * and the first few bytes (key prefix) of every step-th line of the sorted
+ * text file. It's used to make the initial [lo, hi) bisection range
+ * narrower, thus skipping the top levels of the bisection, which are the
+ * same random reads for each query. The results are the same as without
+ * the index. The entries are mmap(2)ed (or read to memory at once), so a
+ * lookup touches only the few pages of its bisection over them.
+ *
+ * File format (all integers are little endian):
+ *
+ * * 8 bytes: LBIDX_MAGIC
+ * * 8 bytes: size of the sorted text file
+ * * 8 bytes: st_mtime of the sorted text file
+ * * 4 bytes: step (number of lines between entries)
+ * * 4 bytes: prefix_size (maximum number of key bytes in an entry)
+ * * for each entry (prefix_size + 9 bytes each), in increasing offset order:
+ *   * 8 bytes: start offset of the line
+ *   * 1 byte: size of the line without the '\n', or 255 if it is longer
+ *     than prefix_size
+ *   * prefix_size bytes: the beginning of the line, padded with '\0'
+ */
+
+#define LBIDX_MAGIC "LBIDX1\n\0"
+#define LBIDX_HEADER_SIZE 32
+#define LBIDX_DEFAULT_STEP 256
+#define LBIDX_PREFIX_SIZE 24  /* Must be at most 254. */
+#define LBIDX_LONG 255
+
+struct lbidx {
+  yfile yf;  /* Reading the .lbidx file. */
+  off_t count;  /* Number of entries. */
+  unsigned prefix_size;
+  const char *entries;  /* In yf.map, or in buf. */
+  char *buf;  /* malloc()ed copy of the entries if yf couldn't be mapped. */
+};
+
+/* Reads *n bytes at ofs from yf to buf. Returns false on EOF. */
+STATIC ybool yfread_at(yfile *yf, off_t ofs, char *buf, int n) {
+  int c;
+  yfseek_set(yf, ofs);
+  for (; n > 0; --n) {
+    if ((c = YFGETCHAR(yf)) < 0) return 0;
+    *buf++ = c;
+  }
+  return 1;
+}
+
+/* Sets idx->entries to the idx->count entries of idx->yf: in its mmap(2)ed
+ * view, or read to idx->buf. Returns false on a read error or out of memory.
+ */
+STATIC ybool lbidx_load(struct lbidx *idx) {
+  const size_t size = (size_t)idx->count * (idx->prefix_size + 9);
+  const char *p;
+  size_t got;
+  int need;
+  idx->buf = NULL;
+  if (idx->yf.map) {
+    idx->entries = idx->yf.map + LBIDX_HEADER_SIZE;
+    return 1;
+  }
+  if ((off_t)(size / (idx->prefix_size + 9)) != idx->count ||
+      !(idx->buf = (char*)malloc(size + 1))) {
+    return 0;
+  }
+  for (got = 0, yfseek_set(&idx->yf, LBIDX_HEADER_SIZE); got < size;
+       got += need) {
+    if ((need = yfpeek(&idx->yf, size - got, &p)) <= 0) {
+      free(idx->buf);
+      idx->buf = NULL;
+      return 0;
+    }
+    memcpy(idx->buf + got, p, need);
+    yfseek_cur(&idx->yf, need);
+  }
+  idx->entries = idx->buf;
+  return 1;
+}
+
+typedef enum lbidx_status_t {
+  LBIDX_OK,
+  LBIDX_MISSING,  /* Doesn't exist, or can't be opened. */
+  LBIDX_STALE,  /* Not up to date, or unreadable. */
+} lbidx_status_t;
+
+/** Opens the sidecar index of yf (which was opened by yfopen(yf, pathname,
+ * (off_t)-1)). Returns LBIDX_OK on success, otherwise it leaves idx
+ * closed.
+ */
+STATIC lbidx_status_t lbidx_open(struct lbidx *idx, yfile *yf,
+                                 const char *pathname) {
+  char *idx_pathname = get_lbidx_pathname(pathname, ".lbidx", "");
+  char header[LBIDX_HEADER_SIZE];
+  struct stat st;
+  off_t step_and_prefix_size;
+  int fd;
+  if (!idx_pathname) return LBIDX_MISSING;
+  fd = open(idx_pathname, O_RDONLY | O_BINARY, 0);
+  free(idx_pathname);
+  if (fd < 0) return LBIDX_MISSING;
+  yfopen_fd(&idx->yf, fd, (off_t)-1);
+  (void)yfmap(&idx->yf);  /* Before reading anything. */
+  if (yfread_at(&idx->yf, 0, header, LBIDX_HEADER_SIZE) &&
+      0 == memcmp(header, LBIDX_MAGIC, 8) &&
+      fstat(yf->fd, &st) == 0 &&
+      (yf->bgzf || get_u64le(header + 8) == st.st_size) &&
+      get_u64le(header + 8) == yfgetsize(yf) &&
+      get_u64le(header + 16) == (off_t)st.st_mtime) {
+    step_and_prefix_size = get_u64le(header + 24);
+    idx->prefix_size = (unsigned)(step_and_prefix_size >> 32);
+    if ((step_and_prefix_size & 0xffffffffU) != 0 &&
+        idx->prefix_size < LBIDX_LONG) {
+      idx->count = (yfgetsize(&idx->yf) - LBIDX_HEADER_SIZE) /
+          (idx->prefix_size + 9);
+      if (lbidx_load(idx)) return LBIDX_OK;
+    }
+  }
+  yfclose(&idx->yf);
+  return LBIDX_STALE;
+}
+
+STATIC void lbidx_close(struct lbidx *idx) {
+  free(idx->buf);
+  yfclose(&idx->yf);
+}
+
+/* Returns -1 if the line of entry is known to be smaller than x (i.e.
+ * compare_line would return false for it), 1 if it's known to be larger,
+ * and 0 if the key prefix in entry is too short to decide.
+ */
+STATIC int lbidx_test(const char *entry, unsigned prefix_size,
+                      const char *x, size_t xsize, compare_mode_t cm) {
+  const unsigned char *k = (const unsigned char*)entry + 9;
+  unsigned ksize = *(const unsigned char*)(entry + 8);
+  const ybool is_long = ksize == LBIDX_LONG;
+  int c;
+  if (is_long) ksize = prefix_size;
+  if ((c = memcmp(x, k, xsize < ksize ? xsize : ksize)) != 0) {
+    return c < 0 ? 1 : -1;
+  }
+  if (xsize <= ksize) {  /* x is a prefix of the line. */
+    if (cm == CM_LE) return 1;
+    if (cm == CM_LP) return -1;
+    return xsize < ksize || is_long ? 1 : -1;  /* CM_LT. */
+  }
+  return is_long ? 0 : -1;  /* The line is a proper prefix of x. */
+}
+
+/** Makes [*lo, *hi] narrower for bisect_way(yf, ..., *lo, *hi, x, xsize,
+ * cm) using the entries of idx, without changing the result of bisect_way.
+ * Only entries which have actually been tested are used as boundaries. size
+ * is yfgetsize(yf), which can be smaller than the size in idx (flag -i).
+ *
+ * A single bisection finds both the first entry not known to be smaller (a)
+ * and the first entry known to be larger (b). It splits to two only at an
+ * entry whose prefix is too short to decide, which is rare.
+ */
+STATIC void lbidx_narrow(struct lbidx *idx, off_t size, off_t *lo, off_t *hi,
+                         const char *x, size_t xsize, compare_mode_t cm) {
+  const size_t entry_size = idx->prefix_size + 9;
+  const char *entry;
+  off_t a = 0, b = idx->count, mid, c, d, new_lo = *lo, new_hi = *hi, ofs;
+  int t;
+  while (a < b) {
+    mid = a + ((b - a) >> 1);
+    entry = idx->entries + (size_t)mid * entry_size;
+    t = lbidx_test(entry, idx->prefix_size, x, xsize, cm);
+    ofs = get_u64le(entry);
+    if (t < 0) {
+      a = mid + 1;
+      if (ofs >= new_lo) new_lo = ofs + 1;
+    } else if (t > 0) {
+      b = mid;
+      if (ofs + 0ULL < new_hi + 0ULL) new_hi = ofs;
+    } else {  /* Undecided: bisect for a below mid, and for b above it. */
+      for (c = mid; a < c;) {
+        d = a + ((c - a) >> 1);
+        entry = idx->entries + (size_t)d * entry_size;
+        if (lbidx_test(entry, idx->prefix_size, x, xsize, cm) < 0) {
+          a = d + 1;
+          if ((ofs = get_u64le(entry)) >= new_lo) new_lo = ofs + 1;
+        } else {
+          c = d;
+        }
+      }
+      for (c = mid + 1; c < b;) {
+        d = c + ((b - c) >> 1);
+        entry = idx->entries + (size_t)d * entry_size;
+        if (lbidx_test(entry, idx->prefix_size, x, xsize, cm) > 0) {
+          b = d;
+          ofs = get_u64le(entry);
+          if (ofs + 0ULL < new_hi + 0ULL) new_hi = ofs;
+        } else {
+          c = d + 1;
+        }
+      }
+      break;
+    }
+  }
+  /* If the line at new_hi is before *lo, then bisect_way would return
+   * get_fofs(*lo).
+   */
+  if (new_hi + 0ULL < *lo + 0ULL) new_hi = *lo;
+  if (new_lo > size) new_lo = size;  /* The last line is ignored (flag -i). */
+  if (new_hi + 0ULL < new_lo + 0ULL) return;  /* Not sorted. */
+  *lo = new_lo;
+  *hi = new_hi;
+}
+
+#ifndef PTS_LBSEARCH_NO_MAIN
+STATIC void set_u64le(char *p, off_t v) {
+  unsigned long long u = (unsigned long long)v;
+  int i;
+  for (i = 0; i < 8; ++i, u >>= 8) {
+    p[i] = (char)(u & 255);
+  }
+}
+
+STATIC void lbidx_write(int fd, const char *buf, size_t size) {
+  if ((size_t)write(fd, buf, size) != size) {
+    die2_strerror("error: write index", "");
+  }
+}
+
+/** Creates the sidecar index <pathname>.lbidx for yf, which was opened by
+ * yfopen(yf, pathname, (off_t)-1). An entry is added for every step-th line.
+ */
+STATIC void lbidx_build(yfile *yf, const char *pathname, unsigned step) {
+  char *tmp_pathname = get_lbidx_pathname(pathname, ".lbidx", ".tmp");
+  char *idx_pathname;
+  char wbuf[8192], *w = wbuf, *entry;
+  struct stat st;
+  off_t ofs = 0;
+  const off_t size = yfgetsize(yf);
+  unsigned countdown = 0, ksize;
+  int c, fd;
+  if (!tmp_pathname) die1("error: out of memory");
+  fd = open(tmp_pathname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0) die2_strerror("error: open ", tmp_pathname);
+  if (fstat(yf->fd, &st) != 0) die2_strerror("error: fstat ", pathname);
+  memcpy(w, LBIDX_MAGIC, 8);
+  set_u64le(w + 8, size);
+  set_u64le(w + 16, (off_t)st.st_mtime);
+  set_u64le(w + 24, (off_t)((unsigned long long)LBIDX_PREFIX_SIZE << 32 |
+                            step));
+  w += LBIDX_HEADER_SIZE;
+  yfseek_set(yf, 0);
+  while (ofs < size) {  /* ofs is the start offset of a line. */
+    c = 0;
+    if (countdown-- == 0) {
+      countdown = step - 1;
+      if (w - wbuf + LBIDX_PREFIX_SIZE + 9 > (int)sizeof(wbuf)) {
+        lbidx_write(fd, wbuf, w - wbuf);
+        w = wbuf;
+      }
+      entry = w;
+      w += LBIDX_PREFIX_SIZE + 9;
+      set_u64le(entry, ofs);
+      memset(entry + 9, '\0', LBIDX_PREFIX_SIZE);
+      for (ksize = 0; ksize < LBIDX_PREFIX_SIZE &&
+           (c = YFGETCHAR(yf)) >= 0 && c != '\n'; ++ksize) {
+        entry[9 + ksize] = c;
+      }
+      ofs += ksize;
+      if (ksize == LBIDX_PREFIX_SIZE) {
+        c = YFGETCHAR(yf);  /* Is the line longer than LBIDX_PREFIX_SIZE? */
+        if (c >= 0 && c != '\n') ++ofs;
+      }
+      entry[8] = c >= 0 && c != '\n' ? (char)LBIDX_LONG : (char)ksize;
+      if (c == '\n') ++ofs;
+    }
+    while (c >= 0 && c != '\n') {  /* Skip the rest of the line. */
+      if ((c = YFGETCHAR(yf)) >= 0) ++ofs;
+    }
+    if (c < 0) break;
+  }
+  if (yf->err != LBS_OK) {
+    (void)close(fd);
+    (void)remove(tmp_pathname);
+    yfcheck(yf, pathname);
+  }
+  lbidx_write(fd, wbuf, w - wbuf);
+  if (close(fd) != 0) die2_strerror("error: close index", "");
+  if (!(idx_pathname = get_lbidx_pathname(pathname, ".lbidx", ""))) {
+    die1("error: out of memory");
+  }
+  if (rename(tmp_pathname, idx_pathname) != 0) {
+    die2_strerror("error: rename ", idx_pathname);
+  }
+  free(idx_pathname);
+  free(tmp_pathname);
+}
+#endif
+
+/* --- Line-offset index (flags -L and -l)
+ *
+ * The line-offset index file <sorted-text-file>.lbofs contains the start
+ * offset of each line of the sorted text file, as a flat array (can be
+ * mmap(2)ed). With it, bisect_way bisects over line numbers instead of byte
+ * offsets: each probe reads a line start directly, without get_fofs
+ * scanning for the next '\n' (which is slow for long lines), and the
+ * number of probes depends on the number of lines, not their lengths. The
+ * results are the same as without the index. lbofs_line also gives the
+ * line number of any line start, e.g. for counting the lines of a range.
+ *
+ * File format (all integers are little endian):
+ *
+ * * 8 bytes: LBOFS_MAGIC
+ * * 8 bytes: size of the sorted text file
+ * * 8 bytes: st_mtime of the sorted text file
+ * * 4 bytes: width of an entry: 5 (40 bits, if the file is smaller than
+ *   1 TiB) or 8
+ * * 4 bytes: 0
+ * * for each line (width bytes each), in increasing order: start offset
+ */
+
+#define LBOFS_MAGIC "LBOFS1\n\0"
+#define LBOFS_HEADER_SIZE 32
+
+/** Opens the line-offset index of yf (which was opened by yfopen(yf,
+ * pathname, (off_t)-1)), and attaches it to yf (yf->lbofs), so bisect_way
+ * will use it. Call before yfignore_incomplete.
+ */
+STATIC lbidx_status_t lbofs_open(yfile *yf, const char *pathname) {
+  char *ofs_pathname = get_lbidx_pathname(pathname, ".lbofs", "");
+  char header[LBOFS_HEADER_SIZE];
+  struct stat st;
+  struct lbofs *ox;
+  int fd;
+  if (!ofs_pathname) return LBIDX_MISSING;
+  fd = open(ofs_pathname, O_RDONLY | O_BINARY, 0);
+  free(ofs_pathname);
+  if (fd < 0) return LBIDX_MISSING;
+  if (!(ox = (struct lbofs*)malloc(sizeof(*ox)))) {
+    close(fd);
+    return LBIDX_MISSING;
+  }
+  yfopen_fd(&ox->yf, fd, (off_t)-1);
+  if (yfread_at(&ox->yf, 0, header, LBOFS_HEADER_SIZE) &&
+      0 == memcmp(header, LBOFS_MAGIC, 8) &&
+      fstat(yf->fd, &st) == 0 &&
+      (yf->bgzf || get_u64le(header + 8) == st.st_size) &&
+      get_u64le(header + 8) == yfgetsize(yf) &&
+      get_u64le(header + 16) == (off_t)st.st_mtime &&
+      ((ox->width = (int)get_u64le(header + 24)) == 5 || ox->width == 8)) {
+    ox->count = (yfgetsize(&ox->yf) - LBOFS_HEADER_SIZE) / ox->width;
+    (void)yfmap(&ox->yf);  /* Reading entries is faster. */
+    yf->lbofs = ox;
+    return LBIDX_OK;
+  }
+  yfclose(&ox->yf);
+  free(ox);
+  return LBIDX_STALE;
+}
+
+/* Returns the start offset of line i of yf, or yfgetsize(yf) if there is
+ * no such line (also if it's ignored by flag -i).
+ */
+STATIC off_t lbofs_get(yfile *yf, off_t i) {
+  struct lbofs *ox = yf->lbofs;
+  char entry[8];
+  off_t ofs;
+  memset(entry, '\0', sizeof(entry));
+  if (i >= ox->count ||
+      !yfread_at(&ox->yf, LBOFS_HEADER_SIZE + i * ox->width, entry,
+                 ox->width) ||
+      (ofs = get_u64le(entry)) > yfgetsize(yf)) {
+    return yfgetsize(yf);  /* Also for a truncated index. */
+  }
+  return ofs;
+}
+
+/** Returns the number of the first line starting at ofs or later, i.e. the
+ * number of lines starting before ofs.
+ */
+STATIC off_t lbofs_line(yfile *yf, off_t ofs) {
+  off_t a = 0, b = yf->lbofs->count, mid;
+  if (ofs <= 0) return 0;  /* Shortcuts for a search of the entire file. */
+  if (ofs >= yfgetsize(yf) && (b == 0 || lbofs_get(yf, b - 1) < ofs)) {
+    return b;
+  }
+  while (a < b) {
+    mid = a + ((b - a) >> 1);
+    if (lbofs_get(yf, mid) < ofs) {
+      a = mid + 1;
+    } else {
+      b = mid;
+    }
+  }
+  return a;
+}
+
+#ifndef PTS_LBSEARCH_NO_MAIN
+/** Creates the line-offset index <pathname>.lbofs for yf, which was opened
+ * by yfopen(yf, pathname, (off_t)-1).
+ */
+STATIC void lbofs_build(yfile *yf, const char *pathname) {
+  char *tmp_pathname = get_lbidx_pathname(pathname, ".lbofs", ".tmp");
+  char *ofs_pathname;
+  char wbuf[8192], *w = wbuf;
+  const char *buf, *q;
+  struct stat st;
+  off_t ofs = 0;
+  const off_t size = yfgetsize(yf);
+  const int width = (unsigned long long)size >> 40 ? 8 : 5;
+  int n, fd;
+  ybool is_bol = 1;  /* Is ofs at the beginning of a line? */
+  if (!tmp_pathname) die1("error: out of memory");
+  fd = open(tmp_pathname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0) die2_strerror("error: open ", tmp_pathname);
+  if (fstat(yf->fd, &st) != 0) die2_strerror("error: fstat ", pathname);
+  memcpy(w, LBOFS_MAGIC, 8);
+  set_u64le(w + 8, size);
+  set_u64le(w + 16, (off_t)st.st_mtime);
+  set_u64le(w + 24, width);
+  w += LBOFS_HEADER_SIZE;
+  yfseek_set(yf, 0);
+  while ((n = yfpeek(yf, size - ofs, &buf)) > 0) {
+    if (is_bol) {
+      if (w - wbuf + 8 > (int)sizeof(wbuf)) {
+        lbidx_write(fd, wbuf, w - wbuf);
+        w = wbuf;
+      }
+      set_u64le(w, ofs);  /* Writes 8 bytes, but only width are kept. */
+      w += width;
+    }
+    if ((q = (const char*)memchr(buf, '\n', n)) != NULL) n = q - buf + 1;
+    is_bol = q != NULL;
+    yfseek_cur(yf, n);
+    ofs += n;
+  }
+  if (yf->err != LBS_OK) {
+    (void)close(fd);
+    (void)remove(tmp_pathname);
+    yfcheck(yf, pathname);
+  }
+  lbidx_write(fd, wbuf, w - wbuf);
+  if (close(fd) != 0) die2_strerror("error: close index", "");
+  if (!(ofs_pathname = get_lbidx_pathname(pathname, ".lbofs", ""))) {
+    die1("error: out of memory");
+  }
+  if (rename(tmp_pathname, ofs_pathname) != 0) {
+    die2_strerror("error: rename ", ofs_pathname);
+  }
+  free(ofs_pathname);
+  free(tmp_pathname);
+}
+#endif
+
+/* State of an incremental bisect_way, advanced by bisect_step. This makes it
+ * possible to run multiple searches concurrently (flag -A).
+ */
+struct bisect_state {
+  struct cache *cache;
+  const char *x;
+  size_t xsize;
+  compare_mode_t cm;
+  off_t lo;
+  off_t hi;
+  off_t mid;
+  off_t midf;
+  off_t result;  /* Valid only if is_done. */
+  ybool is_done;
+  ybool is_first;  /* No bisect_step yet. */
+  ybool is_lines;  /* lo, hi and mid are line numbers in yf->lbofs. */
+};
+
+/* Arguments are the same as for bisect_way. */
+STATIC void bisect_init(
+    struct bisect_state *st, yfile *yf, struct cache *cache, off_t lo,
+    off_t hi, const char *x, size_t xsize, compare_mode_t cm) {
+  const off_t size = yfgetsize(yf);
+  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
+  st->cache = cache;
+  st->x = x;
+  st->xsize = xsize;
+  st->cm = cm;
+  st->mid = -1;  /* Different from lo. */
+  st->is_done = 0;
+  st->is_first = 1;
+  /* Shortcuts. The empty number is 0, not the smallest key. */
+  if (xsize == 0 && !(yf->keyspec && yf->keyspec->is_numeric)) {
+    if (cm == CM_LE) hi = lo;  /* Faster for lo == 0. Returns right below. */
+    if (cm == CM_LP && hi == size) {
+      st->result = hi;
+      st->is_done = 1;
+    }
+  }
+  if ((st->is_lines = yf->lbofs != NULL)) {
+    /* Bisect over the lines starting in [lo, hi) instead. */
+    const off_t lo_byte = lo;
+    lo = lbofs_line(yf, lo);
+    hi = lo_byte < hi ? lbofs_line(yf, hi) : lo;
+  }
+  st->lo = lo;
+  st->hi = hi;
+}
+
+/* Returns the offset at which the bisection of st probes line number or
+ * offset i.
+ */
+STATIC off_t bisect_probe_ofs(yfile *yf, const struct bisect_state *st,
+                              off_t i) {
+  return st->is_lines ? lbofs_get(yf, i) : i;
+}
+
+/* Returns the line number or offset in [lo, hi) (not empty) which the
+ * bisection of st probes next. Without the line cache, it's the midpoint.
+ * With the line cache (flag -C), it's 1 + the offset with the most trailing
+ * 0 bits in the middle eighth of [lo, hi): this grid of probes is the same
+ * for any lo and hi near each other, so the top-of-tree lines probed by a
+ * search (e.g. a batch query starting at the previous result) are found
+ * in the line cache by the next search. The + 1 makes get_fofs start
+ * reading at the (block-aligned) grid offset rather than right before it.
+ * A probe still leaves at most 9/16 of [lo, hi), which is about 1% more
+ * probes on average.
+ */
+STATIC off_t bisect_mid(const yfile *yf, const struct bisect_state *st,
+                        off_t lo, off_t hi) {
+  off_t a, b, d;
+  if (!yf->lcache || st->is_lines || hi - lo < 16) return (lo + hi) >> 1;
+  a = lo + ((hi - lo) >> 1) - ((hi - lo) >> 4);
+  b = lo + ((hi - lo) >> 1) + ((hi - lo) >> 4);
+  for (d = a ^ b; (d & (d - 1)) != 0; d &= d - 1) {}  /* Highest 1 bit. */
+  return (b & -d) + 1;  /* a has a 0 bit at d, b has a 1. */
+}
+
+/* With flag -r, if [lo, hi) of st spans at least this many blocks, the
+ * probe is a whole block, see bisect_block.
+ */
+#define BLOCK_PROBE_MIN_BLOCKS 2
+
+/* Returns the start of the block (in [lo, hi) of st) which the next
+ * bisect_step will search with bisect_block, or -1.
+ */
+STATIC off_t bisect_block_start(const yfile *yf,
+                                const struct bisect_state *st) {
+  off_t b;
+  if (!yf->is_block_aligned || st->is_lines ||
+      st->hi - st->lo < (off_t)yf->block_size * BLOCK_PROBE_MIN_BLOCKS) {
+    return -1;
+  }
+  b = ((st->lo + st->hi) >> 1) & -(off_t)yf->block_size;
+  return b > st->lo ? b : -1;
+}
+
+/* Narrows [lo, hi) of st using all complete lines in the block at b (flag
+ * -r), so a single read does the work of several probes. The lines are
+ * bisected within the block (in the read buffer), and the last of them
+ * smaller than x and the first one not smaller become lo and hi. The line
+ * spanning b (its start is in the previous block) and the one spanning the
+ * end of the block are not used, because comparing them would need another
+ * read. Returns false (without narrowing) if there is no such line.
+ */
+STATIC ybool bisect_block(yfile *yf, struct bisect_state *st, off_t b) {
+  const struct cache_entry *entry;
+  const char *buf;
+  off_t limit, lo = b + 1, hi, mid, fofs, new_lo = -1, new_hi = -1;
+  int n;
+  yfseek_set(yf, b);
+  n = yfpeek(yf, yf->block_size - (b & (yf->block_size - 1)), &buf);
+  while (n > 0 && buf[n - 1] != '\n') --n;
+  /* Lines starting before limit are complete in the block and before hi. */
+  limit = b + n < st->hi ? b + n : st->hi;
+  for (hi = limit; lo < hi;) {
+    mid = lo + ((hi - lo) >> 1);
+    if ((fofs = get_fofs_using_cache(yf, st->cache, mid)) >= hi) {
+      hi = mid;  /* No line starts in [mid, hi). */
+      continue;
+    }
+    ++yf->stats.probe_count;
+    entry = get_using_cache(yf, st->cache, fofs, st->x, st->xsize, st->cm);
+    if (entry->cmp_result) {
+      hi = new_hi = fofs;
+    } else {
+      lo = new_lo = fofs + 1;  /* The result is after this line. */
+    }
+  }
+  if (new_lo >= 0) st->lo = new_lo;
+  if (new_hi >= 0) st->hi = new_hi;
+  st->mid = -1;  /* st->midf is not valid. */
+  return new_lo >= 0 || new_hi >= 0;
+}
+
+#ifdef HAVE_IO_URING
+/* Returns the offset at which the next bisect_step will call get_fofs (and
+ * thus read the file at the offset before it), or -1 if it won't read.
+ */
+STATIC off_t bisect_peek_ofs(yfile *yf, const struct bisect_state *st) {
+  off_t b;
+  if (st->is_done) return -1;
+  /* bisect_block reads the block at b, like get_fofs(b + 1). */
+  if ((b = bisect_block_start(yf, st)) >= 0) return b + 1;
+  if (st->lo < st->hi) {
+    return bisect_probe_ofs(yf, st, bisect_mid(yf, st, st->lo, st->hi));
+  }
+  return st->mid == st->lo || st->is_lines ? -1 : st->lo;
+}
+#endif
+
+/* Prefetches the probes of the bisection of [lo, hi) depth levels deeper,
+ * and also the ones above them if is_all.
+ */
+STATIC void bisect_prefetch(yfile *yf, const struct bisect_state *st,
+                            off_t lo, off_t hi, int depth, ybool is_all) {
+  off_t mid;
+  if (lo >= hi) return;
+  mid = bisect_mid(yf, st, lo, hi);
+  if (depth == 0 || is_all) yfprefetch(yf, bisect_probe_ofs(yf, st, mid));
+  if (depth > 0) {
+    bisect_prefetch(yf, st, lo, mid, depth - 1, is_all);
+    bisect_prefetch(yf, st, mid + 1, hi, depth - 1, is_all);
+  }
+}
+
+/* Does a single probe of the bisection, or finishes it. */
+STATIC void bisect_step(yfile *yf, struct bisect_state *st) {
+  const struct cache_entry *entry;
+  off_t b;
+  if ((b = bisect_block_start(yf, st)) >= 0 && bisect_block(yf, st, b)) {
+    return;
+  }
+  if (st->lo < st->hi) {
+    st->mid = bisect_mid(yf, st, st->lo, st->hi);
+    ++yf->stats.probe_count;
+    if (yf->prefetch_depth > 0) {
+      /* The next probe is in one of the halves, whichever cmp_result picks.
+       * The levels above the deepest were prefetched by the previous steps,
+       * except in the first step.
+       */
+      bisect_prefetch(yf, st, st->lo, st->mid, yf->prefetch_depth - 1,
+                      st->is_first);
+      bisect_prefetch(yf, st, st->mid + 1, st->hi, yf->prefetch_depth - 1,
+                      st->is_first);
+      st->is_first = 0;
+    }
+    entry = get_using_cache(yf, st->cache, bisect_probe_ofs(yf, st, st->mid),
+                            st->x, st->xsize, st->cm);
+    st->midf = entry->fofs;
+    if (entry->cmp_result) {
+      st->hi = st->mid;
+    } else {
+      st->lo = st->mid + 1;
+    }
+  } else if (st->is_lines) {
+    st->result = lbofs_get(yf, st->lo);
+    st->is_done = 1;
+  } else {
+    st->result = st->mid == st->lo ? st->midf :
+        get_fofs_using_cache(yf, st->cache, st->lo);
+    st->is_done = 1;
+  }
+}
+
+/* x[:xsize] must not contain '\n'.
+ *
+ * cm=CM_LE is equivalent to is_left=true and is_open=true.
+ * cm=CM_LT is equivalent to is_left=false and is_open=false.
+ * cm=CL_LP is also supported, it does prefix search.
+ */
+STATIC off_t bisect_way(
+    yfile *yf, struct cache *cache, off_t lo, off_t hi,
+    const char *x, size_t xsize, compare_mode_t cm) {
+  struct bisect_state st;
+  bisect_init(&st, yf, cache, lo, hi, x, xsize, cm);
+  while (!st.is_done) bisect_step(yf, &st);
+  return st.result;
+}
+
+/* --- Galloping from a known offset (flags -H and -M) */
+
+/* The first step of galloping from a hint, in bytes. */
+#define HINT_FIRST_STEP 64
+
+/* Same as bisect_way(yf, cache, lo, hi, x, xsize, cm), but it gallops from
+ * lo towards hi with steps step, 2 * step, 4 * step ... until it finds a
+ * line for which the comparison is true, and it bisects only the last step.
+ * This takes O(log(distance / step)) probes if the result is near lo.
+ */
+STATIC off_t gallop_way(yfile *yf, struct cache *cache, off_t lo, off_t hi,
+                        off_t step, const char *x, size_t xsize,
+                        compare_mode_t cm) {
+  const off_t size = yfgetsize(yf);
+  const struct cache_entry *entry;
+  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
+  if (step <= 0) step = 1;
+  while (hi - lo > step) {
+    ++yf->stats.probe_count;
+    entry = get_using_cache(yf, cache, lo + step, x, xsize, cm);
+    if (entry->cmp_result) {
+      hi = lo + step;
+      break;
+    }
+    lo = entry->fofs + 1;  /* The result is after this line. */
+    step <<= 1;
+  }
+  /* Like bisect_way, return get_fofs(hi) if all lines before are smaller. */
+  return bisect_way(yf, cache, lo < hi ? lo : hi, hi, x, xsize, cm);
+}
+
+/* Same as bisect_way(yf, cache, lo, hi, x, xsize, cm), but it probes the
+ * line at hint first, and gallops from there (like gallop_way) towards lo
+ * or hi, depending on the comparison. This takes a few probes (mostly in
+ * the read buffer) if the result is near hint.
+ */
+STATIC off_t hint_way(yfile *yf, struct cache *cache, off_t lo, off_t hi,
+                      off_t hint, const char *x, size_t xsize,
+                      compare_mode_t cm) {
+  const off_t size = yfgetsize(yf);
+  const struct cache_entry *entry;
+  off_t step = HINT_FIRST_STEP;
+  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
+  if (hint > hi) hint = hi;
+  if (hint < lo) hint = lo;
+  if (hint < hi) {
+    ++yf->stats.probe_count;
+    entry = get_using_cache(yf, cache, hint, x, xsize, cm);
+    if (!entry->cmp_result) {
+      hint = entry->fofs + 1;  /* The result is after this line. */
+      return gallop_way(yf, cache, hint < hi ? hint : hi, hi, step,
+                        x, xsize, cm);
+    }
+  }
+  /* Now the result is at most get_fofs(hint). Gallop towards lo. */
+  while (hint - lo > step) {
+    ++yf->stats.probe_count;
+    entry = get_using_cache(yf, cache, hint - step, x, xsize, cm);
+    if (!entry->cmp_result) {
+      lo = entry->fofs + 1;  /* The result is after this line. */
+      if (lo > hint) lo = hint;
+      break;
+    }
+    hint -= step;
+    step <<= 1;
+  }
+  return bisect_way(yf, cache, lo, hint, x, xsize, cm);
+}
+
+/* --- Interpolation search (flag -u)
+ *
+ * If the keys are uniformly distributed over the file offsets (e.g. hex
+ * hashes or fixed-width timestamps), interp_way estimates the offset of x
+ * from the keys of two probed lines around it (anchors): the last line
+ * smaller than x, and the last one not smaller. The first anchors are the
+ * first line and a line near the end. Each estimate is probed, and it
+ * becomes the new anchor on its side, so the estimates converge much
+ * faster than bisection (the error is about the square root of the
+ * previous one in lines). When the estimate moves less than a block, it
+ * gallops from there (hint_way, in the read buffer). If an estimate doesn't
+ * move less than half as much as the previous one (the keys aren't
+ * uniform), it falls back to bisect_way between the anchors, so the number
+ * of probes is at most a few more than with bisection.
+ *
+ * The keys (by yf->keyspec) are interpolated as numbers: as decimal
+ * numbers with -g, otherwise as fractions of their first few bytes after
+ * the common prefix of the anchors (skipping separators at the same
+ * position, e.g. ':' in timestamps), in the radix of those bytes in the
+ * anchors: 10 for decimal digits, 16 for hex digits, or their range.
+ */
+
+/* The number of bytes of each anchor key remembered. */
+#define INTERP_KEY_SIZE 32
+/* Lines are read up to this many bytes to find their key. */
+#define INTERP_LINE_SIZE 256
+/* At most this many digits of the keys are used. */
+#define INTERP_DIGITS 12
+/* After this many probes not halving the range, bisect. */
+#define INTERP_MAX_SLOW_STEPS 3
+
+struct interp_anchor {
+  off_t fofs;  /* Start offset of the line. */
+  size_t key_size;
+  char key[INTERP_KEY_SIZE];  /* Prefix of the key of the line. */
+};
+
+/* The positions of the digits in the keys, and their radix. */
+struct interp_digits {
+  size_t pos[INTERP_DIGITS];
+  int count;
+  int min;  /* The byte value of digit 0. */
+  int base;
+};
+
+/* Remembers the key of the line at fofs in an. */
+STATIC void interp_set_anchor(yfile *yf, struct interp_anchor *an,
+                              off_t fofs) {
+  char line[INTERP_LINE_SIZE];
+  const char *key;
+  size_t line_size = 0, key_size;
+  int c;
+  yfseek_set(yf, an->fofs = fofs);
+  while (line_size < sizeof(line) && (c = YFGETCHAR(yf)) >= 0 && c != '\n') {
+    line[line_size++] = c;
+  }
+  key = get_line_key(yf->keyspec, line, line_size, &key_size);
+  an->key_size = key_size < sizeof(an->key) ? key_size : sizeof(an->key);
+  memcpy(an->key, key, an->key_size);
+}
+
+/* Returns the digit value of byte c for interpolation: hex digits a..f
+ * (also A..F) are right after 9, for hex hashes.
+ */
+STATIC int get_interp_byte(int c) {
+  return (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') ? (c & 7) + '9' : c;
+}
+
+/* Finds the digits of the keys of lo_an and hi_an to interpolate with (see
+ * above).
+ */
+STATIC void interp_init_digits(struct interp_digits *dg,
+                               const struct interp_anchor *lo_an,
+                               const struct interp_anchor *hi_an) {
+  const size_t size = lo_an->key_size > hi_an->key_size ?
+      lo_an->key_size : hi_an->key_size;
+  size_t i = 0;
+  int c, d, min = 255, max = 0;
+  ybool is_dec = 1;
+  while (i < lo_an->key_size && i < hi_an->key_size &&
+         lo_an->key[i] == hi_an->key[i]) {
+    ++i;  /* Skip the common prefix. */
+  }
+  for (dg->count = 0; i < size && dg->count < INTERP_DIGITS; ++i) {
+    c = i < lo_an->key_size ? (unsigned char)lo_an->key[i] : -1;
+    d = i < hi_an->key_size ? (unsigned char)hi_an->key[i] : -1;
+    /* Skip the separators at fixed positions, e.g. in timestamps. */
+    if (c == d && !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                    (c >= 'A' && c <= 'Z'))) {
+      continue;
+    }
+    dg->pos[dg->count++] = i;
+    if (c >= 0) {
+      if (c < '0' || c > '9') is_dec = 0;
+      if ((c = get_interp_byte(c)) < min) min = c;
+      if (c > max) max = c;
+    }
+    if (d >= 0) {
+      if (d < '0' || d > '9') is_dec = 0;
+      if ((d = get_interp_byte(d)) < min) min = d;
+      if (d > max) max = d;
+    }
+  }
+  if (is_dec) {  /* Decimal digits, e.g. in timestamps. */
+    min = '0';
+    max = '9';
+  } else if (min >= '0' && max <= '9' + 6) {  /* Hex digits. */
+    min = '0';
+    max = '9' + 6;
+  }
+  dg->min = min;
+  dg->base = max >= min ? max - min + 1 : 1;
+}
+
+/* Returns the value of key[:key_size] for interpolation by dg (see above),
+ * treating the missing bytes as pad.
+ */
+STATIC double get_interp_value(const struct keyspec *ks,
+                               const struct interp_digits *dg,
+                               const char *key, size_t key_size, int pad) {
+  const char *ip, *fp;
+  size_t is, fs, i;
+  ybool is_neg;
+  int c, j;
+  double value = 0, scale = 1;
+  if (ks && ks->width != 0 && key_size > ks->width) key_size = ks->width;
+  if (ks && ks->is_numeric) {
+    (void)parse_number(key, key_size, &is_neg, &ip, &is, &fp, &fs);
+    for (i = 0; i < is; ++i) {
+      value = value * 10 + (ip[i] - '0');
+    }
+    for (i = 0; i < fs && i < 20; ++i) {
+      value += (fp[i] - '0') * (scale /= 10);
+    }
+    return is_neg ? -value : value;
+  }
+  for (j = 0; j < dg->count; ++j) {
+    c = dg->pos[j] < key_size ? get_interp_byte((unsigned char)key[dg->pos[j]])
+        : pad;
+    c = c < dg->min ? 0 : c - dg->min >= dg->base ? dg->base - 1 : c - dg->min;
+    value += c * (scale /= dg->base);
+  }
+  return value;
+}
+
+/* Returns the estimated offset of x[:xsize] between the anchors lo_an and
+ * hi_an (lo_an->fofs < hi_an->fofs), in [lo, hi), or -1 if it can't be
+ * estimated. The distance of x from the value of the anchor kept the last
+ * lo_kept (or hi_kept) times is halved lo_kept - 1 times (like in the
+ * Illinois variant of regula falsi), so that the estimates converge from
+ * both sides.
+ */
+STATIC off_t interp_estimate(yfile *yf, const struct interp_anchor *lo_an,
+                             const struct interp_anchor *hi_an,
+                             off_t lo, off_t hi, const char *x, size_t xsize,
+                             compare_mode_t cm, int lo_kept, int hi_kept) {
+  const struct keyspec *ks = yf->keyspec;
+  /* The lines with key x as a prefix are after x with -p. */
+  const int pad = cm == CM_LP ? 255 : 0;
+  struct interp_digits dg;
+  double lo_value, hi_value, x_value, t;
+  off_t est;
+  interp_init_digits(&dg, lo_an, hi_an);
+  lo_value = get_interp_value(ks, &dg, lo_an->key, lo_an->key_size, 0);
+  hi_value = get_interp_value(ks, &dg, hi_an->key, hi_an->key_size, 0);
+  if (!(lo_value < hi_value)) return -1;  /* Not increasing, or NaN. */
+  x_value = get_interp_value(ks, &dg, x, xsize, pad);
+  if (!(x_value > lo_value)) return lo;
+  if (!(x_value < hi_value)) return hi - 1;
+  for (; lo_kept > 1; --lo_kept) {
+    lo_value = x_value - (x_value - lo_value) / 2;
+  }
+  for (; hi_kept > 1; --hi_kept) {
+    hi_value = x_value + (hi_value - x_value) / 2;
+  }
+  t = (x_value - lo_value) / (hi_value - lo_value);
+  est = lo_an->fofs + (off_t)(t * (hi_an->fofs - lo_an->fofs));
+  return est < lo ? lo : est >= hi ? hi - 1 : est;
+}
+
+/* Same as bisect_way(yf, cache, lo, hi, x, xsize, cm), but it probes the
+ * estimated offsets of x first, see above.
+ */
+STATIC off_t interp_way(yfile *yf, struct cache *cache, off_t lo, off_t hi,
+                        const char *x, size_t xsize, compare_mode_t cm) {
+  const off_t size = yfgetsize(yf);
+  const struct cache_entry *entry;
+  struct interp_anchor lo_an, hi_an;
+  off_t est, prev_est = -1, move, range, ofs;
+  int lo_kept = 0, hi_kept = 0, slow_steps = 0;
+  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
+  if (hi - lo <= yf->block_size * 2) {
+    return bisect_way(yf, cache, lo, hi, x, xsize, cm);
+  }
+  ++yf->stats.probe_count;
+  entry = get_using_cache(yf, cache, lo, x, xsize, cm);
+  if (entry->cmp_result || entry->fofs >= hi) return entry->fofs;
+  interp_set_anchor(yf, &lo_an, entry->fofs);
+  lo = entry->fofs + 1;  /* The result is after this line. */
+  ofs = hi - yf->block_size;
+  ++yf->stats.probe_count;
+  entry = get_using_cache(yf, cache, ofs, x, xsize, cm);
+  if (!entry->cmp_result) {  /* In the last block. */
+    if (entry->fofs < hi) lo = entry->fofs + 1;
+    return bisect_way(yf, cache, lo < hi ? lo : hi, hi, x, xsize, cm);
+  }
+  if (entry->fofs >= hi) return bisect_way(yf, cache, lo, hi, x, xsize, cm);
+  interp_set_anchor(yf, &hi_an, entry->fofs);
+  hi = ofs;
+  /* Each probe either halves [lo, hi), or it's a slow step. */
+  while (lo < hi && slow_steps < INTERP_MAX_SLOW_STEPS) {
+    est = interp_estimate(yf, &lo_an, &hi_an, lo, hi, x, xsize, cm,
+                          lo_kept, hi_kept);
+    if (est < 0) break;
+    move = prev_est < 0 ? hi - lo : est > prev_est ? est - prev_est :
+        prev_est - est;
+    if (move < yf->block_size) {
+      return hint_way(yf, cache, lo, hi, est, x, xsize, cm);
+    }
+    range = hi - lo;
+    ++yf->stats.probe_count;
+    entry = get_using_cache(yf, cache, est, x, xsize, cm);
+    if (entry->cmp_result) {
+      hi = est;
+      if (entry->fofs < size) interp_set_anchor(yf, &hi_an, entry->fofs);
+      ++lo_kept;
+      hi_kept = 0;
+    } else {
+      lo = entry->fofs + 1;
+      if (lo > hi) lo = hi;
+      interp_set_anchor(yf, &lo_an, entry->fofs);
+      ++hi_kept;
+      lo_kept = 0;
+    }
+    if (hi - lo > range >> 1) ++slow_steps;
+    prev_est = est;
+  }
+  return bisect_way(yf, cache, lo, hi, x, xsize, cm);
+}
+
+/* --- Bisection of an interval */
+
+/* Same as bisect_way(yf, cache, lo, hi, x, xsize, cm), but it uses hint_way
+ * if hint >= 0, otherwise it narrows [lo, hi] with idx (may be NULL) first,
+ * and uses interp_way for flag -u.
+ */
+STATIC off_t search_way(yfile *yf, struct cache *cache, struct lbidx *idx,
+                        off_t lo, off_t hi, off_t hint,
+                        const char *x, size_t xsize, compare_mode_t cm) {
+  if (hint >= 0) return hint_way(yf, cache, lo, hi, hint, x, xsize, cm);
+  if (idx) lbidx_narrow(idx, yfgetsize(yf), &lo, &hi, x, xsize, cm);
+  if (yf->is_interpolated) return interp_way(yf, cache, lo, hi, x, xsize, cm);
+  return bisect_way(yf, cache, lo, hi, x, xsize, cm);
+}
+
+/* x[:xsize] and y[:ysize] must not contain '\n'. idx may be NULL. */
+STATIC void bisect_interval(
+    yfile *yf, struct lbidx *idx, off_t lo, off_t hi, off_t hint,
+    compare_mode_t cm, const char *x, size_t xsize,
+    const char *y, size_t ysize,
+    off_t *start_out, off_t *end_out) {
+  off_t start, start_hi = hi, usec = yfstats_usec(yf);
+  struct cache cache;
+  struct end_bounds eb;
+  /* If the line x would already be at the end, then all lines from start
+   * are, so the interval is empty (e.g. if y < x).
+   */
+  const ybool is_empty = compare_key_keyspec(yf->keyspec, y, ysize, x, xsize,
+                                             cm);
+  cache_init(&cache);
+  if (!is_empty) {
+    eb.y = y;
+    eb.ysize = ysize;
+    eb.cm = cm;
+    eb.lo = 0;
+    eb.hi = (off_t)-1;
+    eb.limit = hi;
+    cache.eb = &eb;
+  }
+  *start_out = start = search_way(yf, &cache, idx, lo, start_hi, hint,
+                                  x, xsize, CM_LE);
+  yf->stats.start_usec += yfstats_usec(yf) - usec;
+  if (is_empty) {
+    *end_out = start;
+  } else {
+    usec = yfstats_usec(yf);
+    /* Don't use a shared cache, because x or cm are different. */
+    cache_init(&cache);
+    lo = eb.lo > start ? eb.lo : start;
+    if (hi + 0ULL > eb.hi + 0ULL) hi = eb.hi;
+    if (hi + 0ULL < start + 0ULL) hi = start;  /* -U before -F: empty. */
+    /* Only if not sorted, or lo is beyond the -U limit. */
+    if (lo + 0ULL > hi + 0ULL) lo = hi;
+    if (eb.hi != (off_t)-1 && hi == eb.hi && hi - lo <= yf->block_size &&
+        get_fofs(yf, lo) >= hi) {
+      /* The lines read already pin the end: no line starts in [lo, hi),
+       * and the line at hi is beyond it, e.g. for a key on a single line.
+       * This saves the probes of bisecting within that line, and (because
+       * of the size check) never reads more than the bisection would.
+       */
+      *end_out = hi;
+    } else if (hint >= 0) {
+      /* The end is probably near the start, gallop to it. */
+      *end_out = gallop_way(yf, &cache, lo, hi, HINT_FIRST_STEP,
+                            y, ysize, cm);
+    } else {
+      *end_out = search_way(yf, &cache, idx, lo, hi, (off_t)-1,
+                            y, ysize, cm);
+    }
+    yf->stats.end_usec += yfstats_usec(yf) - usec;
+  }
+}
+
+/* --- Library API (see pts_lbsearch.h)
+ *
+ * None of the functions below exit(3) or write to stdout or stderr, errors
+ * are reported in yf->err instead.
+ */
+
+struct AssertLbsModeMatchesCompareMode_Struct {
+  int  AssertLbsModeMatchesCompareMode :
+      (int)LBS_LE == (int)CM_LE && (int)LBS_LT == (int)CM_LT &&
+      (int)LBS_LP == (int)CM_LP;
+};
+
+/** Makes yf ignore the incomplete last line (if any), for flag -i. */
+STATIC void yfignore_incomplete(yfile *yf) {
+  off_t size = yfgetsize(yf);
+  int c;
+  while (size != 0) {
+    yfseek_set(yf, size - 1);
+    if ((c = YFGETCHAR(yf)) < 0 || c == '\n') break;
+    --size;
+  }
+  yflimit(yf, size);
+}
+
+/* Returns the size of key[:key_size] before the first '\n'. */
+STATIC size_t get_key_size(const char *key, size_t key_size) {
+  const char *q = (const char*)memchr(key, '\n', key_size);
+  return q ? (size_t)(q - key) : key_size;
+}
+
+#define LBS_LINE_CACHE_SIZE 32  /* For LBS_LINE_CACHE. */
+
+struct lbs_file {
+  yfile yf;
+  struct lbidx idx;
+  ybool has_idx;
+};
+
+int lbs_open(lbs_file **lbf_out, const char *pathname, unsigned flags,
+             int block_size) {
+  lbs_file *lbf;
+  *lbf_out = NULL;
+  if (block_size != 0 && ((block_size & (block_size - 1)) != 0 ||
+      block_size < YF_MIN_BLOCK_SIZE || block_size > YF_MAX_BLOCK_SIZE)) {
+    return LBS_ERR_ARG;
+  }
+  if (!(lbf = (lbs_file*)malloc(sizeof(*lbf)))) return LBS_ERR_NOMEM;
+  *lbf_out = lbf;
+  lbf->has_idx = 0;
+  yfopen(&lbf->yf, pathname, (off_t)-1);
+  if (lbf->yf.err != LBS_OK) return lbf->yf.err;
+  if (flags & LBS_LINE_CACHE) yfsetlcache(&lbf->yf, LBS_LINE_CACHE_SIZE);
+  if (block_size != 0 || (flags & LBS_DIRECT)) {
+    /* It's not an error if O_DIRECT is not supported. */
+    (void)yfsetbuf(&lbf->yf, block_size != 0 ? block_size : YF_READ_BUF_SIZE,
+                   (flags & LBS_DIRECT) != 0);
+  }
+  if ((flags & LBS_MMAP) && !(flags & LBS_DIRECT) && yfmap(&lbf->yf)) {
+    yfadvise(&lbf->yf, 0);
+  }
+  if ((flags & LBS_INDEX) &&
+      lbidx_open(&lbf->idx, &lbf->yf, pathname) == LBIDX_OK) {
+    lbf->has_idx = 1;
+  }
+  if (flags & LBS_LINE_INDEX) (void)lbofs_open(&lbf->yf, pathname);
+  if (flags & LBS_IGNORE_INCOMPLETE) yfignore_incomplete(&lbf->yf);
+  lbf->yf.is_interpolated = (flags & LBS_INTERPOLATE) != 0;
+  lbf->yf.is_block_aligned = (flags & LBS_BLOCK_ALIGNED) != 0;
+  return lbf->yf.err;
+}
+
+void lbs_close(lbs_file *lbf) {
+  if (!lbf) return;
+  if (lbf->has_idx) lbidx_close(&lbf->idx);
+  yfclose(&lbf->yf);
+  free(lbf);
+}
+
+lbs_off_t lbs_get_size(const lbs_file *lbf) {
+  return lbf->yf.size;
+}
+
+int lbs_search(lbs_file *lbf, lbs_mode mode, const char *key,
+               size_t key_size, lbs_off_t *ofs_out) {
+  return lbs_search_from(lbf, mode, key, key_size, 0, -1, -1, ofs_out);
+}
+
+int lbs_search_from(lbs_file *lbf, lbs_mode mode, const char *key,
+                    size_t key_size, lbs_off_t lo, lbs_off_t hi,
+                    lbs_off_t hint, lbs_off_t *ofs_out) {
+  yfile *yf = &lbf->yf;
+  struct cache cache;
+  off_t a = (off_t)lo, b = (off_t)hi;
+  if ((unsigned)mode > (unsigned)LBS_LP || lo < 0 || hi < -1 ||
+      a != lo || b != hi || (off_t)hint != hint) {
+    return LBS_ERR_ARG;
+  }
+  key_size = get_key_size(key, key_size);
+  if (a > yfgetsize(yf)) a = yfgetsize(yf);  /* Also for an empty file. */
+  if (hint > yfgetsize(yf)) hint = yfgetsize(yf);
+  cache_init(&cache);
+  *ofs_out = search_way(yf, &cache, lbf->has_idx ? &lbf->idx : NULL, a, b,
+                        (off_t)hint, key, key_size, (compare_mode_t)mode);
+  return yf->err;
+}
+
+int lbs_range(lbs_file *lbf, lbs_mode mode, const char *x, size_t xsize,
+              const char *y, size_t ysize,
+              lbs_off_t *start_out, lbs_off_t *end_out) {
+  off_t start, end;
+  if ((unsigned)mode > (unsigned)LBS_LP) return LBS_ERR_ARG;
+  xsize = get_key_size(x, xsize);
+  if (y) {
+    ysize = get_key_size(y, ysize);
+  } else {
+    y = x;
+    ysize = xsize;
+  }
+  bisect_interval(&lbf->yf, lbf->has_idx ? &lbf->idx : NULL, 0, (off_t)-1,
+                  (off_t)-1, (compare_mode_t)mode, x, xsize, y, ysize,
+                  &start, &end);
+  *start_out = start;
+  *end_out = end;
+  return lbf->yf.err;
+}
+
+int lbs_read(lbs_file *lbf, lbs_off_t ofs, char *buf, size_t size,
+             size_t *got_out) {
+  yfile *yf = &lbf->yf;
+  const char *p;
+  int n;
+  size_t got = 0;
+  if (ofs < 0) return LBS_ERR_ARG;
+  yfseek_set(yf, ofs);
+  while ((n = yfpeek(yf, size - got > 0x40000000 ? 0x40000000 :
+                     (off_t)(size - got), &p)) > 0) {
+    memcpy(buf + got, p, n);
+    yfseek_cur(yf, n);
+    got += n;
+  }
+  *got_out = got;
+  return yf->err;
+}
+
+int lbs_errno(const lbs_file *lbf) {
+  return lbf->yf.err == LBS_OK ? 0 : lbf->yf.err_errno;
+}
+
+/* Indexed by lbs_error. */
+static const char *const lbs_error_messages[] = {
+  "success", "open", "input not seekable", "lseek", "read", "out of memory",
+  "invalid argument", "unsupported or corrupt compressed input",
+  "unexpected HTTP response",
+};
+
+const char *lbs_strerror(int err) {
+  return (unsigned)err < sizeof(lbs_error_messages) /
+      sizeof(lbs_error_messages[0]) ? lbs_error_messages[err] :
+      "unknown error";
+}
+
+#ifndef PTS_LBSEARCH_NO_MAIN
+
+/* --- main */
+
+STATIC __attribute__((noreturn)) void usage_error(
+    const char *argv0, const char *msg) {
+  die5_code("Binary search (bisection) in a sorted text file\n"
+            "Usage: ", argv0, "-<flags> <sorted-text-file> <key-x> [<key-y>]\n"
+            "<key-x> is the first key to search for\n"
+            "<key-y> is the last key to search for; default is <key-x>\n"
+            "Flags:\n"
+            "e: do bisect_left, open interval end\n"
+            "t: do bisect_right, closed interval end\n"
+            "b: do bisect_left for interval start (default)\n"
+            "a: do bisect_right for interval start (for append position)\n"
+            "p: do prefix search\n"
+            "c: print file contents (default)\n"
+            "o: print file offsets\n"
+            "q: don't print anything, just detect if there is a match\n"
+            "n: print the number of matching lines\n"
+            "N: print an estimate of the number of matching lines (faster)\n"
+            "R: print <start> <end> <count>: offsets and the number of lines\n"
+            "i: ignore incomplete last line (may be appended to right now)\n"
+            "m: use mmap(2) instead of read(2) if possible\n"
+            "d: use O_DIRECT, bypass the page cache (not with -m)\n"
+            "x: use sidecar index <sorted-text-file>.lbidx if up to date\n"
+            "I: build sidecar index, every <key-x>th (default: 256) line\n"
+            "l: use line-offset index <sorted-text-file>.lbofs if up to date\n"
+            "L: build line-offset index <sorted-text-file>.lbofs\n"
+            "B: batch mode: read queries from stdin instead of <key-x>,\n"
+            "   one per line: <key-x> or <key-x><Tab><key-y>\n"
+            "M: merge join: like -B, but stdin is sorted, answer each query\n"
+            "   right away, gallop from the previous result\n"
+            "f: follow: after the range, wait for and print matching lines\n"
+            "   appended later, until a line beyond the range (implies -i)\n"
+            "s: sharded: <sorted-text-file> lists shard pathnames, one per\n"
+            "   line (- for stdin), search all, merge the results\n"
+            "v: print I/O and cache statistics to stderr\n"
+            "g: compare keys as decimal numbers, like sort -n (not with -p)\n"
+            "u: interpolation search, for uniformly distributed keys\n"
+            "r: probe whole blocks, use all lines in each block read\n"
+            "j<n>: answer batch queries (-B), shards (-s) or filter (-G) in\n"
+            "   <n> threads (if compiled with pthreads)\n"
+            "A<n>: keep <n> batch reads in flight (with -B), e.g. -A32\n"
+            "P<n>: prefetch probes <n> (at most 3) levels ahead, e.g. -P2\n"
+            "C<n>: cache the last <n> (at most 64) lines read, e.g. -C32\n"
+            "F<ofs>: treat lines starting before <ofs> as smaller than keys\n"
+            "U<ofs>: treat lines starting at <ofs> or later as larger\n"
+            "H<ofs>: gallop from offset <ofs> (of a nearby key) first\n"
+            "k<n>: compare field <n> (Tab-separated), like sort -k<n>,<n>\n"
+            "T<c>: with -k, fields are separated by byte <c>, e.g. -k2T,\n"
+            "w<n>: compare only the first <n> bytes of the keys (fixed width)\n"
+            "G<s>: print only the lines containing <s> (rest of the flags),\n"
+            "   scanning in <n> threads with -j<n>, e.g. -pGerror\n"
+            "S: server: -S[dilmruxC<n>P<n>] <socket> <sorted-text-file>...\n"
+            "Environment: PTS_LBSEARCH_BLOCK_SIZE=<bytes>[k|m], a power of 2\n"
+            "usage error: ", msg, "\n",
+            1);
+}
+
+/* Returns the block size in the environment variable
+ * PTS_LBSEARCH_BLOCK_SIZE (e.g. "65536" or "64k"), or 0 if it's not set.
+ */
+STATIC int get_env_block_size(void) {
+  const char *value = getenv("PTS_LBSEARCH_BLOCK_SIZE");
+  char *endp;
+  unsigned long block_size;
+  if (!value || !*value) return 0;
+  block_size = strtoul(value, &endp, 10);
+  if (*endp == 'k' || *endp == 'K') {
+    block_size <<= 10;
+    ++endp;
+  } else if (*endp == 'm' || *endp == 'M') {
+    block_size <<= 20;
+    ++endp;
+  }
+  if (*endp != '\0' || (block_size & (block_size - 1)) != 0 ||
+      block_size < YF_MIN_BLOCK_SIZE || block_size > YF_MAX_BLOCK_SIZE) {
+    die1("error: PTS_LBSEARCH_BLOCK_SIZE must be a power of 2 between 512 "
+         "and 64m");
+  }
+  return (int)block_size;
+}
+
+STATIC void write_all_to_stdout(const char *buf, size_t size) {
+  size_t got = write(STDOUT_FILENO, buf, size);
+  if (got == size) {
+  } else if (got + 1U == 0U) {
+   die2_strerror("error: write stdout", "");
+  } else {
+   die1("error: short write");
+  }
+}
+
+/* Output buffer for the many small writes in batch mode. */
+static char obuf[8192];
+static size_t obuf_size;
+
+STATIC void flush_stdout(void) {
+  if (obuf_size != 0) {
+    write_all_to_stdout(obuf, obuf_size);
+    obuf_size = 0;
+  }
+}
+
+STATIC void write_buffered_to_stdout(const char *buf, size_t size) {
+  if (size > sizeof(obuf) - obuf_size) {
+    flush_stdout();
+    if (size >= sizeof(obuf)) {
+      write_all_to_stdout(buf, size);
+      return;
+    }
+  }
+  memcpy(obuf + obuf_size, buf, size);
+  obuf_size += size;
+}
+
+/* Ranges shorter than this are copied through the read buffer of yf, which
+ * probably already contains a part of them.
+ */
+#define SEND_RANGE_MIN_SIZE 65536
+#define SEND_RANGE_BUF_SIZE (1 << 20)  /* Win32 only. */
+
+/* Copies bytes [start, start + size) of yf to out_fd (e.g. stdout) within
+ * the kernel, without copying the data to user space. Uses
+ * copy_file_range(2) if out_fd is a regular file, and sendfile(2) otherwise
+ * (works with pipes and sockets). Returns the number of bytes copied, which
+ * is less than size if zero-copy is not supported for the file descriptors
+ * (or on error, or if the file got shorter), and then the caller should
+ * copy the rest.
+ */
+STATIC off_t send_range_to_fd(yfile *yf, int out_fd, off_t start,
+                              off_t size) {
+  off_t done = 0;
+#ifdef HAVE_SENDFILE
+  off_t ofs = start;
+  ssize_t got;
+  size_t n;
+#ifdef HAVE_COPY_FILE_RANGE
+  struct stat st;
+  ybool is_regular = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+  if (yf->fd < 0 || yf->is_direct || yf->read_at) return 0;
+  while (done < size) {
+    n = size - done > 0x40000000 ? 0x40000000 : (size_t)(size - done);
+#ifdef HAVE_COPY_FILE_RANGE
+    if (is_regular) {
+      /* Fails e.g. with EXDEV on old kernels, or if stdout is O_APPEND. */
+      if ((got = copy_file_range(yf->fd, &ofs, out_fd, NULL, n, 0)) <= 0) {
+        is_regular = 0;
+        continue;  /* Retry with sendfile(2). */
+      }
+    } else
+#endif
+    if ((got = sendfile(out_fd, yf->fd, &ofs, n)) <= 0) {
+      break;
+    }
+    done += got;
+  }
+#else
+#ifdef HAVE_WIN32_MAP
+  /* No zero-copy on Win32 (TransmitFile needs a socket), but reading
+   * SEND_RANGE_BUF_SIZE bytes at a time instead of a block is much faster
+   * on file servers. The mapping (flag -m) is written directly instead.
+   */
+  char *buf;
+  int got;
+  if (yf->fd < 0 || yf->is_direct || yf->read_at || yf->map ||
+      !(buf = (char*)malloc(SEND_RANGE_BUF_SIZE))) {
+    return 0;
+  }
+  (void)out_fd;  /* Always STDOUT_FILENO. */
+  ++yf->stats.lseek_count;
+  if (lseek(yf->fd, start, SEEK_SET) == start) {
+    while (done < size) {
+      got = size - done > SEND_RANGE_BUF_SIZE ? SEND_RANGE_BUF_SIZE :
+          (int)(size - done);
+      ++yf->stats.read_count;
+      if ((got = read(yf->fd, buf, got)) <= 0) break;
+      yf->stats.read_bytes += got;
+      write_all_to_stdout(buf, got);
+      done += got;
+    }
+  }
+  free(buf);
+  /* Make the next yfgetc lseek(2), the file offset has changed. */
+  yf->p = yf->rend = yf->rbuf + yf->block_size + 1;
+  yf->ofs = -(off_t)(yf->block_size + 1);
+#else
+  (void)yf; (void)out_fd; (void)start; (void)size;
+#endif
+#endif
+  return done;
+}
+
+STATIC void print_range(yfile *yf, off_t start, off_t end) {
+  int need;
+  const char *buf;
+  if (start >= end) return;
+  if (end - start >= SEND_RANGE_MIN_SIZE) {
+    start += send_range_to_fd(yf, STDOUT_FILENO, start, end - start);
+    if (start >= end) return;
+  }
+  yfseek_set(yf, start);
+  end -= start;
+  while ((need = yfpeek(yf, end, &buf)) > 0) {
+    write_all_to_stdout(buf, need);
+    yfseek_cur(yf, need);
+    end -= need;
+  }
+  /* \n is not printed at EOF if there isn't any. */
+}
+
+/* Returns the number of '\n' bytes in buf[:size]. It compares a word
+ * (sizeof(unsigned long) bytes) at a time, which is as fast as memchr(3) for
+ * short lines, and 3 times faster than comparing bytes.
+ */
+STATIC off_t count_newlines(const char *buf, size_t size) {
+  const unsigned long ones = ~0UL / 255, highs = ones << 7, lows = ~highs;
+  unsigned long w, sum;
+  off_t count = 0;
+  int i;
+  while (size >= sizeof(w) * 8) {
+    /* Each byte of sum counts the '\n' bytes at that position, in 8 words. */
+    for (sum = 0, i = 0; i < 8; ++i, buf += sizeof(w)) {
+      memcpy(&w, buf, sizeof(w));  /* buf may be unaligned. */
+      w ^= ones * '\n';  /* Now '\n' bytes are 0. */
+      sum += (~(((w & lows) + lows) | w) & highs) >> 7;  /* 1 for a 0 byte. */
+    }
+    count += (sum * ones) >> (sizeof(w) * 8 - 8);  /* Add up the bytes. */
+    size -= sizeof(w) * 8;
+  }
+  for (; size > 0; --size) {
+    if (*buf++ == '\n') ++count;
+  }
+  return count;
+}
+
+/* Returns the number of lines in [start, end), which must be at line starts
+ * (or EOF). It counts an incomplete last line as well.
+ */
+STATIC off_t count_lines(yfile *yf, off_t start, off_t end) {
+  off_t count = 0;
+  int need;
+  const char *buf;
+  if (start >= end) return 0;
+  if (yf->lbofs) return lbofs_line(yf, end) - lbofs_line(yf, start);
+  yfseek_set(yf, start);
+  end -= start;
+  while ((need = yfpeek(yf, end, &buf)) > 0) {
+    count += count_newlines(buf, need);
+    if ((end -= need) == 0 && buf[need - 1] != '\n') ++count;
+    yfseek_cur(yf, need);
+  }
+  return count;
+}
+
+#define ESTIMATE_SAMPLE_COUNT 64
+/* Each sample of estimate_lines reads lines until this many bytes. */
+#define ESTIMATE_SAMPLE_SIZE 4096
+/* Ranges up to this size are counted exactly by estimate_lines. */
+#define ESTIMATE_EXACT_SIZE 65536
+
+/* Returns an estimate of count_lines(yf, start, end), based on the average
+ * length of the lines read at ESTIMATE_SAMPLE_COUNT evenly spaced offsets
+ * in [start, end). Each sample reads complete lines until it has read
+ * ESTIMATE_SAMPLE_SIZE bytes, so it takes the same time for any range size.
+ */
+STATIC off_t estimate_lines(yfile *yf, off_t start, off_t end) {
+  off_t sample_size = 0, sample_count = 0, ofs = start, fofs, bol;
+  int i, need;
+  const char *buf, *q;
+  if (yf->lbofs || end - start <= ESTIMATE_EXACT_SIZE) {
+    return count_lines(yf, start, end);
+  }
+  for (i = 0; i < ESTIMATE_SAMPLE_COUNT; ++i) {
+    fofs = start + (end - start) / ESTIMATE_SAMPLE_COUNT * i;
+    if (fofs < ofs) continue;  /* Already read by the previous sample. */
+    if ((fofs = bol = get_fofs(yf, fofs)) >= end) break;
+    for (ofs = fofs, yfseek_set(yf, ofs);
+         (need = yfpeek(yf, end - ofs, &buf)) > 0;) {
+      if ((q = (const char*)memchr(buf, '\n', need)) != NULL) {
+        need = q - buf + 1;
+      }
+      yfseek_cur(yf, need);
+      ofs += need;
+      if (q) {
+        ++sample_count;
+        bol = ofs;
+        if (ofs - fofs >= ESTIMATE_SAMPLE_SIZE) break;
+      }
+    }
+    sample_size += bol - fofs;  /* Only complete lines. */
+  }
+  if (sample_count == 0) return 1;  /* Only an incomplete last line. */
+  return ((end - start) * sample_count + (sample_size >> 1)) / sample_size;
+}
+
+/* Returns count_lines(yf, start, end) (or estimate_lines if is_estimate)
+ * for the range [start, end) of x[:xsize] and y[:ysize] (NULL means x)
+ * found with cm. The lines of an exact match (-t with y == x, comparing
+ * entire lines) are all x followed by '\n', so a run of them (of any
+ * length) is counted from its size, without reading it.
+ */
+STATIC off_t count_range_lines(yfile *yf, off_t start, off_t end,
+                               compare_mode_t cm, const char *x, size_t xsize,
+                               const char *y, size_t ysize,
+                               ybool is_estimate) {
+  if (cm == CM_LT && !yf->keyspec &&
+      (!y || (ysize == xsize && 0 == memcmp(x, y, xsize)))) {
+    /* + xsize: the last line may be incomplete (without the '\n'). */
+    return start < end ? (end - start + xsize) / (xsize + 1) : 0;
+  }
+  return is_estimate ? estimate_lines(yf, start, end) :
+      count_lines(yf, start, end);
+}
+
+#if defined(__i386__) && __SIZEOF_INT__ == 4 && __SIZEOF_LONG_LONG__ == 8 && \
+    defined(__GNUC__)
+/* A smaller implementation of division for format_unsigned, which doesn't
+ * call the __udivdi3 (for 64-bit /) and __umoddi3 (for 64-bit %) functions
+ * from libgcc. This implementation can be smaller because the divisor (b) is
+ * only 32 bits.
+ */
+
+typedef unsigned UInt32;
+typedef unsigned long long UInt64;
+/* Returns *a % b, and sets *a = *a_old / b; */
+STATIC __inline__ UInt32 UInt64DivAndGetMod(UInt64 *a, UInt32 b) {
+  /* http://stackoverflow.com/a/41982320/97248 */
+  UInt32 upper = ((UInt32*)a)[1], r;
+  ((UInt32*)a)[1] = 0;
+  if (upper >= b) {
+    ((UInt32*)a)[1] = upper / b;
+    upper %= b;
+  }
+  __asm__("divl %2" : "=a" (((UInt32*)a)[0]), "=d" (r) :
+      "rm" (b), "0" (((UInt32*)a)[0]), "1" (upper));
+  return r;
+}
+/* Returns *a % b, and sets *a = *a_old / b; */
+STATIC __inline__ UInt32 UInt32DivAndGetMod(UInt32 *a, UInt32 b) {
+  /* gcc-4.4 is smart enough to optimize the / and % to a single divl. */
+  const UInt32 r = *a % b;
+  *a /= b;
+  return r;
+}
+
+/** Returns p + size of formatted output. */
+STATIC char *format_unsigned(char *p, off_t i) {
+  struct AssertOffTSizeIs4or8_Struct {
+    int  AssertOffTSizeIs4or8 : sizeof(i) == 4 || sizeof(i) == 8;
+  };
+  char *q = p, *result, c;
+  assert(i >= 0);
+  do {
+    *q++ = '0' + (
+        sizeof(i) == 8 ? UInt64DivAndGetMod((UInt64*)&i, 10) :
+        sizeof(i) == 4 ? UInt32DivAndGetMod((UInt32*)&i, 10) :
+        0);  /* 0 never happens, see AssertOffTSizeIs4or8 above. */
+  } while (i != 0);
+  result = q--;
+  while (p < q) {  /* Reverse the string between p and q. */
+    c = *p; *p++ = *q; *q-- = c;
+  }
+  return result;
+}
+#else
+
+/** Returns p + size of formatted output. */
+static char *format_unsigned(char *p, off_t i) {
+  char *q = p, *result, c;
+  assert(i >= 0);
+  do {
+    *q++ = '0' + (i % 10);
+  } while ((i /= 10) != 0);
+  result = q--;
+  while (p < q) {  /* Reverse the string between p and q. */
+    c = *p; *p++ = *q; *q-- = c;
+  }
+  return result;
+}
+#endif
+
+typedef enum printing_t {
+  PR_OFFSETS,
+  PR_CONTENTS,
+  PR_DETECT,
+  PR_COUNT,  /* Flag -n. */
+  PR_ESTIMATE,  /* Flag -N. */
+  PR_RUN,  /* Flag -R: offsets and count. */
+  PR_UNSET,
+} printing_t;
+
+typedef enum incomplete_t {
+  IN_IGNORE,  /* Ignore incomplete last line of file. */
+  IN_USE,  /* Use incomplete last line of file as if it had a trailin '\n'. */
+  IN_UNSET,  /* Not set yet. Most functions do not support it. */
+} incomplete_t;
+
+/* How to open the input file, from the command-line flags. */
+struct input_options {
+  const char *pathname;
+  int block_size;  /* 0 for the default. */
+  ybool is_direct;
+  ybool is_mmap;
+  ybool is_index_used;
+  ybool is_lbofs_used;  /* Flag -l. */
+  ybool is_stats;
+  int prefetch_depth;  /* Flag -P<n>, or 0. */
+  ybool is_interpolated;  /* Flag -u. */
+  ybool is_block_aligned;  /* Flag -r. */
+  int lcache_size;  /* Flag -C<n>, or 0. */
+  incomplete_t incomplete;
+  const struct keyspec *keyspec;  /* Flags -k, -T, -w and -g, or NULL. */
+};
+
+/** Opens opts->pathname in yf, and also its sidecar index in idx if
+ * requested. Returns idx if the index is used, otherwise NULL. Prints the
+ * warnings if is_verbose is true. On error, yf->err is set (and NULL is
+ * returned), the caller should check it.
+ */
+STATIC struct lbidx *try_open_input(yfile *yf, struct lbidx *idx,
+                                    const struct input_options *opts,
+                                    ybool is_verbose) {
+  lbidx_status_t status = LBIDX_MISSING;
+  yfopen(yf, opts->pathname, (off_t)-1);
+  if (opts->lcache_size != 0 && yf->err == LBS_OK) {
+    yfsetlcache(yf, opts->lcache_size);
+  }
+  if ((opts->block_size != 0 || opts->is_direct) &&
+      !yfsetbuf(yf, opts->block_size != 0 ? opts->block_size :
+                YF_READ_BUF_SIZE, opts->is_direct) && is_verbose) {
+    write5_stderr("warning: O_DIRECT not supported", "", "", "", "\n");
+  }
+  if (yf->err != LBS_OK) return NULL;
+  yf->keyspec = opts->keyspec;
+  yf->stats.is_timed = opts->is_stats;
+  yf->prefetch_depth = opts->prefetch_depth;
+  yf->is_interpolated = opts->is_interpolated;
+  yf->is_block_aligned = opts->is_block_aligned;
+  if (opts->is_mmap && yfmap(yf)) yfadvise(yf, 0);
+  /* Before yfignore_incomplete, because it checks the file size. */
+  if (opts->is_index_used) status = lbidx_open(idx, yf, opts->pathname);
+  if (status == LBIDX_STALE && is_verbose) {
+    write5_stderr("warning: ignoring stale index: ", opts->pathname,
+                  ".lbidx", "", "\n");
+  }
+  if (opts->is_lbofs_used &&
+      lbofs_open(yf, opts->pathname) == LBIDX_STALE && is_verbose) {
+    write5_stderr("warning: ignoring stale line-offset index: ",
+                  opts->pathname, ".lbofs", "", "\n");
+  }
+  if (opts->incomplete == IN_IGNORE) yfignore_incomplete(yf);
+  return status == LBIDX_OK ? idx : NULL;
+}
+
+/** Same as try_open_input, but exits on error. */
+STATIC struct lbidx *open_input(yfile *yf, struct lbidx *idx,
+                                const struct input_options *opts,
+                                ybool is_verbose) {
+  struct lbidx *idxp = try_open_input(yf, idx, opts, is_verbose);
+  yfcheck(yf, opts->pathname);
+  return idxp;
+}
+
+/* --- Tail-follow (flag -f)
+ *
+ * For sorted files which are being appended to (e.g. timestamp-keyed
+ * logs). If the printed range ends at EOF, lines appended later may also
+ * be in the range: follow_range waits for the file to grow, and prints the
+ * matching complete lines appended, by bisecting only the appended part,
+ * until a line beyond the range is appended. It waits with inotify(7) on
+ * Linux and kqueue(2) on the BSDs and macOS, but for at most
+ * FOLLOW_POLL_MSEC (in case a change is not notified, e.g. on NFS), and
+ * elsewhere it checks the file size every FOLLOW_POLL_MSEC.
+ */
+
+#define FOLLOW_POLL_MSEC 1000
+
+struct follow_watch {
+  int fd;  /* inotify(7) or kqueue(2) file descriptor, or -1 for polling. */
+};
+
+/* Starts watching the file pathname, opened as fd, for changes. */
+STATIC void follow_watch_open(struct follow_watch *w, int fd,
+                              const char *pathname) {
+#ifdef HAVE_KQUEUE
+  struct kevent ev;
+  (void)pathname;
+  if ((w->fd = kqueue()) >= 0) {
+    EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND, 0, NULL);
+    if (kevent(w->fd, &ev, 1, NULL, 0, NULL) < 0) {
+      close(w->fd);
+      w->fd = -1;
+    }
+  }
+#else
+  (void)fd;
+  w->fd = -1;
+#ifdef HAVE_INOTIFY
+  if ((w->fd = inotify_init()) >= 0 &&
+      inotify_add_watch(w->fd, pathname, IN_MODIFY) < 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+#else
+  (void)pathname;
+#endif
+#endif
+}
+
+STATIC void follow_watch_close(struct follow_watch *w) {
+  if (w->fd >= 0) close(w->fd);
+}
+
+/* Waits until the file watched by w has probably changed, but for at most
+ * FOLLOW_POLL_MSEC.
+ */
+STATIC void follow_wait(struct follow_watch *w) {
+#ifdef HAVE_KQUEUE
+  struct kevent ev;
+  struct timespec ts;
+  if (w->fd >= 0) {
+    ts.tv_sec = FOLLOW_POLL_MSEC / 1000;
+    ts.tv_nsec = FOLLOW_POLL_MSEC % 1000 * 1000000L;
+    (void)kevent(w->fd, NULL, 0, &ev, 1, &ts);
+    return;
+  }
+#endif
+#ifdef HAVE_INOTIFY
+  char buf[4096];
+  struct pollfd pfd;
+  if (w->fd >= 0) {
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, FOLLOW_POLL_MSEC) > 0) {
+      (void)!read(w->fd, buf, sizeof(buf));  /* Drain the events. */
+    }
+    return;
+  }
+#endif
+  (void)w;
+#ifdef HAVE_POLL
+  (void)poll(NULL, 0, FOLLOW_POLL_MSEC);
+#else
+  sleep((FOLLOW_POLL_MSEC + 999) / 1000);
+#endif
+}
+
+/** Called after printing the range of x and y (see bisect_interval) in yf
+ * (with flag -i, and not mmap(2)ed), which ends at end == yfgetsize(yf).
+ * Prints the lines in the range which are appended later, as they are
+ * appended, and returns (true iff any line was printed) only after a line
+ * beyond the range has been appended. Lines starting before lo (flag -F)
+ * are not printed.
+ */
+STATIC ybool follow_range(yfile *yf, const char *pathname, off_t lo,
+                          off_t end, compare_mode_t cm,
+                          const char *x, size_t xsize,
+                          const char *y, size_t ysize) {
+  struct follow_watch w;
+  struct stat st;
+  off_t seen_size = -1, start;
+  ybool is_found = 0;
+  follow_watch_open(&w, yf->fd, pathname);
+  for (;;) {
+    if (fstat(yf->fd, &st) != 0) die2_strerror("error: fstat ", pathname);
+    if (st.st_size < yfgetsize(yf)) {
+      die5_code("error: file truncated while following: ", pathname, "",
+                "", "\n", 2);
+    }
+    if (st.st_size == seen_size) {
+      follow_wait(&w);
+      continue;
+    }
+    seen_size = st.st_size;
+    yfgrow(yf, seen_size);
+    yfignore_incomplete(yf);  /* The last line may not be complete yet. */
+    if (yfgetsize(yf) == end) continue;
+    /* Gallop from the old EOF, where the result usually is. */
+    bisect_interval(yf, NULL, lo > end ? lo : end, (off_t)-1, end, cm,
+                    x, xsize, y, ysize, &start, &end);
+    yfcheck(yf, pathname);
+    print_range(yf, start, end);
+    yfcheck(yf, pathname);
+    if (start < end) is_found = 1;
+    if (end < yfgetsize(yf)) break;  /* A line beyond the range. */
+  }
+  follow_watch_close(&w);
+  return is_found;
+}
+
+/* --- Batch mode (flag -B)
+ *
+ * Queries are read from stdin (one per line: <key-x> or <key-x>\t<key-y>),
+ * sorted by key, and answered in sorted order using a single yfile, so that
+ * the lo of each search can be the start offset of the previous query (it
+ * never decreases), and the read buffer is reused between nearby keys.
+ * Results are printed in input order:
+ *
+ * * -o: "<start> <end>\n" per query, or "<start>\n" for -eo, -aeo with
+ *   single-key queries (like without -B);
+ * * -q: "1\n" if the query has a match, "0\n" otherwise;
+ * * -c: the matching lines, followed by a '\0' byte per query.
+ */
+
+struct query {
+  const char *x;
+  const char *y;  /* NULL if the query has only <key-x>. */
+  size_t xsize;
+  size_t ysize;
+  off_t start;
+  off_t end;
+};
+
+/* Returns a malloc()ed buffer with all data read from fd (e.g. stdin, name
+ * is used in error messages), *size_out is its size.
+ */
+STATIC char *read_all_fd(int fd, const char *name, size_t *size_out) {
+  size_t size = 0, capacity = 8192;
+  char *buf = (char*)malloc(capacity), *new_buf;
+  int got;
+  if (!buf) die1("error: out of memory");
+  for (;;) {
+    if (size == capacity) {
+      if ((capacity <<= 1) <= size ||
+          !(new_buf = (char*)realloc(buf, capacity))) {
+        die1("error: out of memory");
+      }
+      buf = new_buf;
+    }
+    got = read(fd, buf + size,
+               capacity - size > 0x40000000U ? 0x40000000U : capacity - size);
+    if (got == 0) break;
+    if (got < 0) die2_strerror("error: read ", name);
+    size += got;
+  }
+  *size_out = size;
+  return buf;
+}
+
+/* Compares a[:asize] with b[:bsize] lexicographically, like memcmp. */
+STATIC int compare_keys(const char *a, size_t asize,
+                        const char *b, size_t bsize) {
+  const int c = memcmp(a, b, asize < bsize ? asize : bsize);
+  return c != 0 ? c : asize < bsize ? -1 : asize > bsize;
+}
+
+/* Same as compare_keys, but compares the keys by ks (may be NULL). */
+STATIC int compare_keys_keyspec(const struct keyspec *ks,
+                                const char *a, size_t asize,
+                                const char *b, size_t bsize) {
+  if (ks) {
+    if (ks->width != 0 && asize > ks->width) asize = ks->width;
+    if (ks->width != 0 && bsize > ks->width) bsize = ks->width;
+    if (ks->is_numeric) return compare_numbers(a, asize, b, bsize);
+  }
+  return compare_keys(a, asize, b, bsize);
+}
+
+/* The keyspec of the queries compared by compare_query_ptrs, because
+ * qsort(3) doesn't pass it. Set by run_batch.
+ */
+static const struct keyspec *query_keyspec;
+
+/* Sorts by x, then by y (single-key queries first). Used by qsort(3). */
+STATIC int compare_query_ptrs(const void *a, const void *b) {
+  const struct query *qa = *(const struct query* const*)a;
+  const struct query *qb = *(const struct query* const*)b;
+  const int c = compare_keys_keyspec(query_keyspec, qa->x, qa->xsize,
+                                     qb->x, qb->xsize);
+  if (c != 0) return c;
+  if (!qa->y || !qb->y) return !qb->y ? !!qa->y : -1;
+  return compare_keys_keyspec(query_keyspec, qa->y, qa->ysize,
+                              qb->y, qb->ysize);
+}
+
+/* Answers the queries sorted[:qsize] (sorted by compare_query_ptrs). */
+STATIC void resolve_queries(yfile *yf, struct lbidx *idx,
+                            struct query **sorted, size_t qsize,
+                            compare_mode_t cm, compare_mode_t cmstart,
+                            printing_t printing) {
+  size_t i;
+  struct query *qy;
+  const struct query *prev;
+  off_t lo, hi, usec;
+  struct cache cache;
+  for (prev = NULL, lo = 0, i = 0; i < qsize; ++i, prev = qy) {
+    qy = sorted[i];
+    if (prev && compare_query_ptrs(&prev, &qy) == 0) {  /* Duplicate. */
+      qy->start = prev->start;
+      qy->end = prev->end;
+    } else if (!qy->y && cm == CM_LE && printing == PR_OFFSETS) {
+      usec = yfstats_usec(yf);
+      cache_init(&cache);
+      hi = (off_t)-1;
+      if (idx) {
+        lbidx_narrow(idx, yfgetsize(yf), &lo, &hi, qy->x, qy->xsize, cmstart);
+      }
+      qy->start = qy->end = lo =
+          bisect_way(yf, &cache, lo, hi, qy->x, qy->xsize, cmstart);
+      yf->stats.start_usec += yfstats_usec(yf) - usec;
+    } else {
+      bisect_interval(yf, idx, lo, (off_t)-1, (off_t)-1, cm, qy->x, qy->xsize,
+                      qy->y ? qy->y : qy->x, qy->y ? qy->ysize : qy->xsize,
+                      &qy->start, &qy->end);
+      lo = qy->start;
+    }
+  }
+}
+
+#define MAX_THREAD_COUNT 256
+
+/* A thread of flag -j, answering a contiguous range of the sorted queries
+ * with its own file descriptor, read buffer and cache.
+ */
+struct batch_worker {
+  yfile yf;
+  struct lbidx idx;
+  struct lbidx *idxp;
+  struct query **sorted;
+  size_t qsize;
+  compare_mode_t cm;
+  compare_mode_t cmstart;
+  printing_t printing;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+#endif
+};
+
+STATIC void *batch_worker_main(void *arg) {
+  struct batch_worker *w = (struct batch_worker*)arg;
+  resolve_queries(&w->yf, w->idxp, w->sorted, w->qsize, w->cm, w->cmstart,
+                  w->printing);
+  return NULL;
+}
+
+STATIC void yfstats_add(struct yfstats *st, const struct yfstats *other) {
+  st->lseek_count += other->lseek_count;
+  st->read_count += other->read_count;
+  st->read_bytes += other->read_bytes;
+  st->scan_bytes += other->scan_bytes;
+  st->probe_count += other->probe_count;
+  st->cache_hit_count += other->cache_hit_count;
+  st->cache_miss_count += other->cache_miss_count;
+  st->start_usec += other->start_usec;
+  st->end_usec += other->end_usec;
+  st->print_usec += other->print_usec;
+  st->prefetch_count += other->prefetch_count;
+  st->lcache_hit_count += other->lcache_hit_count;
+  st->lcache_miss_count += other->lcache_miss_count;
+  st->inflate_count += other->inflate_count;
+}
+
+/* Answers sorted[:qsize] with thread_count threads (each with its own
+ * yfile), splitting it to contiguous ranges, so that each thread reads
+ * a separate region of the file. yf and idx (may be NULL) are used only for
+ * adding up the statistics.
+ */
+STATIC void resolve_queries_in_threads(
+    yfile *yf, struct lbidx *idx, const struct input_options *opts,
+    struct query **sorted, size_t qsize, compare_mode_t cm,
+    compare_mode_t cmstart, printing_t printing, int thread_count) {
+  struct batch_worker *workers, *w;
+  size_t i, j;
+  if ((size_t)thread_count > qsize) thread_count = qsize ? (int)qsize : 1;
+  workers = (struct batch_worker*)malloc(thread_count * sizeof(*workers));
+  if (!workers) die1("error: out of memory");
+  for (i = j = 0, w = workers; w != workers + thread_count; ++w, i = j) {
+    j = qsize * (w - workers + 1) / thread_count;
+    w->idxp = open_input(&w->yf, &w->idx, opts, 0);
+    w->sorted = sorted + i;
+    w->qsize = j - i;
+    w->cm = cm;
+    w->cmstart = cmstart;
+    w->printing = printing;
+#ifdef HAVE_PTHREAD
+    if (w != workers &&
+        (errno = pthread_create(&w->thread, NULL, batch_worker_main, w))) {
+      die2_strerror("error: pthread_create", "");
+    }
+#endif
+  }
+  /* The first range is answered by this thread. Without pthreads, all. */
+  for (w = workers; w != workers + thread_count; ++w) {
+#ifdef HAVE_PTHREAD
+    if (w != workers) {
+      if ((errno = pthread_join(w->thread, NULL))) {
+        die2_strerror("error: pthread_join", "");
+      }
+      continue;
+    }
+#endif
+    batch_worker_main(w);
+  }
+  for (w = workers; w != workers + thread_count; ++w) {
+    yfcheck(&w->yf, opts->pathname);
+    yfstats_add(&yf->stats, &w->yf.stats);
+    if (w->idxp) {
+      if (idx) yfstats_add(&idx->yf.stats, &w->idx.yf.stats);
+      lbidx_close(w->idxp);
+    }
+    yfclose(&w->yf);
+  }
+  free(workers);
+}
+
+/* --- Asynchronous batch reads (flag -A)
+ *
+ * With flag -A<n>, up to <n> batch queries are searched concurrently, each
+ * in its own slot (with its own yfile and cache). Whenever the next probe
+ * of a query needs a block which is not in the read buffer of its slot, the
+ * read is submitted to io_uring(7), and the other queries make progress
+ * until it completes. Thus up to <n> reads are in flight instead of a
+ * single dependent read. (The rare probes of lines spanning a block
+ * boundary finish with a synchronous read.) If io_uring is not available,
+ * the queries are answered in <n> threads instead, as with flag -j<n>.
+ */
+
+#ifdef HAVE_IO_URING
+struct uring {
+  int fd;
+  unsigned to_submit;  /* Number of SQEs queued by uring_readv. */
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  char *sq_map;
+  char *cq_map;
+  size_t sq_map_size;
+  size_t cq_map_size;
+  size_t sqes_size;
+};
+
+STATIC void uring_close(struct uring *r) {
+  if (r->sq_map != (char*)MAP_FAILED) munmap(r->sq_map, r->sq_map_size);
+  if (r->cq_map != (char*)MAP_FAILED) munmap(r->cq_map, r->cq_map_size);
+  if (r->sqes != (struct io_uring_sqe*)MAP_FAILED) {
+    munmap(r->sqes, r->sqes_size);
+  }
+  close(r->fd);
+}
+
+/** Sets up r for at least entries reads in flight. Returns false if
+ * io_uring(7) is not available (e.g. old kernel, or blocked by seccomp).
+ */
+STATIC ybool uring_open(struct uring *r, unsigned entries) {
+  struct io_uring_params params;
+  long fd;
+  memset(&params, 0, sizeof(params));
+  if ((fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) return 0;
+  r->fd = (int)fd;
+  r->to_submit = 0;
+  r->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_map_size = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_map = (char*)mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+  r->cq_map = (char*)mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size,
+                                       PROT_READ | PROT_WRITE, MAP_SHARED,
+                                       r->fd, IORING_OFF_SQES);
+  if (r->sq_map == (char*)MAP_FAILED || r->cq_map == (char*)MAP_FAILED ||
+      r->sqes == (struct io_uring_sqe*)MAP_FAILED) {
+    uring_close(r);
+    return 0;
+  }
+  r->sq_tail = (unsigned*)(r->sq_map + params.sq_off.tail);
+  r->sq_mask = (unsigned*)(r->sq_map + params.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(r->sq_map + params.sq_off.array);
+  r->cq_head = (unsigned*)(r->cq_map + params.cq_off.head);
+  r->cq_tail = (unsigned*)(r->cq_map + params.cq_off.tail);
+  r->cq_mask = (unsigned*)(r->cq_map + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(r->cq_map + params.cq_off.cqes);
+  return 1;
+}
+
+/** Queues a readv(2) of iov at ofs. The caller must not have more reads in
+ * flight than the entries passed to uring_open.
+ */
+STATIC void uring_readv(struct uring *r, int fd, const struct iovec *iov,
+                        off_t ofs, unsigned user_data) {
+  const unsigned tail = *r->sq_tail;  /* Only we write it. */
+  const unsigned i = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = r->sqes + i;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;  /* IORING_OP_READ needs Linux 5.6. */
+  sqe->fd = fd;
+  sqe->off = ofs;
+  sqe->addr = (size_t)iov;
+  sqe->len = 1;
+  sqe->user_data = user_data;
+  r->sq_array[i] = i;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++r->to_submit;
+}
+
+/** Submits the queued reads, and waits for a read to complete. Returns
+ * false on error.
+ */
+STATIC ybool uring_wait(struct uring *r, unsigned *user_data_out,
+                        int *res_out) {
+  unsigned head;
+  const struct io_uring_cqe *cqe;
+  long got;
+  for (;;) {
+    head = *r->cq_head;  /* Only we write it. */
+    if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) &&
+        r->to_submit == 0) {
+      cqe = r->cqes + (head & *r->cq_mask);
+      *user_data_out = (unsigned)cqe->user_data;
+      *res_out = cqe->res;
+      __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+    got = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+                  head != *r->cq_tail ? 0 : 1, IORING_ENTER_GETEVENTS,
+                  NULL, 0);
+    if (got < 0) {
+      if (errno != EINTR) return 0;
+    } else {
+      r->to_submit -= (unsigned)got;
+    }
+  }
+}
+
+/* A query being answered by resolve_queries_async. */
+struct async_slot {
+  yfile yf;
+  struct lbidx idx;
+  struct lbidx *idxp;
+  struct query *qy;  /* NULL if there are no more queries. */
+  int phase;  /* ASYNC_*. */
+  struct cache cache;
+  struct end_bounds eb;  /* For ASYNC_START. */
+  struct bisect_state st;
+  struct iovec iov;
+  off_t read_ofs;  /* Offset of the block being read into yf.rbuf. */
+};
+
+#define ASYNC_OFFSET 0  /* Single bisect_way, as in flag -eo. */
+#define ASYNC_START 1  /* First bisect_way of bisect_interval. */
+#define ASYNC_END 2  /* Second bisect_way of bisect_interval. */
+
+struct async_batch {
+  struct query **sorted;
+  size_t qsize;
+  size_t next;  /* Index of the next query to start in sorted. */
+  compare_mode_t cm;
+  compare_mode_t cmstart;
+  printing_t printing;
 };
 
-#define CACHE_HAS_0(a) ((a) != 3)
-#define CACHE_HAS_1(a) ((a) < 2)
-#define CACHE_GET_ACTIVE(a) ((a) & 1)  /* Valid only if CACHE_HAS_0(a). */
+/* Starts the search for the next query (skipping duplicates) in slot.
+ * Returns false if there are no more queries. Does the same as
+ * resolve_queries, except that lo isn't seeded from the previous query.
+ */
+STATIC ybool async_start_query(struct async_slot *slot,
+                               struct async_batch *ab) {
+  struct query *qy;
+  off_t lo = 0, hi = (off_t)-1;
+  while (ab->next != 0 && ab->next < ab->qsize &&
+         compare_query_ptrs(ab->sorted + ab->next - 1,
+                            ab->sorted + ab->next) == 0) {
+    ++ab->next;  /* Duplicates are filled by resolve_queries_async. */
+  }
+  if (ab->next >= ab->qsize) {
+    slot->qy = NULL;
+    return 0;
+  }
+  slot->qy = qy = ab->sorted[ab->next++];
+  cache_init(&slot->cache);
+  if (!qy->y && ab->cm == CM_LE && ab->printing == PR_OFFSETS) {
+    slot->phase = ASYNC_OFFSET;
+    if (slot->idxp) {
+      lbidx_narrow(slot->idxp, yfgetsize(&slot->yf), &lo, &hi, qy->x,
+                   qy->xsize, ab->cmstart);
+    }
+    bisect_init(&slot->st, &slot->yf, &slot->cache, lo, hi, qy->x, qy->xsize,
+                ab->cmstart);
+  } else {
+    slot->phase = ASYNC_START;
+    slot->eb.y = qy->y ? qy->y : qy->x;
+    slot->eb.ysize = qy->y ? qy->ysize : qy->xsize;
+    slot->eb.cm = ab->cm;
+    slot->eb.lo = 0;
+    slot->eb.hi = (off_t)-1;
+    slot->eb.limit = (off_t)-1;
+    /* If empty, the interval will be empty, see bisect_interval. */
+    if (!compare_key_keyspec(slot->yf.keyspec, slot->eb.y, slot->eb.ysize,
+                             qy->x, qy->xsize, ab->cm)) {
+      slot->cache.eb = &slot->eb;
+    }
+    if (slot->idxp) {
+      lbidx_narrow(slot->idxp, yfgetsize(&slot->yf), &lo, &hi, qy->x,
+                   qy->xsize, CM_LE);
+    }
+    bisect_init(&slot->st, &slot->yf, &slot->cache, lo, hi, qy->x, qy->xsize,
+                CM_LE);
+  }
+  return 1;
+}
+
+/* Called when slot->st is done. Returns true if slot->qy is answered,
+ * otherwise starts the search for the end of the range.
+ */
+STATIC ybool async_finish_search(struct async_slot *slot,
+                                 const struct async_batch *ab) {
+  struct query *qy = slot->qy;
+  const char *y = qy->y ? qy->y : qy->x;
+  const size_t ysize = qy->y ? qy->ysize : qy->xsize;
+  off_t lo, hi;
+  if (slot->phase == ASYNC_OFFSET) {
+    qy->start = qy->end = slot->st.result;
+    return 1;
+  } else if (slot->phase == ASYNC_END) {
+    qy->end = slot->st.result;
+    return 1;
+  }
+  qy->start = slot->st.result;
+  if (!slot->cache.eb) {  /* The interval is empty. */
+    qy->end = qy->start;
+    return 1;
+  }
+  lo = slot->eb.lo > qy->start ? slot->eb.lo : qy->start;
+  hi = slot->eb.hi;
+  if (hi + 0ULL < lo + 0ULL) hi = lo;  /* Only if not sorted. */
+  slot->phase = ASYNC_END;
+  cache_init(&slot->cache);  /* Neither x nor cm is the same. */
+  if (slot->idxp) {
+    lbidx_narrow(slot->idxp, yfgetsize(&slot->yf), &lo, &hi, y, ysize, ab->cm);
+  }
+  bisect_init(&slot->st, &slot->yf, &slot->cache, lo, hi, y, ysize, ab->cm);
+  return 0;
+}
+
+/* Advances the searches in slot until it needs a block which is not in its
+ * read buffer: then it submits the read to r. Sets slot->qy to NULL if
+ * there are no more queries.
+ */
+STATIC void async_advance(struct uring *r, struct async_slot *slot,
+                          unsigned slot_idx, struct async_batch *ab) {
+  yfile *yf = &slot->yf;
+  off_t ofs, b;
+  for (;;) {
+    if (slot->st.is_done) {
+      if (async_finish_search(slot, ab) && !async_start_query(slot, ab)) {
+        return;
+      }
+      continue;
+    }
+    ofs = bisect_peek_ofs(yf, &slot->st);
+    if (ofs >= 0 && !cache_has(&slot->cache, ofs) &&
+        !yfhas(yf, ofs == 0 ? 0 : ofs - 1)) {  /* get_fofs reads ofs - 1. */
+      b = (ofs == 0 ? 0 : ofs - 1) & -(off_t)yf->block_size;
+      /* Drop the read buffer, it will be overwritten. */
+      yf->p = yf->rend = yf->rbuf + yf->block_size + 1;
+      slot->read_ofs = b;
+      slot->iov.iov_base = yf->rbuf;
+      slot->iov.iov_len =
+          yf->is_direct || b + yf->block_size + 0ULL <= yf->size + 0ULL ?
+          (size_t)yf->block_size : (size_t)(yf->size - b);
+      uring_readv(r, yf->fd, &slot->iov, b, slot_idx);
+      return;
+    }
+    bisect_step(yf, &slot->st);
+  }
+}
+
+/* Answers sorted[:qsize] with up to depth reads in flight (see above).
+ * Returns false if io_uring(7) is not available. yf and idx (may be NULL)
+ * are used only for adding up the statistics.
+ */
+STATIC ybool resolve_queries_async(
+    yfile *yf, struct lbidx *idx, const struct input_options *opts,
+    struct query **sorted, size_t qsize, compare_mode_t cm,
+    compare_mode_t cmstart, printing_t printing, int depth) {
+  struct uring r;
+  struct async_batch ab;
+  struct async_slot *slots, *slot;
+  unsigned slot_idx;
+  int res, in_flight = 0;
+  size_t i;
+  if (yf->read_at || !uring_open(&r, depth)) return 0;
+  slots = (struct async_slot*)malloc(depth * sizeof(*slots));
+  if (!slots) die1("error: out of memory");
+  ab.sorted = sorted;
+  ab.qsize = qsize;
+  ab.next = 0;
+  ab.cm = cm;
+  ab.cmstart = cmstart;
+  ab.printing = printing;
+  for (slot = slots; slot != slots + depth; ++slot) {
+    slot->idxp = open_input(&slot->yf, &slot->idx, opts, 0);
+    if (async_start_query(slot, &ab)) {
+      async_advance(&r, slot, slot - slots, &ab);
+      if (slot->qy) ++in_flight;
+    }
+  }
+  while (in_flight > 0) {
+    if (!uring_wait(&r, &slot_idx, &res)) {
+      die2_strerror("error: io_uring_enter", "");
+    }
+    slot = slots + slot_idx;
+    if (res < 0) {
+      errno = -res;
+      yfseterr(&slot->yf, LBS_ERR_READ);  /* Sticky, won't read more. */
+    } else {
+      /* yf.p is at the sentinel, this makes the buffer valid. */
+      yfsetblock(&slot->yf, slot->read_ofs, res);
+      slot->yf.p = slot->yf.rbuf;
+    }
+    async_advance(&r, slot, slot_idx, &ab);
+    if (!slot->qy) --in_flight;
+  }
+  for (i = 1; i < qsize; ++i) {  /* Fill the duplicates. */
+    if (compare_query_ptrs(sorted + i - 1, sorted + i) == 0) {
+      sorted[i]->start = sorted[i - 1]->start;
+      sorted[i]->end = sorted[i - 1]->end;
+    }
+  }
+  for (slot = slots; slot != slots + depth; ++slot) {
+    yfcheck(&slot->yf, opts->pathname);
+    yfstats_add(&yf->stats, &slot->yf.stats);
+    if (slot->idxp) {
+      if (idx) yfstats_add(&idx->yf.stats, &slot->idx.yf.stats);
+      lbidx_close(slot->idxp);
+    }
+    yfclose(&slot->yf);
+  }
+  free(slots);
+  uring_close(&r);
+  return 1;
+}
+#endif
+
+/* Sets the keys of qy from the query line p[:q - p] (without the '\n'). */
+STATIC void parse_query(struct query *qy, const char *p, const char *q,
+                        compare_mode_t cmstart) {
+  qy->x = p;
+  qy->y = NULL;
+  qy->xsize = q - p;
+  qy->ysize = 0;
+  if (cmstart == CM_LE) {  /* Split at the first '\t'. */
+    for (; p != q && *p != '\t'; ++p) {}
+    if (p != q) {
+      qy->xsize = p - qy->x;
+      qy->y = p + 1;
+      qy->ysize = q - p - 1;
+    }
+  }
+}
+
+/* Prints the result of the batch query qy (with qy->start and qy->end
+ * already set) to stdout, in the format described above.
+ */
+STATIC void print_query_result(yfile *yf, const struct query *qy,
+                               compare_mode_t cm, printing_t printing) {
+  /* Large enough to hold 3 off_t()s and 3 more bytes (flag -R). */
+  char ofsbuf[sizeof(off_t) * 9 + 3], *ofsp = ofsbuf;
+  if (printing == PR_CONTENTS) {
+    flush_stdout();
+    print_range(yf, qy->start, qy->end);
+    write_buffered_to_stdout("", 1);  /* Terminating '\0'. */
+    return;
+  } else if (printing == PR_DETECT) {
+    write_buffered_to_stdout(qy->start < qy->end ? "1\n" : "0\n", 2);
+    return;
+  } else if (printing == PR_COUNT || printing == PR_ESTIMATE) {
+    ofsp = format_unsigned(ofsp, count_range_lines(
+        yf, qy->start, qy->end, cm, qy->x, qy->xsize, qy->y, qy->ysize,
+        printing == PR_ESTIMATE));
+  } else {
+    ofsp = format_unsigned(ofsp, qy->start);
+    if (qy->y || cm != CM_LE || printing == PR_RUN) {
+      *ofsp++ = ' ';
+      ofsp = format_unsigned(ofsp, qy->end);
+    }
+    if (printing == PR_RUN) {
+      *ofsp++ = ' ';
+      ofsp = format_unsigned(ofsp, count_range_lines(
+          yf, qy->start, qy->end, cm, qy->x, qy->xsize, qy->y, qy->ysize, 0));
+    }
+  }
+  *ofsp++ = '\n';
+  write_buffered_to_stdout(ofsbuf, ofsp - ofsbuf);
+}
+
+STATIC void run_batch(yfile *yf, struct lbidx *idx,
+                      const struct input_options *opts, compare_mode_t cm,
+                      compare_mode_t cmstart, printing_t printing,
+                      int thread_count, int async_depth) {
+  size_t size, qsize, i;
+  char *buf = read_all_fd(STDIN_FILENO, "stdin", &size), *p, *pend, *q;
+  struct query *queries, *qy, **sorted;
+  off_t usec;
+
+  for (qsize = 0, p = buf, pend = buf + size; p != pend; ++p) {
+    if (*p == '\n') ++qsize;
+  }
+  if (size != 0 && pend[-1] != '\n') ++qsize;  /* Incomplete last line. */
+  queries = (struct query*)malloc(qsize * sizeof(*queries) + 1);
+  sorted = (struct query**)malloc(qsize * sizeof(*sorted) + 1);
+  if (!queries || !sorted) die1("error: out of memory");
+  for (qy = queries, p = buf; p != pend; ++qy, p = q + (q != pend)) {
+    for (q = p; q != pend && *q != '\n'; ++q) {}
+    parse_query(qy, p, q, cmstart);
+  }
+  for (i = 0; i < qsize; ++i) {
+    sorted[i] = queries + i;
+  }
+  query_keyspec = opts->keyspec;
+  qsort(sorted, qsize, sizeof(*sorted), compare_query_ptrs);
+  if (async_depth > 0) {
+#ifdef HAVE_IO_URING
+    if (!resolve_queries_async(yf, idx, opts, sorted, qsize, cm, cmstart,
+                               printing, async_depth))
+#endif
+    {
+      resolve_queries_in_threads(yf, idx, opts, sorted, qsize, cm, cmstart,
+                                 printing, async_depth);
+    }
+  } else if (thread_count > 1) {
+    resolve_queries_in_threads(yf, idx, opts, sorted, qsize, cm, cmstart,
+                               printing, thread_count);
+  } else {
+    resolve_queries(yf, idx, sorted, qsize, cm, cmstart, printing);
+  }
+
+  yfcheck(yf, opts->pathname);
+  usec = yfstats_usec(yf);
+  if (printing == PR_CONTENTS || printing == PR_COUNT || printing == PR_RUN) {
+    yfadvise(yf, 1);
+  }
+  for (qy = queries, i = 0; i < qsize; ++qy, ++i) {
+    print_query_result(yf, qy, cm, printing);
+  }
+  flush_stdout();
+  yf->stats.print_usec += yfstats_usec(yf) - usec;
+  yfcheck(yf, opts->pathname);
+  free(sorted);
+  free(queries);
+  free(buf);
+}
+
+/* --- Merge join (flag -M)
+ *
+ * Like -B, but the queries on stdin must already be sorted (e.g. by LC_ALL=C
+ * sort), and each one is answered and printed right after it is read, with
+ * constant memory. Each search starts at the result of the previous query
+ * (as in resolve_queries), but instead of bisecting the rest of the file,
+ * it gallops from there: it probes lo + gap, lo + 2 * gap, lo + 4 * gap ...
+ * (where gap is the recent distance between the results) until it finds a
+ * line after the key, and then it bisects only the last step. This takes
+ * O(log(distance / gap)) probes, which are mostly in the read buffer for
+ * dense keys, so that a join of many keys is almost a sequential scan. If
+ * gap is large compared to the rest of the file (sparse keys), it bisects
+ * the rest instead. A query out of order is answered by bisecting the
+ * entire file.
+ */
 
-/** Can be called again to clear the cache. */
-STATIC void cache_init(struct cache *cache) {
-  cache->active = 3;
+/* Gallop only if gap * MERGE_GALLOP_RATIO is less than the rest. */
+#define MERGE_GALLOP_RATIO 8
+
+/* Searches like bisect_way from lo to EOF, by galloping (with step gap) or
+ * by bisection, whichever is expected to be faster.
+ */
+STATIC off_t merge_way(yfile *yf, struct lbidx *idx, off_t lo, off_t gap,
+                       const char *x, size_t xsize, compare_mode_t cm) {
+  struct cache cache;
+  cache_init(&cache);
+  if (gap < (yfgetsize(yf) - lo) / MERGE_GALLOP_RATIO) {
+    return gallop_way(yf, &cache, lo, (off_t)-1, gap, x, xsize, cm);
+  }
+  return search_way(yf, &cache, idx, lo, (off_t)-1, (off_t)-1, x, xsize, cm);
 }
 
-/* x[:xsize] must not contain '\n'. */
-STATIC const struct cache_entry *get_using_cache(
-    yfile *yf, struct cache *cache, off_t ofs,
-    const char *x, size_t xsize, compare_mode_t cm) {
-  int a = cache->active;
-  struct cache_entry *entry;
-  off_t fofs;
-  assert(ofs >= 0);
-  /* TODO(pts): Add tests for efficient and correct cache usage. */
-  /* TODO(pts): Add tests for code coverage. */
-  if (CACHE_HAS_0(a) &&
-      cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) {
-    if (a == 1) cache->active = a = 0;
-  } else if (CACHE_HAS_1(a) &&
-             cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs) {
-    if (a == 0) cache->active = a = 1;
-  } else {
-    fofs = get_fofs(yf, ofs);
-    assert(ofs <= fofs);
-    if (CACHE_HAS_0(a) && cache->e[0].fofs == fofs) {
-      if (a == 1) cache->active = a = 0;
-      if (cache->e[0].ofs > ofs) cache->e[0].ofs = ofs;
-    } else if (CACHE_HAS_1(a) && cache->e[1].fofs == fofs) {
-      if (a == 0) cache->active = a = 1;
-      if (cache->e[1].ofs > ofs) cache->e[1].ofs = ofs;
+/* Reads stdin line by line. */
+struct line_reader {
+  char *buf;
+  size_t size;  /* Number of bytes read to buf. */
+  size_t pos;  /* Start of the next line in buf. */
+  size_t alloc;
+  ybool is_eof;
+};
+
+/* Sets *line_out and *size_out to the next line of stdin (without the
+ * '\n'), valid until the next call. Returns false at EOF. Flushes stdout
+ * before waiting for stdin, so that the results of the previous lines are
+ * available (e.g. for a coprocess).
+ */
+STATIC ybool read_line(struct line_reader *r, const char **line_out,
+                       size_t *size_out) {
+  const char *q;
+  char *new_buf;
+  int got;
+  for (;;) {
+    if ((q = (const char*)memchr(r->buf + r->pos, '\n', r->size - r->pos))
+        != NULL || (r->is_eof && r->pos != r->size)) {
+      if (!q) q = r->buf + r->size;  /* Incomplete last line. */
+      *line_out = r->buf + r->pos;
+      *size_out = q - *line_out;
+      r->pos = q - r->buf + (q != r->buf + r->size);
+      return 1;
+    }
+    if (r->is_eof) return 0;
+    memmove(r->buf, r->buf + r->pos, r->size -= r->pos);
+    r->pos = 0;
+    if (r->size == r->alloc) {
+      if ((r->alloc <<= 1) <= r->size ||
+          !(new_buf = (char*)realloc(r->buf, r->alloc))) {
+        die1("error: out of memory");
+      }
+      r->buf = new_buf;
+    }
+    flush_stdout();
+    got = read(STDIN_FILENO, r->buf + r->size,
+               r->alloc - r->size > 0x40000000U ? 0x40000000U :
+               r->alloc - r->size);
+    if (got < 0) die2_strerror("error: read stdin", "");
+    if (got == 0) r->is_eof = 1;
+    r->size += got;
+  }
+}
+
+/* Answers the sorted queries on stdin, printing the results right away. */
+STATIC void run_merge_join(yfile *yf, struct lbidx *idx,
+                           const struct input_options *opts,
+                           compare_mode_t cm, compare_mode_t cmstart,
+                           printing_t printing) {
+  struct line_reader r;
+  struct query qy;
+  const char *line, *y;
+  size_t line_size, ysize, prev_size = 0, prev_alloc = 64;
+  char *prev_x = (char*)malloc(prev_alloc);
+  const off_t size = yfgetsize(yf);
+  /* Previous start, and the recent start and end distances. */
+  off_t lo = 0, gap = size, end_gap = size, usec;
+  r.alloc = 8192;
+  r.size = r.pos = 0;
+  r.is_eof = 0;
+  if (!(r.buf = (char*)malloc(r.alloc)) || !prev_x) {
+    die1("error: out of memory");
+  }
+  if (printing == PR_CONTENTS || printing == PR_COUNT || printing == PR_RUN) {
+    yfadvise(yf, 1);
+  }
+  for (; read_line(&r, &line, &line_size); lo = qy.start) {
+    parse_query(&qy, line, line + line_size, cmstart);
+    if (compare_keys_keyspec(opts->keyspec, qy.x, qy.xsize,
+                             prev_x, prev_size) < 0) {
+      lo = 0;  /* Out of order. */
+      gap = end_gap = size;
+    }
+    if (prev_alloc < qy.xsize) {
+      free(prev_x);
+      while ((prev_alloc <<= 1) < qy.xsize) {}
+      if (!(prev_x = (char*)malloc(prev_alloc))) die1("error: out of memory");
+    }
+    memcpy(prev_x, qy.x, prev_size = qy.xsize);
+    usec = yfstats_usec(yf);
+    if (!qy.y && cm == CM_LE && printing == PR_OFFSETS) {
+      qy.start = qy.end = merge_way(yf, idx, lo, gap, qy.x, qy.xsize, cmstart);
+      yf->stats.start_usec += yfstats_usec(yf) - usec;
     } else {
-      if (CACHE_HAS_0(a)) {
-        cache->active = a = CACHE_GET_ACTIVE(a) ^ 1;
-        entry = cache->e + a;
+      y = qy.y ? qy.y : qy.x;
+      ysize = qy.y ? qy.ysize : qy.xsize;
+      qy.start = merge_way(yf, idx, lo, gap, qy.x, qy.xsize, CM_LE);
+      yf->stats.start_usec += yfstats_usec(yf) - usec;
+      if (compare_key_keyspec(opts->keyspec, y, ysize, qy.x, qy.xsize, cm)) {
+        qy.end = qy.start;  /* Empty, e.g. y < x. */
       } else {
-        cache->active = a = 2;
-        entry = cache->e;
+        usec = yfstats_usec(yf);
+        qy.end = merge_way(yf, idx, qy.start, end_gap, y, ysize, cm);
+        yf->stats.end_usec += yfstats_usec(yf) - usec;
+        end_gap = (end_gap >> 1) + ((qy.end - qy.start) >> 1);
       }
-      /* Fill newly activated cache entry. */
-      entry->fofs = fofs;
-      entry->ofs = ofs;
-      entry->cmp_result = compare_line(yf, fofs, x, xsize, cm);
-      return entry;  /* Shortcut, the return below would do the same. */
     }
+    gap = (gap >> 1) + ((qy.start - lo) >> 1);  /* Smoothed. */
+    yfcheck(yf, opts->pathname);
+    usec = yfstats_usec(yf);
+    print_query_result(yf, &qy, cm, printing);
+    yf->stats.print_usec += yfstats_usec(yf) - usec;
+    yfcheck(yf, opts->pathname);
   }
-  return cache->e + CACHE_GET_ACTIVE(a);
+  flush_stdout();
+  free(prev_x);
+  free(r.buf);
 }
 
-STATIC off_t get_fofs_using_cache(
-    yfile *yf, struct cache *cache, off_t ofs) {
-  int a = cache->active;
-  off_t fofs;
-  assert(ofs >= 0);
-  if (ofs == 0) return 0;
-  if (CACHE_HAS_0(a) &&
-      cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) {
-    if (a == 1) cache->active = a = 0;
-    return cache->e[0].fofs;
-  } else if (CACHE_HAS_1(a) &&
-             cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs) {
-    if (a == 0) cache->active = a = 1;
-    return cache->e[1].fofs;
-  } else {
-    fofs = get_fofs(yf, ofs);
-    assert(ofs <= fofs);
-    if (CACHE_HAS_0(a) && cache->e[0].fofs == fofs) {
-      if (a == 1) cache->active = a = 0;
-      if (cache->e[0].ofs > ofs) cache->e[0].ofs = ofs;
-    } else if (CACHE_HAS_1(a) && cache->e[1].fofs == fofs) {
-      if (a == 0) cache->active = a = 1;
-      if (cache->e[1].ofs > ofs) cache->e[1].ofs = ofs;
+STATIC char *format_stat(char *p, const char *key, off_t value) {
+  const size_t key_size = strlen(key);
+  memcpy(p, key, key_size);
+  p += key_size;
+  *p++ = '=';
+  p = format_unsigned(p, value);
+  *p++ = ' ';
+  return p;
+}
+
+/* Prints the statistics of yf (and idx, which may be NULL) to stderr for
+ * flag -v, as a single line of space-separated key=value pairs.
+ */
+STATIC void write_stats(const yfile *yf, const struct lbidx *idx) {
+  const struct yfstats *st = &yf->stats;
+  char buf[1024], *p = buf;
+  p = format_stat(p, "stats: probes", st->probe_count);
+  p = format_stat(p, "cache_hits", st->cache_hit_count);
+  p = format_stat(p, "cache_misses", st->cache_miss_count);
+  p = format_stat(p, "lseeks", st->lseek_count);
+  p = format_stat(p, "reads", st->read_count);
+  p = format_stat(p, "read_bytes", st->read_bytes);
+  p = format_stat(p, "scan_bytes", st->scan_bytes);
+  p = format_stat(p, "prefetches", st->prefetch_count);
+  p = format_stat(p, "lcache_hits", st->lcache_hit_count);
+  p = format_stat(p, "lcache_misses", st->lcache_miss_count);
+  p = format_stat(p, "idx_lseeks", idx ? idx->yf.stats.lseek_count : 0);
+  p = format_stat(p, "idx_reads", idx ? idx->yf.stats.read_count : 0);
+  p = format_stat(p, "idx_read_bytes", idx ? idx->yf.stats.read_bytes : 0);
+  p = format_stat(p, "lbofs_reads",
+                  yf->lbofs ? yf->lbofs->yf.stats.read_count : 0);
+  p = format_stat(p, "inflates", st->inflate_count);
+  p = format_stat(p, "start_usec", st->start_usec);
+  p = format_stat(p, "end_usec", st->end_usec);
+  p = format_stat(p, "print_usec", st->print_usec);
+  p[-1] = '\n';
+  (void)!write(STDERR_FILENO, buf, p - buf);
+}
+
+/* --- Sharded search (flag -s)
+ *
+ * With flag -s, <sorted-text-file> is a manifest: a text file (or - for
+ * stdin) with the pathnames of sorted shards (e.g. one per day), one per
+ * line. Each shard is opened with its own yfile, all of them are searched
+ * for the same keys (in <n> threads with -j<n>), and the results are
+ * combined:
+ *
+ * * -c: the matching lines of all shards, merged to a single sorted stream
+ *   (like sort -m: equal lines are printed in manifest order);
+ * * -o: "<start> <end>\n" per shard in manifest order, or "<start>\n" for
+ *   -eo and -aeo without <key-y>;
+ * * -n, -N: the sum of the line counts;
+ * * -q: nothing, the exit code is 0 iff any shard has a match.
+ *
+ * The merge prints the smallest next line of the shards (from a heap) one
+ * by one, but once the same shard has won MERGE_GALLOP_MIN times in a row
+ * (like in timsort), it gallops (hint_way) in it to the first line after
+ * the next line of the runner-up shard, and prints this run of lines at
+ * once. Thus shards with disjoint key ranges (e.g. keyed by timestamp) are
+ * copied with print_range (zero-copy for large runs), and interleaved
+ * lines don't cost extra probes.
+ */
+
+#define MERGE_GALLOP_MIN 8
+
+struct shard {
+  yfile yf;
+  struct lbidx idx;
+  struct lbidx *idxp;
+  const char *pathname;
+  off_t start;  /* While merging, the start of the lines not printed yet. */
+  off_t end;
+  off_t count;  /* For flags -n and -N. */
+  /* While merging, a malloc()ed copy of the line at start, without '\n'. */
+  char *line;
+  size_t line_size;
+  size_t line_alloc;
+  const char *key;  /* The key of line (by yf.keyspec), in line. */
+  size_t key_size;
+};
+
+/* A thread of flag -j, searching every step-th shard from first. */
+struct shard_worker {
+  struct shard *shards;
+  size_t first;
+  size_t step;
+  size_t shard_count;
+  compare_mode_t cm;
+  compare_mode_t cmstart;
+  printing_t printing;
+  const char *x;
+  const char *y;  /* NULL if only <key-x> was specified. */
+  size_t xsize;
+  size_t ysize;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+#endif
+};
+
+STATIC void *shard_worker_main(void *arg) {
+  const struct shard_worker *w = (const struct shard_worker*)arg;
+  struct shard *sh;
+  struct cache cache;
+  size_t i;
+  off_t usec;
+  for (i = w->first; i < w->shard_count; i += w->step) {
+    sh = w->shards + i;
+    usec = yfstats_usec(&sh->yf);
+    if (!w->y && w->cm == CM_LE && w->printing == PR_OFFSETS) {
+      cache_init(&cache);
+      sh->start = sh->end = search_way(&sh->yf, &cache, sh->idxp, 0,
+                                       (off_t)-1, (off_t)-1, w->x, w->xsize,
+                                       w->cmstart);
+      sh->yf.stats.start_usec += yfstats_usec(&sh->yf) - usec;
+    } else {
+      bisect_interval(&sh->yf, sh->idxp, 0, (off_t)-1, (off_t)-1, w->cm,
+                      w->x, w->xsize, w->y ? w->y : w->x,
+                      w->y ? w->ysize : w->xsize, &sh->start, &sh->end);
+    }
+    if (w->printing == PR_COUNT || w->printing == PR_ESTIMATE) {
+      usec = yfstats_usec(&sh->yf);
+      if (w->printing == PR_COUNT) yfadvise(&sh->yf, 1);
+      sh->count = count_range_lines(&sh->yf, sh->start, sh->end, w->cm,
+                                    w->x, w->xsize, w->y, w->ysize,
+                                    w->printing == PR_ESTIMATE);
+      sh->yf.stats.print_usec += yfstats_usec(&sh->yf) - usec;
     }
-    /* We don't update the cache, because we don't know cmp_result, and we
-     * are too lazy to compute it.
-     */
-    return fofs;
   }
+  return NULL;
 }
 
-/* x[:xsize] must not contain '\n'.
+/* Copies bytes [start, end) of yf to stdout, small ranges through obuf. */
+STATIC void print_range_buffered(yfile *yf, off_t start, off_t end) {
+  int need;
+  const char *buf;
+  if (end - start >= SEND_RANGE_MIN_SIZE) {
+    flush_stdout();
+    print_range(yf, start, end);
+    return;
+  }
+  yfseek_set(yf, start);
+  end -= start;
+  while ((need = yfpeek(yf, end, &buf)) > 0) {
+    write_buffered_to_stdout(buf, need);
+    yfseek_cur(yf, need);
+    end -= need;
+  }
+}
+
+/* Copies the line at sh->start (before sh->end) to sh->line. */
+STATIC void shard_read_line(struct shard *sh) {
+  off_t ofs = sh->start;
+  const char *buf, *q;
+  char *new_line;
+  int need, n;
+  sh->line_size = 0;
+  yfseek_set(&sh->yf, ofs);
+  while ((need = yfpeek(&sh->yf, sh->end - ofs, &buf)) > 0) {
+    q = (const char*)memchr(buf, '\n', need);
+    n = q ? q - buf : need;
+    if (sh->line_alloc - sh->line_size < (size_t)n) {
+      while ((sh->line_alloc = sh->line_alloc ? sh->line_alloc << 1 : 256) -
+             sh->line_size < (size_t)n) {}
+      if (!(new_line = (char*)realloc(sh->line, sh->line_alloc))) {
+        die1("error: out of memory");
+      }
+      sh->line = new_line;
+    }
+    memcpy(sh->line + sh->line_size, buf, n);
+    sh->line_size += n;
+    if (q) break;
+    yfseek_cur(&sh->yf, need);
+    ofs += need;
+  }
+  sh->key = get_line_key(sh->yf.keyspec, sh->line, sh->line_size,
+                         &sh->key_size);
+}
+
+/* Returns true iff the next line of a is printed before the one of b. */
+STATIC ybool shard_is_before(const struct shard *a, const struct shard *b) {
+  const int c = compare_keys_keyspec(a->yf.keyspec, a->key, a->key_size,
+                                     b->key, b->key_size);
+  return c < 0 || (c == 0 && a < b);  /* The manifest order. */
+}
+
+/* Moves heap[i] down to its place in the heap heap[:n]. */
+STATIC void shard_sift_down(struct shard **heap, size_t n, size_t i) {
+  struct shard *sh = heap[i];
+  size_t j;
+  while ((j = 2 * i + 1) < n) {
+    if (j + 1 < n && shard_is_before(heap[j + 1], heap[j])) ++j;
+    if (!shard_is_before(heap[j], sh)) break;
+    heap[i] = heap[j];
+    i = j;
+  }
+  heap[i] = sh;
+}
+
+/* Prints the matching lines of the shards in heap[:n] (all with
+ * start < end), merged.
+ */
+STATIC void merge_shards(struct shard **heap, size_t n) {
+  struct shard *sh, *next, *prev = NULL;
+  struct cache cache;
+  size_t i, wins = 0;
+  off_t end, usec;
+  ybool need_newline = 0;
+  for (i = 0; i < n; ++i) {
+    yfadvise(&heap[i]->yf, 1);
+    shard_read_line(heap[i]);
+    yfcheck(&heap[i]->yf, heap[i]->pathname);
+  }
+  for (i = n >> 1; i-- > 0;) {
+    shard_sift_down(heap, n, i);
+  }
+  while (n > 0) {
+    sh = heap[0];
+    usec = yfstats_usec(&sh->yf);
+    wins = sh == prev ? wins + 1 : 0;
+    prev = sh;
+    if (n == 1) {
+      end = sh->end;
+    } else if (wins < MERGE_GALLOP_MIN) {  /* Just the line at start. */
+      end = sh->start + sh->line_size + 1;  /* Including the '\n'. */
+      if (end > sh->end) end = sh->end;  /* Incomplete last line. */
+    } else {
+      next = n == 2 || shard_is_before(heap[1], heap[2]) ? heap[1] : heap[2];
+      /* Up to next->line, also the lines equal to it if sh is before. */
+      cache_init(&cache);
+      end = hint_way(&sh->yf, &cache, sh->start, sh->end, sh->start,
+                     next->key, next->key_size, sh < next ? CM_LT : CM_LE);
+    }
+    if (need_newline) write_buffered_to_stdout("\n", 1);
+    print_range_buffered(&sh->yf, sh->start, end);
+    /* An incomplete last line, with more lines to print after it. */
+    need_newline = 0;
+    if (end == yfgetsize(&sh->yf)) {
+      yfseek_set(&sh->yf, end - 1);
+      need_newline = YFGETCHAR(&sh->yf) != '\n';
+    }
+    if ((sh->start = end) < sh->end) {
+      shard_read_line(sh);
+    } else {
+      heap[0] = heap[--n];
+    }
+    sh->yf.stats.print_usec += yfstats_usec(&sh->yf) - usec;
+    yfcheck(&sh->yf, sh->pathname);
+    if (n > 1) shard_sift_down(heap, n, 0);
+  }
+  flush_stdout();
+}
+
+/* Searches all shards listed in the manifest opts->pathname, and prints
+ * the combined results. Returns the exit code.
+ */
+STATIC int run_sharded(const struct input_options *opts, compare_mode_t cm,
+                       compare_mode_t cmstart, printing_t printing,
+                       int thread_count, const char *x, size_t xsize,
+                       const char *y, size_t ysize) {
+  const ybool is_stdin = 0 == strcmp(opts->pathname, "-");
+  const int fd = is_stdin ? STDIN_FILENO :
+      open(opts->pathname, O_RDONLY | O_BINARY, 0);
+  size_t size, shard_count, i;
+  char *buf, *p, *pend, *q;
+  struct shard *shards, *sh, **heap;
+  struct shard_worker *workers, *w;
+  struct input_options shard_opts = *opts;
+  /* Large enough to hold 2 off_t()s and 2 more bytes. */
+  char ofsbuf[sizeof(off_t) * 6 + 2], *ofsp;
+  off_t count = 0;
+  /* 3 if no match found. Single-key -eo always succeeds, like without -s. */
+  int exit_code = !y && cm == CM_LE && printing == PR_OFFSETS ?
+      EXIT_SUCCESS : 3;
+  yfile total;
+  struct lbidx total_idx;
+  struct lbofs total_lbofs;
+  if (fd < 0) die2_strerror("error: open ", opts->pathname);
+  buf = read_all_fd(fd, opts->pathname, &size);
+  if (!is_stdin) close(fd);
+  /* Room for a '\0' after the last pathname. */
+  if (!(p = (char*)realloc(buf, size + 1))) die1("error: out of memory");
+  buf = p;
+  for (shard_count = 0, p = buf, pend = buf + size; p != pend; p = q + 1) {
+    if (!(q = (char*)memchr(p, '\n', pend - p))) q = pend;
+    if (q != p) ++shard_count;
+    if (q == pend) break;
+  }
+  if (!(shards = (struct shard*)calloc(shard_count + 1, sizeof(*shards))) ||
+      !(heap = (struct shard**)malloc((shard_count + 1) * sizeof(*heap)))) {
+    die1("error: out of memory");
+  }
+  for (sh = shards, p = buf; p != pend; p = q + 1) {
+    if (!(q = (char*)memchr(p, '\n', pend - p))) q = pend;
+    if (q != p) {
+      *q = '\0';  /* Overwrites the '\n'. */
+      shard_opts.pathname = sh->pathname = p;
+      sh->idxp = open_input(&sh->yf, &sh->idx, &shard_opts, 1);
+      ++sh;
+    }
+    if (q == pend) break;
+  }
+
+#ifndef HAVE_PTHREAD
+  thread_count = 1;
+#endif
+  if (thread_count <= 0) thread_count = 1;
+  if ((size_t)thread_count > shard_count) {
+    thread_count = shard_count ? (int)shard_count : 1;
+  }
+  workers = (struct shard_worker*)malloc(thread_count * sizeof(*workers));
+  if (!workers) die1("error: out of memory");
+  for (w = workers; w != workers + thread_count; ++w) {
+    w->shards = shards;
+    w->first = w - workers;
+    w->step = thread_count;
+    w->shard_count = shard_count;
+    w->cm = cm;
+    w->cmstart = cmstart;
+    w->printing = printing;
+    w->x = x;
+    w->xsize = xsize;
+    w->y = y;
+    w->ysize = ysize;
+#ifdef HAVE_PTHREAD
+    if (w != workers &&
+        (errno = pthread_create(&w->thread, NULL, shard_worker_main, w))) {
+      die2_strerror("error: pthread_create", "");
+    }
+#endif
+  }
+  /* The first thread is this one. */
+  for (w = workers; w != workers + thread_count; ++w) {
+#ifdef HAVE_PTHREAD
+    if (w != workers) {
+      if ((errno = pthread_join(w->thread, NULL))) {
+        die2_strerror("error: pthread_join", "");
+      }
+      continue;
+    }
+#endif
+    shard_worker_main(w);
+  }
+  free(workers);
+
+  for (i = 0, sh = shards; sh != shards + shard_count; ++sh) {
+    yfcheck(&sh->yf, sh->pathname);
+    if (sh->start < sh->end) {
+      exit_code = EXIT_SUCCESS;
+      heap[i++] = sh;
+    }
+    count += sh->count;
+    if (printing == PR_OFFSETS) {
+      ofsp = format_unsigned(ofsbuf, sh->start);
+      if (y || cm != CM_LE) {
+        *ofsp++ = ' ';
+        ofsp = format_unsigned(ofsp, sh->end);
+      }
+      *ofsp++ = '\n';
+      write_buffered_to_stdout(ofsbuf, ofsp - ofsbuf);
+    }
+  }
+  if (printing == PR_CONTENTS) {
+    merge_shards(heap, i);
+  } else if (printing == PR_COUNT || printing == PR_ESTIMATE) {
+    ofsp = format_unsigned(ofsbuf, count);
+    *ofsp++ = '\n';
+    write_buffered_to_stdout(ofsbuf, ofsp - ofsbuf);
+  }
+  flush_stdout();
+
+  if (opts->is_stats) {  /* Add up the statistics of all shards. */
+    memset(&total, '\0', sizeof(total));
+    memset(&total_idx, '\0', sizeof(total_idx));
+    memset(&total_lbofs, '\0', sizeof(total_lbofs));
+    for (sh = shards; sh != shards + shard_count; ++sh) {
+      yfstats_add(&total.stats, &sh->yf.stats);
+      if (sh->idxp) yfstats_add(&total_idx.yf.stats, &sh->idx.yf.stats);
+      if (sh->yf.lbofs) {
+        yfstats_add(&total_lbofs.yf.stats, &sh->yf.lbofs->yf.stats);
+        total.lbofs = &total_lbofs;
+      }
+    }
+    write_stats(&total, &total_idx);
+  }
+  for (sh = shards; sh != shards + shard_count; ++sh) {
+    yfclose(&sh->yf);
+    if (sh->idxp) lbidx_close(sh->idxp);
+    free(sh->line);
+  }
+  free(heap);
+  free(shards);
+  free(buf);
+  return exit_code;
+}
+
+/* --- Filtered output (flag -G)
  *
- * cm=CM_LE is equivalent to is_left=true and is_open=true.
- * cm=CM_LT is equivalent to is_left=false and is_open=false.
- * cm=CL_LP is also supported, it does prefix search.
+ * With -G<substring>, only the lines of the range containing <substring>
+ * are printed, like piping the output to `grep -F', but without copying the
+ * whole range through a pipe. The range is split to line-aligned chunks
+ * (by get_fofs) of FILTER_CHUNK_SIZE bytes, and with -j<n>, <n> threads
+ * (each with its own yfile) scan <n> consecutive chunks at a time, each
+ * collecting its matching lines in memory, which are printed in order.
+ * Each window of FILTER_WINDOW_SIZE bytes is searched as a whole with
+ * memmem(3) (vectorized in glibc), and only the lines around the matches
+ * are looked at.
  */
-STATIC off_t bisect_way(
-    yfile *yf, struct cache *cache, off_t lo, off_t hi,
-    const char *x, size_t xsize, compare_mode_t cm) {
-  const off_t size = yfgetsize(yf);
-  off_t mid, midf;
-  const struct cache_entry *entry;
-  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
-  if (xsize == 0) {  /* Shortcuts. */
-    if (cm == CM_LE) hi = lo;  /* Faster for lo == 0. Returns right below. */
-    if (cm == CM_LP && hi == size) return hi;
+
+#define FILTER_CHUNK_SIZE ((off_t)1 << 22)
+#define FILTER_WINDOW_SIZE 65536
+
+struct filter_worker {
+  yfile *yf;  /* &own_yf, or the yfile of main for the first worker. */
+  yfile own_yf;
+  struct lbidx idx, *idxp;  /* Not used, opened with -x. */
+  const char *pattern;
+  size_t pattern_size;
+  off_t start, end;  /* The chunk, line-aligned. */
+  char *buf;  /* Window read from yf. */
+  size_t buf_alloc;
+  char *out;  /* Matching lines found so far. */
+  size_t out_size, out_alloc;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+  ybool is_running;  /* thread has been created, and not joined yet. */
+#endif
+};
+
+/* Returns the first occurrence of pattern[:n] (n > 0) in buf[:size], or
+ * NULL.
+ */
+STATIC const char *find_substring(const char *buf, size_t size,
+                                  const char *pattern, size_t n) {
+#ifdef HAVE_MEMMEM
+  return (const char*)memmem(buf, size, pattern, n);
+#else
+  const char *q, *bend;
+  if (size < n) return NULL;
+  for (bend = buf + (size - n) + 1;
+       (q = (const char*)memchr(buf, *pattern, bend - buf)) != NULL;
+       buf = q + 1) {
+    if (0 == memcmp(q + 1, pattern + 1, n - 1)) return q;
   }
-  if (lo >= hi) return get_fofs_using_cache(yf, cache, lo);
-  do {
-    mid = (lo + hi) >> 1;
-    entry = get_using_cache(yf, cache, mid, x, xsize, cm);
-    midf = entry->fofs;
-    if (entry->cmp_result) {
-      hi = mid;
+  return NULL;
+#endif
+}
+
+/* Grows *bufp (of *allocp bytes) to at least size bytes. */
+STATIC void grow_buffer(char **bufp, size_t *allocp, size_t size) {
+  char *new_buf;
+  size_t alloc = *allocp;
+  if (alloc >= size) return;
+  while ((alloc = alloc ? alloc << 1 : 4096) < size) {}
+  if (!(new_buf = (char*)realloc(*bufp, alloc))) {
+    die1("error: out of memory");
+  }
+  *bufp = new_buf;
+  *allocp = alloc;
+}
+
+/* Appends the lines in buf[:size] (ending with '\n', except maybe at the
+ * end of the chunk) containing the pattern to w->out.
+ */
+STATIC void filter_lines(struct filter_worker *w, const char *buf,
+                         size_t size) {
+  const char *bend = buf + size, *q, *line, *line_end;
+  while ((q = find_substring(buf, bend - buf, w->pattern, w->pattern_size))) {
+    for (line = q; line != buf && line[-1] != '\n'; --line) {}
+    q += w->pattern_size;
+    line_end = (const char*)memchr(q, '\n', bend - q);
+    line_end = line_end ? line_end + 1 : bend;
+    grow_buffer(&w->out, &w->out_alloc, w->out_size + (line_end - line));
+    memcpy(w->out + w->out_size, line, line_end - line);
+    w->out_size += line_end - line;
+    buf = line_end;
+  }
+}
+
+/* Scans the chunk [w->start, w->end), window by window. Doesn't change
+ * w->start or w->end, which the main thread reads concurrently.
+ */
+STATIC void *filter_worker_main(void *arg) {
+  struct filter_worker *w = (struct filter_worker*)arg;
+  yfile *yf = w->yf;
+  off_t ofs = w->start, end = w->end;
+  size_t size = 0, lines_size;  /* w->buf[:size] is unscanned. */
+  const char *buf;
+  int need;
+  if (yf->map) {  /* No need to copy. */
+    if (end > yf->size) end = yf->size;
+    if (ofs < end) filter_lines(w, yf->map + ofs, end - ofs);
+    return NULL;
+  }
+  yfseek_set(yf, ofs);
+  while (ofs < end) {
+    /* A line longer than the window makes the window larger. */
+    grow_buffer(&w->buf, &w->buf_alloc, size + FILTER_WINDOW_SIZE);
+    need = 0;
+    while (size < w->buf_alloc &&
+           (need = yfpeek(yf, end - ofs < (off_t)(w->buf_alloc - size) ?
+                          end - ofs : (off_t)(w->buf_alloc - size),
+                          &buf)) > 0) {
+      memcpy(w->buf + size, buf, need);
+      yfseek_cur(yf, need);
+      size += need;
+      ofs += need;
+    }
+    if (yf->err != LBS_OK) break;
+    if (need <= 0) end = ofs;  /* EOF, the file got shorter. */
+    if (ofs < end) {  /* Keep the last, incomplete line for later. */
+      for (lines_size = size; lines_size > 0 &&
+           w->buf[lines_size - 1] != '\n'; --lines_size) {}
     } else {
-      lo = mid + 1;
+      lines_size = size;  /* The incomplete last line at EOF. */
     }
-  } while (lo < hi);
-  return mid == lo ? midf : get_fofs_using_cache(yf, cache, lo);
+    filter_lines(w, w->buf, lines_size);
+    memmove(w->buf, w->buf + lines_size, size - lines_size);
+    size -= lines_size;
+    if (ofs >= end) break;
+  }
+  return NULL;
 }
 
-/* x[:xsize] and y[:ysize] must not contain '\n'. */
-STATIC void bisect_interval(
-    yfile *yf, off_t lo, off_t hi, compare_mode_t cm,
-    const char *x, size_t xsize,
-    const char *y, size_t ysize,
-    off_t *start_out, off_t *end_out) {
-  off_t start;
-  struct cache cache;
-  /* TODO(pts): If y < x, then don't even read the file. Smart compare! */
-  cache_init(&cache);
-  *start_out = start = bisect_way(yf, &cache, lo, hi, x, xsize, CM_LE);
-  if (cm == CM_LE && xsize == ysize && 0 == memcmp(x, y, xsize)) {
-    *end_out = start;
-  } else {
-    /* Don't use a shared cache, because x or cm are different. */
-    cache_init(&cache);
-    *end_out = bisect_way(yf, &cache, start, hi, y, ysize, cm);
+/* Prints the lines in [start, end) of yf containing pattern[:pattern_size]
+ * (not empty), scanning in thread_count threads. Returns true iff a
+ * line was printed.
+ */
+STATIC ybool print_filtered_range(
+    yfile *yf, const struct input_options *opts, off_t start, off_t end,
+    const char *pattern, size_t pattern_size, int thread_count) {
+  struct filter_worker *workers, *w;
+  ybool is_found = 0;
+  if (thread_count <= 0) thread_count = 1;
+#ifndef HAVE_PTHREAD
+  thread_count = 1;
+#endif
+  /* Don't start threads which wouldn't have a chunk. */
+  if ((end - start) / FILTER_CHUNK_SIZE + 1 < thread_count) {
+    thread_count = (int)((end - start) / FILTER_CHUNK_SIZE + 1);
+  }
+  workers = (struct filter_worker*)malloc(thread_count * sizeof(*workers));
+  if (!workers) die1("error: out of memory");
+  for (w = workers; w != workers + thread_count; ++w) {
+    w->yf = w == workers ? yf : &w->own_yf;
+    w->idxp = w == workers ? NULL : open_input(w->yf, &w->idx, opts, 0);
+    w->pattern = pattern;
+    w->pattern_size = pattern_size;
+    w->buf = w->out = NULL;
+    w->buf_alloc = w->out_alloc = 0;
+  }
+  while (start < end) {
+    for (w = workers; w != workers + thread_count; ++w) {
+      w->start = start;
+      w->end = start = end - start > FILTER_CHUNK_SIZE ?
+          get_fofs(yf, start + FILTER_CHUNK_SIZE) : end;
+      if (w->end > end) w->end = start = end;
+      w->out_size = 0;
+#ifdef HAVE_PTHREAD
+      w->is_running = w != workers && w->start < w->end;
+      if (w->is_running &&
+          (errno = pthread_create(&w->thread, NULL, filter_worker_main, w))) {
+        die2_strerror("error: pthread_create", "");
+      }
+#endif
+    }
+    yfcheck(yf, opts->pathname);
+    /* The first chunk is scanned by this thread. Without pthreads, all. */
+    for (w = workers; w != workers + thread_count; ++w) {
+#ifdef HAVE_PTHREAD
+      if (w != workers) {
+        if (w->is_running && (errno = pthread_join(w->thread, NULL))) {
+          die2_strerror("error: pthread_join", "");
+        }
+        w->is_running = 0;
+        continue;
+      }
+#endif
+      filter_worker_main(w);
+    }
+    for (w = workers; w != workers + thread_count; ++w) {
+      yfcheck(w->yf, opts->pathname);
+      if (w->out_size != 0) {
+        write_all_to_stdout(w->out, w->out_size);
+        is_found = 1;
+      }
+    }
+  }
+  for (w = workers; w != workers + thread_count; ++w) {
+    if (w != workers) {
+      yfstats_add(&yf->stats, &w->own_yf.stats);
+      yfclose(&w->own_yf);
+      if (w->idxp) lbidx_close(w->idxp);
+    }
+    free(w->buf);
+    free(w->out);
+  }
+  free(workers);
+  return is_found;
+}
+
+#define MAX_PREFETCH_DEPTH 3  /* 2 ** 3 posix_fadvise(2) calls per probe. */
+
+/* Parses the decimal count (at most MAX_THREAD_COUNT) after the flag at
+ * **pp (e.g. -j8), and moves *pp to its last digit.
+ */
+STATIC int parse_flag_count(const char *argv0, const char **pp) {
+  const char *p = *pp;
+  int count = 0;
+  for (; p[1] >= '0' && p[1] <= '9'; ++p) {
+    count = count * 10 + (p[1] - '0');
+    if (count > MAX_THREAD_COUNT) usage_error(argv0, "flag count too large");
+  }
+  if (count == 0) usage_error(argv0, "missing flag count");
+  *pp = p;
+  return count;
+}
+
+/* Parses the decimal file offset after the flag at **pp (e.g. -F4096), and
+ * moves *pp to its last digit.
+ */
+STATIC off_t parse_flag_offset(const char *argv0, const char **pp) {
+  const char *p = *pp;
+  off_t ofs = 0;
+  if (p[1] < '0' || p[1] > '9') usage_error(argv0, "missing flag offset");
+  for (; p[1] >= '0' && p[1] <= '9'; ++p) {
+    if (ofs > (((off_t)1 << (sizeof(off_t) * 8 - 2)) - 1) / 5) {
+      usage_error(argv0, "flag offset too large");
+    }
+    ofs = ofs * 10 + (p[1] - '0');
+  }
+  *pp = p;
+  return ofs;
+}
+
+/* --- Server mode (flag -S)
+ *
+ * pts_lbsearch -S[<flags>] <socket> <sorted-text-file>... listens on the
+ * Unix domain socket <socket>, and answers queries from any number of
+ * clients, keeping the files open with warm read buffers, line cache (-C32
+ * by default) and sidecar index (with -x), thus saving the exec(2),
+ * open(2) and cold probes of each lookup. <flags> can be d, i, m, x, C<n>
+ * and P<n>. A file is reopened before a query if its size, mtime or inode
+ * has changed (a deleted file is still served).
+ *
+ * Each request is a line: <flags>\t<sorted-text-file>\t<key-x>[\t<key-y>],
+ * where <flags> are query flags among e, t, p, a, b, c, o and q (same as
+ * on the command line, without -B), and <sorted-text-file> is as specified
+ * for the server. The reply is:
+ *
+ * * -o: "<start> <end>\n", or "<start>\n" for -eo and -aeo without <key-y>;
+ * * -q: "1\n" if there is a match, "0\n" otherwise;
+ * * -c: "<size>\n", followed by <size> bytes: the matching lines;
+ * * on error: "error: <message>\n" (it never starts with a digit).
+ *
+ * Clients are served one request at a time by a single thread, so a client
+ * not reading a long -c reply delays the others.
+ */
+
+#ifdef HAVE_UNIX_SOCKET
+#define SERVER_MAX_REQUEST_SIZE 65536
+
+struct served_file {
+  struct input_options opts;
+  yfile yf;
+  struct lbidx idx;
+  struct lbidx *idxp;
+  struct stat st;  /* Of opts.pathname at the last open, or zeros. */
+};
+
+struct server_client {
+  int fd;
+  char *buf;
+  size_t size;
+  size_t alloc;
+};
+
+/* Reopens sf if its file has changed since it was opened.  */
+STATIC void served_file_refresh(struct served_file *sf) {
+  struct stat st;
+  if (stat(sf->opts.pathname, &st) != 0) {
+    if (sf->yf.err == LBS_OK) return;  /* Keep serving the deleted file. */
+    memset(&st, 0, sizeof(st));
+  } else if (sf->yf.err == LBS_OK && st.st_size == sf->st.st_size &&
+             st.st_mtime == sf->st.st_mtime && st.st_ino == sf->st.st_ino &&
+             st.st_dev == sf->st.st_dev) {
+    return;
   }
+  if (sf->idxp) lbidx_close(sf->idxp);
+  yfclose(&sf->yf);
+  sf->st = st;
+  sf->idxp = try_open_input(&sf->yf, &sf->idx, &sf->opts, 0);
 }
 
-/* --- main */
+/* Writes buf[:size] to the client fd. Returns false on error. */
+STATIC ybool write_all_to_fd(int fd, const char *buf, size_t size) {
+  ssize_t got;
+  while (size > 0) {
+    if ((got = write(fd, buf, size)) <= 0) {
+      if (got < 0 && errno == EINTR) continue;
+      return 0;
+    }
+    buf += got;
+    size -= got;
+  }
+  return 1;
+}
 
-STATIC __attribute__((noreturn)) void usage_error(
-    const char *argv0, const char *msg) {
-  die5_code("Binary search (bisection) in a sorted text file\n"
-            "Usage: ", argv0, "-<flags> <sorted-text-file> <key-x> [<key-y>]\n"
-            "<key-x> is the first key to search for\n"
-            "<key-y> is the last key to search for; default is <key-x>\n"
-            "Flags:\n"
-            "e: do bisect_left, open interval end\n"
-            "t: do bisect_right, closed interval end\n"
-            "b: do bisect_left for interval start (default)\n"
-            "a: do bisect_right for interval start (for append position)\n"
-            "p: do prefix search\n"
-            "c: print file contents (default)\n"
-            "o: print file offsets\n"
-            "q: don't print anything, just detect if there is a match\n"
-            "i: ignore incomplete last line (may be appended to right now)\n"
-            "usage error: ", msg, "\n",
-            1);
+/* Replies "error: <msg1>...<msg5>\n". Returns false on write error. */
+STATIC ybool server_error5(int fd, const char *msg1, const char *msg2,
+                           const char *msg3, const char *msg4,
+                           const char *msg5) {
+  char buf[1024];
+  const char *msgs[6];
+  size_t size = 0, n;
+  int i;
+  msgs[0] = "error: ";
+  msgs[1] = msg1;
+  msgs[2] = msg2;
+  msgs[3] = msg3;
+  msgs[4] = msg4;
+  msgs[5] = msg5;
+  for (i = 0; i < 6; ++i) {
+    n = strlen(msgs[i]);
+    if (n > sizeof(buf) - 1 - size) n = sizeof(buf) - 1 - size;
+    memcpy(buf + size, msgs[i], n);
+    size += n;
+  }
+  buf[size++] = '\n';
+  return write_all_to_fd(fd, buf, size);
 }
 
-STATIC void write_all_to_stdout(const char *buf, size_t size) {
-  size_t got = write(STDOUT_FILENO, buf, size);
-  if (got == size) {
-  } else if (got + 1U == 0U) {
-   die2_strerror("error: write stdout", "");
-  } else {
-   die1("error: short write");
+STATIC ybool server_error(int fd, const char *msg) {
+  return server_error5(fd, msg, "", "", "", "");
+}
+
+/* Replies with the error of yf, with a message similar to yfcheck. */
+STATIC ybool server_yf_error(int fd, const yfile *yf, const char *pathname) {
+  if (yf->err == LBS_ERR_NOT_SEEKABLE || yf->err == LBS_ERR_NOMEM) {
+    return server_error(fd, lbs_strerror(yf->err));
   }
+  return server_error5(fd, lbs_strerror(yf->err), " ", pathname, ": ",
+                       strerror(yf->err_errno));
 }
 
-STATIC void print_range(yfile *yf, off_t start, off_t end) {
-  int need;
+/* Copies bytes [start, end) of yf to the client fd. Returns false on error
+ * (also if the file got shorter).
+ */
+STATIC ybool server_send_range(int fd, yfile *yf, off_t start, off_t end) {
   const char *buf;
-  if (start >= end) return;
+  int need;
+  if (end - start >= SEND_RANGE_MIN_SIZE) {
+    start += send_range_to_fd(yf, fd, start, end - start);
+  }
   yfseek_set(yf, start);
-  end -= start;
-#if defined(__MSDOS__) || defined(_WIN32) || defined(_WIN64)
-  /* _WIN32 and _WIN64 cover __CYGWIN__, __MINGW32__, __MINGW64__ and
-   * _MSC_VER > 1000, no need to check for more.
-   */
-  setmode(STDOUT_FILENO, O_BINARY);
-#endif
-  while ((need = yfpeek(yf, end, &buf)) > 0) {
-    write_all_to_stdout(buf, need);
+  for (; start < end; start += need) {
+    if ((need = yfpeek(yf, end - start, &buf)) <= 0) return 0;
+    if (!write_all_to_fd(fd, buf, need)) return 0;
     yfseek_cur(yf, need);
-    end -= need;
   }
-  /* \n is not printed at EOF if there isn't any. */
-#if defined(__MSDOS__) || defined(_WIN32) || defined(_WIN64)
-  /* _WIN32 and _WIN64 cover __CYGWIN__, __MINGW32__, __MINGW64__ and
-   * _MSC_VER > 1000, no need to check for more.
-   */
-  setmode(STDOUT_FILENO, 0);
-#endif
+  return 1;
 }
 
-#if defined(__i386__) && __SIZEOF_INT__ == 4 && __SIZEOF_LONG_LONG__ == 8 && \
-    defined(__GNUC__)
-/* A smaller implementation of division for format_unsigned, which doesn't
- * call the __udivdi3 (for 64-bit /) and __umoddi3 (for 64-bit %) functions
- * from libgcc. This implementation can be smaller because the divisor (b) is
- * only 32 bits.
+/* Answers the request line[:size] (without the '\n') on the client fd.
+ * Returns false if the client should be disconnected.
  */
-
-typedef unsigned UInt32;
-typedef unsigned long long UInt64;
-/* Returns *a % b, and sets *a = *a_old / b; */
-STATIC __inline__ UInt32 UInt64DivAndGetMod(UInt64 *a, UInt32 b) {
-  /* http://stackoverflow.com/a/41982320/97248 */
-  UInt32 upper = ((UInt32*)a)[1], r;
-  ((UInt32*)a)[1] = 0;
-  if (upper >= b) {
-    ((UInt32*)a)[1] = upper / b;
-    upper %= b;
+STATIC ybool server_query(struct served_file *files, int file_count, int fd,
+                          const char *line, size_t size) {
+  const char *pend = line + size, *p, *q, *x, *y;
+  size_t xsize, ysize;
+  compare_mode_t cm = CM_UNSET, cmstart = CM_UNSET;
+  printing_t printing = PR_UNSET;
+  struct served_file *sf;
+  yfile *yf;
+  struct cache cache;
+  off_t start, end, lo = 0, hi = (off_t)-1;
+  /* Large enough to hold 3 off_t()s and 3 more bytes (flag -R). */
+  char ofsbuf[sizeof(off_t) * 9 + 3], *ofsp = ofsbuf;
+  char flag;
+  for (p = line; p != pend && *p != '\t'; ++p) {
+    flag = *p;
+    if (flag == 'e' || flag == 't' || flag == 'p') {
+      if (cm != CM_UNSET) return server_error(fd, "multiple boundary flags");
+      cm = flag == 'e' ? CM_LE : flag == 't' ? CM_LT : CM_LP;
+    } else if (flag == 'b' || flag == 'a') {
+      if (cmstart != CM_UNSET) return server_error(fd, "multiple start flags");
+      cmstart = flag == 'b' ? CM_LE : CM_LT;
+    } else if (flag == 'c' || flag == 'o' || flag == 'q' || flag == 'n' ||
+               flag == 'N' || flag == 'R') {
+      if (printing != PR_UNSET) {
+        return server_error(fd, "multiple printing flags");
+      }
+      printing = flag == 'c' ? PR_CONTENTS : flag == 'o' ? PR_OFFSETS :
+          flag == 'q' ? PR_DETECT : flag == 'n' ? PR_COUNT :
+          flag == 'N' ? PR_ESTIMATE : PR_RUN;
+    } else {
+      return server_error(fd, "unsupported flag");
+    }
   }
-  __asm__("divl %2" : "=a" (((UInt32*)a)[0]), "=d" (r) :
-      "rm" (b), "0" (((UInt32*)a)[0]), "1" (upper));
-  return r;
-}
-/* Returns *a % b, and sets *a = *a_old / b; */
-STATIC __inline__ UInt32 UInt32DivAndGetMod(UInt32 *a, UInt32 b) {
-  /* gcc-4.4 is smart enough to optimize the / and % to a single divl. */
-  const UInt32 r = *a % b;
-  *a /= b;
-  return r;
+  if (p == pend) return server_error(fd, "incorrect request");
+  for (q = ++p; q != pend && *q != '\t'; ++q) {}
+  if (q == pend) return server_error(fd, "incorrect request");
+  for (sf = files; sf != files + file_count; ++sf) {
+    if (strlen(sf->opts.pathname) == (size_t)(q - p) &&
+        0 == memcmp(sf->opts.pathname, p, q - p)) break;
+  }
+  if (sf == files + file_count) {
+    return server_error(fd, "file not served");
+  }
+  for (x = p = q + 1; p != pend && *p != '\t'; ++p) {}
+  xsize = p - x;
+  y = p == pend ? NULL : p + 1;
+  ysize = y ? (size_t)(pend - y) : 0;
+  if (printing == PR_UNSET) printing = PR_CONTENTS;
+  if (cmstart == CM_UNSET) cmstart = CM_LE;
+  if (cm == CM_UNSET) return server_error(fd, "missing boundary flag");
+  if (cmstart == CM_LT && !(!y && cm == CM_LE && printing == PR_OFFSETS)) {
+    return server_error(fd, "flag -a needs -eo and no <key-y>");
+  }
+  served_file_refresh(sf);
+  yf = &sf->yf;
+  if (yf->err != LBS_OK) return server_yf_error(fd, yf, sf->opts.pathname);
+  if (!y && cm == CM_LE && printing == PR_OFFSETS) {
+    cache_init(&cache);
+    if (sf->idxp) {
+      lbidx_narrow(sf->idxp, yfgetsize(yf), &lo, &hi, x, xsize, cmstart);
+    }
+    start = end = bisect_way(yf, &cache, lo, hi, x, xsize, cmstart);
+  } else {
+    bisect_interval(yf, sf->idxp, 0, (off_t)-1, (off_t)-1, cm, x, xsize,
+                    y ? y : x, y ? ysize : xsize, &start, &end);
+  }
+  if (yf->err != LBS_OK) return server_yf_error(fd, yf, sf->opts.pathname);
+  if (printing == PR_DETECT) {
+    return write_all_to_fd(fd, start < end ? "1\n" : "0\n", 2);
+  } else if (printing == PR_COUNT || printing == PR_ESTIMATE) {
+    start = count_range_lines(yf, start, end, cm, x, xsize, y, ysize,
+                              printing == PR_ESTIMATE);
+    if (yf->err != LBS_OK) return server_yf_error(fd, yf, sf->opts.pathname);
+    ofsp = format_unsigned(ofsp, start);
+  } else if (printing == PR_OFFSETS || printing == PR_RUN) {
+    ofsp = format_unsigned(ofsp, start);
+    if (y || cm != CM_LE || printing == PR_RUN) {
+      *ofsp++ = ' ';
+      ofsp = format_unsigned(ofsp, end);
+    }
+    if (printing == PR_RUN) {
+      *ofsp++ = ' ';
+      ofsp = format_unsigned(ofsp, count_range_lines(
+          yf, start, end, cm, x, xsize, y, ysize, 0));
+      if (yf->err != LBS_OK) {
+        return server_yf_error(fd, yf, sf->opts.pathname);
+      }
+    }
+  } else {
+    ofsp = format_unsigned(ofsp, end - start);
+  }
+  *ofsp++ = '\n';
+  return write_all_to_fd(fd, ofsbuf, ofsp - ofsbuf) &&
+      (printing != PR_CONTENTS || server_send_range(fd, yf, start, end));
 }
 
-/** Returns p + size of formatted output. */
-STATIC char *format_unsigned(char *p, off_t i) {
-  struct AssertOffTSizeIs4or8_Struct {
-    int  AssertOffTSizeIs4or8 : sizeof(i) == 4 || sizeof(i) == 8;
-  };
-  char *q = p, *result, c;
-  assert(i >= 0);
-  do {
-    *q++ = '0' + (
-        sizeof(i) == 8 ? UInt64DivAndGetMod((UInt64*)&i, 10) :
-        sizeof(i) == 4 ? UInt32DivAndGetMod((UInt32*)&i, 10) :
-        0);  /* 0 never happens, see AssertOffTSizeIs4or8 above. */
-  } while (i != 0);
-  result = q--;
-  while (p < q) {  /* Reverse the string between p and q. */
-    c = *p; *p++ = *q; *q-- = c;
+/* Reads from the client c, and answers its complete requests. Returns false
+ * if c should be disconnected.
+ */
+STATIC ybool server_serve_client(struct served_file *files, int file_count,
+                                 struct server_client *c) {
+  ssize_t got;
+  char *p, *q, *pend, *buf;
+  if (c->alloc - c->size < 4096) {
+    if (c->alloc >= SERVER_MAX_REQUEST_SIZE) {
+      (void)server_error(c->fd, "request too long");
+      return 0;
+    }
+    if (!(buf = (char*)realloc(c->buf, c->alloc * 2 + 4096))) return 0;
+    c->buf = buf;
+    c->alloc = c->alloc * 2 + 4096;
   }
-  return result;
+  if ((got = read(c->fd, c->buf + c->size, c->alloc - c->size)) <= 0) {
+    return got < 0 && errno == EINTR;
+  }
+  c->size += got;
+  for (p = c->buf, pend = c->buf + c->size;
+       (q = (char*)memchr(p, '\n', pend - p)) != NULL; p = q + 1) {
+    if (!server_query(files, file_count, c->fd, p, q - p)) return 0;
+  }
+  memmove(c->buf, p, pend - p);
+  c->size = pend - p;
+  return 1;
 }
-#else
 
-/** Returns p + size of formatted output. */
-static char *format_unsigned(char *p, off_t i) {
-  char *q = p, *result, c;
-  assert(i >= 0);
-  do {
-    *q++ = '0' + (i % 10);
-  } while ((i /= 10) != 0);
-  result = q--;
-  while (p < q) {  /* Reverse the string between p and q. */
-    c = *p; *p++ = *q; *q-- = c;
+STATIC __attribute__((noreturn)) void run_server(int argc, char **argv) {
+  struct input_options opts;
+  struct served_file *files, *sf;
+  struct server_client *clients = NULL, *c;
+  struct pollfd *pfds = NULL;
+  struct sockaddr_un addr;
+  struct stat st;
+  const char *socket_pathname, *p;
+  char flag;
+  int file_count, client_count = 0, client_alloc = 0, listen_fd, fd, i;
+  opts.block_size = get_env_block_size();
+  opts.is_direct = opts.is_mmap = opts.is_index_used = opts.is_stats = 0;
+  opts.is_lbofs_used = 0;
+  opts.prefetch_depth = 0;
+  opts.is_interpolated = 0;
+  opts.is_block_aligned = 0;
+  opts.lcache_size = 0;
+  opts.incomplete = IN_USE;
+  opts.keyspec = NULL;
+  for (p = argv[1] + 2; (flag = *p); ++p) {
+    if (flag == 'd') {
+      opts.is_direct = 1;
+    } else if (flag == 'm') {
+      opts.is_mmap = 1;
+    } else if (flag == 'x') {
+      opts.is_index_used = 1;
+    } else if (flag == 'l') {
+      opts.is_lbofs_used = 1;
+    } else if (flag == 'u') {
+      opts.is_interpolated = 1;
+    } else if (flag == 'r') {
+      opts.is_block_aligned = 1;
+    } else if (flag == 'i') {
+      opts.incomplete = IN_IGNORE;
+    } else if (flag == 'C') {
+      if ((opts.lcache_size = parse_flag_count(argv[0], &p)) >
+          LCACHE_MAX_SIZE) {
+        usage_error(argv[0], "line cache size too large");
+      }
+    } else if (flag == 'P') {
+      if ((opts.prefetch_depth = parse_flag_count(argv[0], &p)) >
+          MAX_PREFETCH_DEPTH) {
+        usage_error(argv[0], "prefetch depth too large");
+      }
+    } else {
+      usage_error(argv[0], "unsupported flag for -S");
+    }
+  }
+  if (opts.is_direct && opts.is_mmap) {
+    usage_error(argv[0], "flag -d conflicts with -m");
+  }
+  if (opts.is_direct && opts.prefetch_depth) {
+    usage_error(argv[0], "flag -d conflicts with -P");
+  }
+  if (opts.is_block_aligned && (opts.is_lbofs_used || opts.prefetch_depth)) {
+    usage_error(argv[0], "flag -r conflicts with -l and -P");
+  }
+  if (opts.lcache_size == 0) opts.lcache_size = 32;
+  if (argc < 4) usage_error(argv[0], "incorrect argument count");
+  socket_pathname = argv[2];
+  file_count = argc - 3;
+  if (!(files = (struct served_file*)malloc(file_count * sizeof(*files)))) {
+    die1("error: out of memory");
+  }
+  for (sf = files, i = 0; i < file_count; ++sf, ++i) {
+    sf->opts = opts;
+    sf->opts.pathname = argv[3 + i];
+    if (stat(sf->opts.pathname, &sf->st) != 0) {
+      memset(&sf->st, 0, sizeof(sf->st));
+    }
+    sf->idxp = open_input(&sf->yf, &sf->idx, &sf->opts, 1);
   }
-  return result;
-}
-#endif
 
-typedef enum printing_t {
-  PR_OFFSETS,
-  PR_CONTENTS,
-  PR_DETECT,
-  PR_UNSET,
-} printing_t;
+  if (strlen(socket_pathname) >= sizeof(addr.sun_path)) {
+    die1("error: socket pathname too long");
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_pathname);
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    die2_strerror("error: socket", "");
+  }
+  if (lstat(socket_pathname, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    (void)unlink(socket_pathname);  /* Left there by a previous server. */
+  }
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    die2_strerror("error: bind ", socket_pathname);
+  }
+  if (listen(listen_fd, 64) != 0) die2_strerror("error: listen", "");
+  (void)signal(SIGPIPE, SIG_IGN);  /* Clients may disconnect any time. */
 
-typedef enum incomplete_t {
-  IN_IGNORE,  /* Ignore incomplete last line of file. */
-  IN_USE,  /* Use incomplete last line of file as if it had a trailin '\n'. */
-  IN_UNSET,  /* Not set yet. Most functions do not support it. */
-} incomplete_t;
+  for (;;) {
+    if (client_count + 1 > client_alloc) {
+      client_alloc = client_alloc * 2 + 16;
+      clients = (struct server_client*)realloc(
+          clients, client_alloc * sizeof(*clients));
+      pfds = (struct pollfd*)realloc(pfds, (client_alloc + 1) * sizeof(*pfds));
+      if (!clients || !pfds) die1("error: out of memory");
+    }
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    for (i = 0; i < client_count; ++i) {
+      pfds[i + 1].fd = clients[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+    if (poll(pfds, client_count + 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      die2_strerror("error: poll", "");
+    }
+    /* Backwards, so that removing by swapping with the last is safe. */
+    for (i = client_count; i-- > 0;) {
+      c = clients + i;
+      if (pfds[i + 1].revents != 0 &&
+          !server_serve_client(files, file_count, c)) {
+        close(c->fd);
+        free(c->buf);
+        *c = clients[--client_count];
+      }
+    }
+    if ((pfds[0].revents & POLLIN) &&
+        (fd = accept(listen_fd, NULL, NULL)) >= 0) {
+      c = clients + client_count++;
+      c->fd = fd;
+      c->buf = NULL;
+      c->size = c->alloc = 0;
+    }
+  }
+}
+#endif
 
 int main(int argc, char **argv) {
   yfile yff, *yf = &yff;
@@ -663,32 +5809,80 @@ int main(int argc, char **argv) {
   const char *flags;
   const char *p;
   char flag;
-  /* Large enough to hold 2 off_t()s and 2 more bytes. */
-  char ofsbuf[sizeof(off_t) * 6 + 2], *ofsp;
+  /* Large enough to hold 3 off_t()s and 3 more bytes (flag -R). */
+  char ofsbuf[sizeof(off_t) * 9 + 3], *ofsp;
   compare_mode_t cm = CM_UNSET;
   compare_mode_t cmstart = CM_UNSET;
   size_t xsize, ysize;
   off_t start, end;
   printing_t printing = PR_UNSET;
   incomplete_t incomplete = IN_UNSET;
+  ybool is_batch = 0;
+  ybool is_merge = 0;
+  ybool is_follow = 0;
+  ybool is_sharded = 0;
+  ybool is_found_later = 0;
+  ybool is_filtered_out = 0;
+  ybool is_mmap = 0;
+  ybool is_direct = 0;
+  ybool is_index_build = 0;
+  ybool is_index_used = 0;
+  ybool is_lbofs_build = 0;
+  ybool is_lbofs_used = 0;
+  ybool is_stats = 0;
+  ybool is_interpolated = 0;
+  ybool is_block_aligned = 0;
+  int thread_count = 0;
+  int async_depth = 0;
+  int prefetch_depth = 0;
+  int lcache_size = 0;
+  int key_field = 0;
+  int key_width = 0;
+  char key_sep = '\0';
+  ybool is_numeric = 0;
+  struct keyspec ks;
+  const char *filter = NULL;
+  size_t filter_size = 0;
+  off_t lo = 0, hi = (off_t)-1, hint = (off_t)-1;
+  int exit_code = EXIT_SUCCESS;  /* 0. */
+  struct input_options opts;
+  struct lbidx idx, *idxp;
+
+#if defined(__MSDOS__) || defined(_WIN32) || defined(_WIN64)
+  /* _WIN32 and _WIN64 cover __CYGWIN__, __MINGW32__, __MINGW64__ and
+   * _MSC_VER > 1000, no need to check for more. All output (file contents,
+   * offsets and counts) is binary, so write(2) doesn't have to look for
+   * '\n' bytes to convert, and -B -c output isn't corrupted either.
+   */
+  setmode(STDOUT_FILENO, O_BINARY);
+#endif
 
   /* Parse the command-line. */
-  if (argc != 4 && argc != 5) usage_error(argv[0], "incorrect argument count");
+#ifdef HAVE_UNIX_SOCKET
+  if (argc >= 2 && argv[1][0] == '-' && argv[1][1] == 'S') {
+    run_server(argc, argv);
+  }
+#endif
+  if (argc < 3 || argc > 5) usage_error(argv[0], "incorrect argument count");
   if (argv[1][0] != '-') usage_error(argv[0], "missing flags");
   flags = argv[1] + 1;
   filename = argv[2];
-  x = argv[3];
-  for (p = x; *p && *p != '\n'; ++p) {}
-  xsize = p - x;  /* Make sure x[:psize] doesn't contain '\n'. */
-  if (argc == 4) {
-    y = NULL;
-    ysize = 0;
+  if (argc == 3) {  /* Batch mode (-B), checked below. */
+    x = y = NULL;
+    xsize = ysize = 0;
   } else {
-    y = argv[4];
-    for (p = y; *p && *p != '\n'; ++p) {}
-    ysize = p - y;  /* Make sure x[:psize] doesn't contain '\n'. */
+    x = argv[3];
+    for (p = x; *p && *p != '\n'; ++p) {}
+    xsize = p - x;  /* Make sure x[:psize] doesn't contain '\n'. */
+    if (argc == 4) {
+      y = NULL;
+      ysize = 0;
+    } else {
+      y = argv[4];
+      for (p = y; *p && *p != '\n'; ++p) {}
+      ysize = p - y;  /* Make sure x[:psize] doesn't contain '\n'. */
+    }
   }
-  /* TODO(pts): Make the initial lo and hi offsets specifiable. */
   for (p = flags; (flag = *p); ++p) {
     if (flag == 'e') {
       if (cm != CM_UNSET) usage_error(argv[0], "multiple boundary flags");
@@ -714,81 +5908,358 @@ int main(int argc, char **argv) {
     } else if (flag == 'q') {
       if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
       printing = PR_DETECT;
+    } else if (flag == 'n') {
+      if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
+      printing = PR_COUNT;
+    } else if (flag == 'N') {
+      if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
+      printing = PR_ESTIMATE;
+    } else if (flag == 'R') {
+      if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
+      printing = PR_RUN;
     } else if (flag == 'i') {
       if (incomplete != IN_UNSET) {
         usage_error(argv[0], "multiple incomplete flags");
       }
       incomplete = IN_IGNORE;
+    } else if (flag == 'm') {
+      if (is_mmap) usage_error(argv[0], "multiple mmap flags");
+      is_mmap = 1;
+    } else if (flag == 'd') {
+      if (is_direct) usage_error(argv[0], "multiple direct flags");
+      is_direct = 1;
+    } else if (flag == 'x') {
+      if (is_index_used) usage_error(argv[0], "multiple index flags");
+      is_index_used = 1;
+    } else if (flag == 'I') {
+      if (is_index_build) usage_error(argv[0], "multiple index flags");
+      is_index_build = 1;
+    } else if (flag == 'l') {
+      if (is_lbofs_used) usage_error(argv[0], "multiple line index flags");
+      is_lbofs_used = 1;
+    } else if (flag == 'L') {
+      if (is_lbofs_build) usage_error(argv[0], "multiple line index flags");
+      is_lbofs_build = 1;
+    } else if (flag == 'B') {
+      if (is_batch) usage_error(argv[0], "multiple batch flags");
+      is_batch = 1;
+    } else if (flag == 'M') {
+      if (is_batch) usage_error(argv[0], "multiple batch flags");
+      is_batch = is_merge = 1;
+    } else if (flag == 'f') {
+      if (is_follow) usage_error(argv[0], "multiple follow flags");
+      is_follow = 1;
+    } else if (flag == 's') {
+      if (is_sharded) usage_error(argv[0], "multiple shard flags");
+      is_sharded = 1;
+    } else if (flag == 'v') {
+      if (is_stats) usage_error(argv[0], "multiple stats flags");
+      is_stats = 1;
+    } else if (flag == 'u') {
+      if (is_interpolated) usage_error(argv[0], "multiple interpolation flags");
+      is_interpolated = 1;
+    } else if (flag == 'r') {
+      if (is_block_aligned) usage_error(argv[0], "multiple block probe flags");
+      is_block_aligned = 1;
+    } else if (flag == 'g') {
+      if (is_numeric) usage_error(argv[0], "multiple numeric flags");
+      is_numeric = 1;
+    } else if (flag == 'k') {  /* -k<field>, e.g. -k2. */
+      if (key_field != 0) usage_error(argv[0], "multiple key field flags");
+      key_field = parse_flag_count(argv[0], &p);
+    } else if (flag == 'T') {  /* -T<separator>, e.g. -T, */
+      if (key_sep != '\0') usage_error(argv[0], "multiple separator flags");
+      if ((key_sep = *++p) == '\0' || key_sep == '\n') {
+        usage_error(argv[0], "missing field separator");
+      }
+    } else if (flag == 'w') {  /* -w<width>, e.g. -w8. */
+      if (key_width != 0) usage_error(argv[0], "multiple key width flags");
+      key_width = parse_flag_count(argv[0], &p);
+    } else if (flag == 'G') {  /* -G<substring>, e.g. -Gerror. */
+      /* The substring is the rest of the flags. */
+      for (filter = p + 1; filter[filter_size] != '\0' &&
+           filter[filter_size] != '\n'; ++filter_size) {}
+      if (filter_size == 0) usage_error(argv[0], "missing filter substring");
+      p += strlen(p) - 1;
+    } else if (flag == 'j') {  /* -j<thread-count>, e.g. -j8. */
+      if (thread_count != 0) usage_error(argv[0], "multiple thread flags");
+      thread_count = parse_flag_count(argv[0], &p);
+    } else if (flag == 'A') {  /* -A<async-depth>, e.g. -A32. */
+      if (async_depth != 0) usage_error(argv[0], "multiple async flags");
+      async_depth = parse_flag_count(argv[0], &p);
+    } else if (flag == 'C') {  /* -C<line-cache-size>, e.g. -C32. */
+      if (lcache_size != 0) usage_error(argv[0], "multiple line cache flags");
+      lcache_size = parse_flag_count(argv[0], &p);
+      if (lcache_size > LCACHE_MAX_SIZE) {
+        usage_error(argv[0], "line cache size too large");
+      }
+    } else if (flag == 'F') {  /* -F<lo>, e.g. -F4096. */
+      if (lo != 0) usage_error(argv[0], "multiple from flags");
+      lo = parse_flag_offset(argv[0], &p);
+    } else if (flag == 'U') {  /* -U<hi>, e.g. -U8192. */
+      if (hi != (off_t)-1) usage_error(argv[0], "multiple until flags");
+      hi = parse_flag_offset(argv[0], &p);
+    } else if (flag == 'H') {  /* -H<hint>, e.g. -H4096. */
+      if (hint != (off_t)-1) usage_error(argv[0], "multiple hint flags");
+      hint = parse_flag_offset(argv[0], &p);
+    } else if (flag == 'P') {  /* -P<prefetch-depth>, e.g. -P2. */
+      if (prefetch_depth != 0) usage_error(argv[0], "multiple prefetch flags");
+      prefetch_depth = parse_flag_count(argv[0], &p);
+      if (prefetch_depth > MAX_PREFETCH_DEPTH) {
+        usage_error(argv[0], "prefetch depth too large");
+      }
     } else {
       usage_error(argv[0], "unsupported flag");
     }
   }
+  if (is_direct && is_mmap) usage_error(argv[0], "flag -d conflicts with -m");
+  if (is_direct && prefetch_depth) {
+    usage_error(argv[0], "flag -d conflicts with -P");
+  }
+  if (is_index_build && is_lbofs_build) {
+    usage_error(argv[0], "flag -I conflicts with -L");
+  }
+  if (is_sharded && (is_index_build || is_lbofs_build)) {
+    usage_error(argv[0], "flag -s conflicts with -I and -L");
+  }
+  if (is_index_build) {
+    unsigned long step = LBIDX_DEFAULT_STEP;
+    char *endp;
+    if (argc > 4) usage_error(argv[0], "incorrect argument count");
+    if (x) {
+      step = strtoul(x, &endp, 10);
+      if (*x == '\0' || *endp != '\0' || step == 0 || step > 0xffffffffUL) {
+        usage_error(argv[0], "bad index step");
+      }
+    }
+    yfopen(yf, filename, (off_t)-1);
+    yfcheck(yf, filename);
+    lbidx_build(yf, filename, (unsigned)step);
+    yfclose(yf);
+    return EXIT_SUCCESS;
+  }
+  if (is_lbofs_build) {
+    if (argc > 3) usage_error(argv[0], "incorrect argument count");
+    yfopen(yf, filename, (off_t)-1);
+    yfcheck(yf, filename);
+    lbofs_build(yf, filename);
+    yfclose(yf);
+    return EXIT_SUCCESS;
+  }
+  if (is_batch != (argc == 3)) {
+    usage_error(argv[0], "incorrect argument count");
+  }
   if (printing == PR_UNSET) printing = PR_CONTENTS;
-  if (incomplete == IN_UNSET) incomplete = IN_USE;
+  if (incomplete == IN_UNSET) incomplete = is_follow ? IN_IGNORE : IN_USE;
   if (cmstart == CM_UNSET) cmstart = CM_LE;
   if (cm == CM_UNSET) usage_error(argv[0], "missing boundary flag");
   if (cmstart == CM_LT && !(!y && cm == CM_LE && printing == PR_OFFSETS)) {
     /* TODO(pts): Make cmstart=CM_LT work in bisect_interval etc. */
     usage_error(argv[0], "flag -a needs -eo and no <key-y>");
   }
-  if (!y && printing != PR_OFFSETS && cm == CM_LE) {
+  if (!is_batch && !y && printing != PR_OFFSETS && cm == CM_LE) {
     usage_error(argv[0], "single-key contents is always empty");
   }
 
-  yfopen(yf, filename, (off_t)-1);
-  if (incomplete == IN_IGNORE) {
-    off_t size = yfgetsize(yf);
-    int c;
-    while (size != 0) {
-      yfseek_set(yf, size - 1);
-      if ((c = YFGETCHAR(yf)) < 0 || c == '\n') break;
-      --size;
-    }
-    yflimit(yf, size);
+  if (thread_count != 0 && !is_batch && !is_sharded && !filter) {
+    usage_error(argv[0], "flag -j needs -B, -s or -G");
   }
-  if (!y && cm == CM_LE && printing == PR_OFFSETS) {
+  if (filter && (printing != PR_CONTENTS || is_batch || is_sharded ||
+                 is_follow)) {
+    usage_error(argv[0], "flag -G needs -c, and no -B, -M, -s or -f");
+  }
+  if (async_depth != 0 && !is_batch) usage_error(argv[0], "flag -A needs -B");
+  if (async_depth != 0 && thread_count != 0) {
+    usage_error(argv[0], "flag -A conflicts with -j");
+  }
+  if (is_merge && (thread_count != 0 || async_depth != 0)) {
+    usage_error(argv[0], "flag -M conflicts with -j and -A");
+  }
+  if (is_batch && (lo != 0 || hi != (off_t)-1 || hint != (off_t)-1)) {
+    usage_error(argv[0], "flags -F, -U and -H conflict with -B and -M");
+  }
+  if (is_follow && (printing != PR_CONTENTS || is_batch)) {
+    usage_error(argv[0], "flag -f needs -c, and no -B or -M");
+  }
+  if (is_follow && (is_mmap || is_lbofs_used || hi != (off_t)-1)) {
+    usage_error(argv[0], "flag -f conflicts with -m, -l and -U");
+  }
+  if (is_sharded && printing == PR_RUN) {
+    usage_error(argv[0], "flag -s conflicts with -R");
+  }
+  if (is_sharded && (is_batch || is_follow || async_depth != 0)) {
+    usage_error(argv[0], "flag -s conflicts with -B, -M, -f and -A");
+  }
+  if (is_sharded && (lo != 0 || hi != (off_t)-1 || hint != (off_t)-1)) {
+    usage_error(argv[0], "flag -s conflicts with -F, -U and -H");
+  }
+  if (is_block_aligned && (is_lbofs_used || prefetch_depth != 0)) {
+    usage_error(argv[0], "flag -r conflicts with -l and -P");
+  }
+  if (is_interpolated && (async_depth != 0 || hint != (off_t)-1)) {
+    usage_error(argv[0], "flag -u conflicts with -A and -H");
+  }
+  if (key_sep != '\0' && key_field == 0) {
+    usage_error(argv[0], "flag -T needs -k");
+  }
+  if (is_numeric && cm == CM_LP) {
+    usage_error(argv[0], "flag -p conflicts with -g");
+  }
+  /* The .lbidx prefixes are of entire lines. */
+  if (is_index_used && (key_field != 0 || key_width != 0 || is_numeric)) {
+    usage_error(argv[0], "flag -x conflicts with -k, -w and -g");
+  }
+#ifndef HAVE_PTHREAD
+  /* The work is done in a single thread, with the same results. */
+  if (thread_count > 1) {
+    write5_stderr("warning: no thread support, ignoring flag -j", "", "", "",
+                  "\n");
+  }
+#ifndef HAVE_IO_URING
+  if (async_depth > 1) {
+    write5_stderr("warning: no io_uring or thread support, ignoring flag -A",
+                  "", "", "", "\n");
+  }
+#endif
+#endif
+
+  opts.pathname = filename;
+  opts.block_size = get_env_block_size();
+  opts.is_direct = is_direct;
+  opts.is_mmap = is_mmap;
+  opts.is_index_used = is_index_used;
+  opts.is_lbofs_used = is_lbofs_used;
+  opts.is_stats = is_stats;
+  opts.prefetch_depth = prefetch_depth;
+  opts.is_interpolated = is_interpolated;
+  opts.is_block_aligned = is_block_aligned;
+  opts.lcache_size = lcache_size;
+  opts.incomplete = incomplete;
+  opts.keyspec = NULL;
+  if (key_field != 0 || key_width != 0 || is_numeric) {
+    ks.field = key_field;
+    ks.sep = key_sep != '\0' ? key_sep : '\t';
+    ks.width = key_width;
+    ks.is_numeric = is_numeric;
+    opts.keyspec = &ks;
+  }
+  if (is_sharded) {
+    return run_sharded(&opts, cm, cmstart, printing, thread_count,
+                       x, xsize, y, ysize);
+  }
+  idxp = open_input(yf, &idx, &opts, 1);
+  /* -F and -H beyond the end (e.g. after -i) mean the end. */
+  if (lo > yfgetsize(yf)) lo = yfgetsize(yf);
+  if (hint > yfgetsize(yf)) hint = yfgetsize(yf);
+  if (is_follow && yf->read_at) {
+    die1("error: flag -f needs a local, uncompressed file");
+  }
+  if (is_merge) {
+    run_merge_join(yf, idxp, &opts, cm, cmstart, printing);
+  } else if (is_batch) {
+    run_batch(yf, idxp, &opts, cm, cmstart, printing, thread_count,
+              async_depth);
+  } else if (!y && cm == CM_LE && printing == PR_OFFSETS) {
     struct cache cache;
+    off_t usec = yfstats_usec(yf);
     cache_init(&cache);
-    start = bisect_way(yf, &cache, 0, (off_t)-1, x, xsize, cmstart);
-    yfclose(yf);
+    start = search_way(yf, &cache, idxp, lo, hi, hint, x, xsize, cmstart);
+    yf->stats.start_usec += yfstats_usec(yf) - usec;
+    yfcheck(yf, filename);
     ofsp = ofsbuf;
     ofsp = format_unsigned(ofsp, start);
     *ofsp++ = '\n';
     write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
-  } else if (printing == PR_DETECT &&
-             (!y || (xsize == ysize && 0 == memcmp(x, y, xsize)))) {
-    /* This branch is just a shortcut, it doesn't change the results. */
+  } else if (printing == PR_DETECT && (hi == (off_t)-1 || !y ||
+             (xsize == ysize && 0 == memcmp(x, y, xsize)))) {
+    /* This branch is just a shortcut, it doesn't change the results: the
+     * range is not empty iff the line at its start is before its end, so
+     * the end is not searched for (which would take most of the probes of
+     * a long run of equal keys).
+     */
     struct cache cache;
     const struct cache_entry *entry;
-    /* Shortcut just to detect if x is present. */
-    if (cm == CM_LE) exit(3);  /* start:end range would always be empty. */
-    cache_init(&cache);
-    start = bisect_way(yf, &cache, 0, (off_t)-1, x, xsize, CM_LE);
-    cache_init(&cache);  /* Can't reuse cache, cm has changed. */
-    /* We don't benefit any speed from the cache here (because it's empty),
-     * but we reuse the existing code to compare a single line from yf.
-     */
-    entry = get_using_cache(yf, &cache, start, x, xsize, cm);
-    yfclose(yf);
-    if (entry->cmp_result) exit(3);  /* exit(3) iff x not found in yf. */
+    off_t usec = yfstats_usec(yf);
+    if (!y) {
+      y = x;
+      ysize = xsize;
+    }
+    /* Same as is_empty in bisect_interval, e.g. with -e and y == x. */
+    if (compare_key_keyspec(yf->keyspec, y, ysize, x, xsize, cm)) {
+      exit_code = 3;  /* start:end range would always be empty. */
+    } else {
+      cache_init(&cache);
+      start = search_way(yf, &cache, idxp, lo, hi, hint, x, xsize, CM_LE);
+      cache_init(&cache);  /* Can't reuse cache, cm has changed. */
+      /* We don't benefit any speed from the cache here (because it's empty),
+       * but we reuse the existing code to compare a single line from yf.
+       */
+      entry = get_using_cache(yf, &cache, start, y, ysize, cm);
+      yf->stats.start_usec += yfstats_usec(yf) - usec;
+      yfcheck(yf, filename);
+      /* The line at hi (flag -U) or later is beyond the end. */
+      if (entry->cmp_result || (hi != (off_t)-1 && start >= hi)) {
+        exit_code = 3;  /* No match found. */
+      }
+    }
   } else {
     if (!y) {
       y = x;
       ysize = xsize;
     }
-    bisect_interval(yf, 0, (off_t)-1, cm, x, xsize, y, ysize, &start, &end);
+    bisect_interval(yf, idxp, lo, hi, hint, cm, x, xsize, y, ysize,
+                    &start, &end);
+    yfcheck(yf, filename);
     if (printing == PR_CONTENTS) {
-      print_range(yf, start, end);
-    } else if (printing == PR_OFFSETS) {
+      off_t usec = yfstats_usec(yf);
+      yfadvise(yf, 1);
+      if (filter) {
+        is_filtered_out = !print_filtered_range(yf, &opts, start, end,
+                                                filter, filter_size,
+                                                thread_count);
+      } else {
+        print_range(yf, start, end);
+      }
+      yf->stats.print_usec += yfstats_usec(yf) - usec;
+      yfcheck(yf, filename);
+      if (is_follow && end == yfgetsize(yf)) {
+        is_found_later = follow_range(yf, filename, lo, end, cm,
+                                      x, xsize, y, ysize);
+      }
+    } else if (printing == PR_OFFSETS || printing == PR_RUN) {
       ofsp = ofsbuf;
       ofsp = format_unsigned(ofsp, start);
       *ofsp++ = ' ';
       ofsp = format_unsigned(ofsp, end);
+      if (printing == PR_RUN) {
+        off_t usec = yfstats_usec(yf);
+        *ofsp++ = ' ';
+        ofsp = format_unsigned(ofsp, count_range_lines(
+            yf, start, end, cm, x, xsize, y, ysize, 0));
+        yf->stats.print_usec += yfstats_usec(yf) - usec;
+        yfcheck(yf, filename);
+      }
+      *ofsp++ = '\n';
+      write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
+    } else if (printing == PR_COUNT || printing == PR_ESTIMATE) {
+      off_t usec = yfstats_usec(yf);
+      if (printing == PR_COUNT) yfadvise(yf, 1);
+      ofsp = ofsbuf;
+      ofsp = format_unsigned(ofsp, count_range_lines(
+          yf, start, end, cm, x, xsize, y, ysize, printing == PR_ESTIMATE));
       *ofsp++ = '\n';
+      yf->stats.print_usec += yfstats_usec(yf) - usec;
+      yfcheck(yf, filename);
       write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
     }
-    yfclose(yf);
-    if (start >= end) exit(3);  /* No match found. */
+    if ((start >= end || is_filtered_out) && !is_found_later) {
+      exit_code = 3;  /* No match found. */
+    }
   }
-  return EXIT_SUCCESS;  /* 0. */
+  if (is_stats) write_stats(yf, idxp);
+  yfclose(yf);
+  if (idxp) lbidx_close(idxp);
+  return exit_code;
 }
+
+#endif  /* PTS_LBSEARCH_NO_MAIN */
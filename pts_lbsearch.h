@@ -0,0 +1,140 @@
+/*
+ * pts_lbsearch.h: Library API of pts_lbsearch.c (libptslbsearch).
+ *
+ * License: GNU GPL v2 or newer, at your choice.
+ *
+ * Build the library with compile_lib.sh, which compiles pts_lbsearch.c with
+ * -DPTS_LBSEARCH_NO_MAIN. The library never calls exit(3) and never writes
+ * to stdout or stderr: all functions returning int return LBS_OK (0) on
+ * success, and an lbs_error code otherwise.
+ *
+ * Each lbs_file handle is independent (there is no global state), so
+ * different threads can use different handles at the same time. A single
+ * handle must not be used by multiple threads concurrently.
+ *
+ * Errors are sticky: after an I/O error, all subsequent calls on the same
+ * handle (except for lbs_close) fail with the same error.
+ */
+
+#ifndef PTS_LBSEARCH_H
+#define PTS_LBSEARCH_H 1
+
+#ifndef __XTINY__
+#include <stddef.h>  /* size_t. */
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef long long lbs_off_t;  /* File offset, always 64 bits. */
+
+typedef struct lbs_file lbs_file;
+
+typedef enum lbs_error {
+  LBS_OK = 0,
+  LBS_ERR_OPEN = 1,  /* open(2) failed. errno is available in lbs_errno. */
+  LBS_ERR_NOT_SEEKABLE = 2,  /* The input is a pipe or similar. */
+  LBS_ERR_LSEEK = 3,
+  LBS_ERR_READ = 4,
+  LBS_ERR_NOMEM = 5,
+  LBS_ERR_ARG = 6,  /* Invalid argument. */
+  /* A .gz or .bgz file which is not BGZF (bgzip), or is corrupt, or the
+   * library was compiled without zlib.
+   */
+  LBS_ERR_FORMAT = 7,
+  LBS_ERR_REMOTE = 8  /* Unexpected HTTP response, e.g. 404 or no Range. */
+} lbs_error;
+
+/* Flags for lbs_open. */
+#define LBS_MMAP 1  /* Use mmap(2) instead of read(2) if possible (-m). */
+#define LBS_DIRECT 2  /* Use O_DIRECT if possible (-d). */
+#define LBS_INDEX 4  /* Use <pathname>.lbidx if it is up to date (-x). */
+#define LBS_IGNORE_INCOMPLETE 8  /* Ignore incomplete last line (-i). */
+/* Remember the last 32 lines read across calls (-C32): faster for many
+ * queries with common top-of-tree probes.
+ */
+#define LBS_LINE_CACHE 16
+/* Bisect over line numbers using <pathname>.lbofs if it is up to date (-l).
+ */
+#define LBS_LINE_INDEX 32
+/* Interpolation search (-u): fewer probes if the keys are uniformly
+ * distributed over the file (e.g. hex hashes), like bisection otherwise.
+ */
+#define LBS_INTERPOLATE 64
+/* Probe whole blocks (-r): use all lines in each block read to narrow the
+ * search, fewer reads per search.
+ */
+#define LBS_BLOCK_ALIGNED 128
+
+/* Comparison modes, each line of the file is compared to a key: */
+typedef enum lbs_mode {
+  LBS_LE = 0,  /* key <= line. Leftmost insertion point (bisect_left). */
+  LBS_LT = 1,  /* key < line. Rightmost insertion point (bisect_right). */
+  LBS_LP = 2  /* key* < line, where key* is key followed by all lines
+               * starting with key: end of the prefix range. */
+} lbs_mode;
+
+/** Opens the line-sorted text file pathname for searching, and sets
+ * *lbf_out to the new handle, which must be closed with lbs_close (even on
+ * error, unless *lbf_out is NULL). block_size is the read block size: 0 for
+ * the default (8192), or a power of 2 between 512 and 1 << 26. If pathname
+ * ends with .gz or .bgz, the uncompressed data of the BGZF (bgzip) file is
+ * searched (offsets are also within the uncompressed data). If pathname is
+ * an http:// URL, the remote file is read with HTTP range requests.
+ */
+int lbs_open(lbs_file **lbf_out, const char *pathname, unsigned flags,
+             int block_size);
+
+/** Closes lbf (if not NULL), and frees all its resources. */
+void lbs_close(lbs_file *lbf);
+
+/** Returns the size of the searchable part of the file. */
+lbs_off_t lbs_get_size(const lbs_file *lbf);
+
+/** Sets *ofs_out to the start offset of the first line for which the
+ * comparison (mode) with key[:key_size] is true, or to the file size if
+ * there isn't any. The key is truncated at the first '\n'.
+ */
+int lbs_search(lbs_file *lbf, lbs_mode mode, const char *key,
+               size_t key_size, lbs_off_t *ofs_out);
+
+/** Same as lbs_search, but the result is limited to the lines starting in
+ * [lo, hi] (hi == -1 means EOF): the lines before are treated as smaller
+ * than key, and the first line starting at hi or later as larger. If
+ * hint >= 0, the search starts at offset hint (e.g. a previous result for
+ * a nearby key), and gallops towards the result, which takes only a few
+ * reads from the same block if it is near. The result doesn't depend on
+ * hint.
+ */
+int lbs_search_from(lbs_file *lbf, lbs_mode mode, const char *key,
+                    size_t key_size, lbs_off_t lo, lbs_off_t hi,
+                    lbs_off_t hint, lbs_off_t *ofs_out);
+
+/** Sets [*start_out, *end_out) to the byte range of the lines at least
+ * x[:xsize], and smaller than (LBS_LE), at most (LBS_LT), or smaller than
+ * or starting with (LBS_LP) y[:ysize]. If y is NULL, x is used instead.
+ * The keys are truncated at the first '\n'. Same as the pts_lbsearch
+ * command-line tool with flag -e, -t or -p, respectively.
+ */
+int lbs_range(lbs_file *lbf, lbs_mode mode, const char *x, size_t xsize,
+              const char *y, size_t ysize,
+              lbs_off_t *start_out, lbs_off_t *end_out);
+
+/** Copies file bytes [ofs, ofs + size) to buf, and sets *got_out to
+ * the number of bytes copied, which is less than size only at EOF.
+ */
+int lbs_read(lbs_file *lbf, lbs_off_t ofs, char *buf, size_t size,
+             size_t *got_out);
+
+/** Returns the errno(3) value of the error of lbf, or 0. */
+int lbs_errno(const lbs_file *lbf);
+
+/** Returns a short English description of an lbs_error code. */
+const char *lbs_strerror(int err);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* PTS_LBSEARCH_H */
@@ -0,0 +1,411 @@
+#! /usr/bin/env python3
+
+"""Benchmark of the line bisection implementations in this directory.
+
+License: GNU GPL v2 or newer, at your choice.
+
+Generates synthetic sorted text files (of varying size, line length and key
+distribution) in a work directory, compiles pts_lbsearch.c and lbsearch.c
+there with ${CC:-gcc}, and runs query workloads with each engine, block size
+(PTS_LBSEARCH_BLOCK_SIZE, used by pts_lbsearch only) and page cache state:
+
+* point: all lines equal to a key (-to <key>)
+* prefix: all lines starting with a key prefix (-po <prefix>)
+* range: the lines between two keys (-eo <key-x> <key-y>)
+* batch: all point queries in a single process (-toB, pts_lbsearch only)
+
+Half of the keys are lines in the file, the other half are random. The
+engines are:
+
+* pts_lbsearch, and its I/O strategies: pts_lbsearch-m (mmap(2)),
+  pts_lbsearch-d (O_DIRECT), pts_lbsearch-r (block probes) and
+  pts_lbsearch-u (interpolation search)
+* lbsearch: lbsearch.c, an early version of pts_lbsearch.c, only with
+  --engines=lbsearch,...: most of its results are wrong (also on db), so
+  its latency, syscall and byte columns are not comparable with the others
+* python: pts_line_bisect.py, run with a Python 2 interpreter (--python)
+* bisect: bisect.c, which has no command line: it does its own single query
+  on the sample file db, so it is run only for db
+
+Each query is a new process. For each combination, it prints the number of
+queries, latency percentiles (in milliseconds, wall time including the
+process startup), and the averages per query of the probes (with -v, only
+pts_lbsearch has it), the read(2)-like syscalls and the bytes read by them
+(from /proc/<pid>/io, minus the same for a process which only prints its
+usage, so page faults with mmap(2) are not counted), and the number of
+results different from the first engine. Cold
+cache means POSIX_FADV_DONTNEED on the file before each query (before each
+process in batch mode), which has no effect on tmpfs (e.g. /tmp on some
+systems) or for dirty pages, so use a --dir on a disk for cold results.
+
+Usage: ./pts_lbsearch_bench.py [--sizes=1m,16m] [--engines=pts_lbsearch,...]
+Run with --help for all options. Needs Python 3.3 on Linux.
+"""
+
+import optparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ENGINES = ('pts_lbsearch', 'pts_lbsearch-m', 'pts_lbsearch-d',
+           'pts_lbsearch-r', 'pts_lbsearch-u', 'lbsearch', 'python', 'bisect')
+DEFAULT_ENGINES = tuple(name for name in ENGINES if name != 'lbsearch')
+WORKLOADS = ('point', 'prefix', 'range', 'batch')
+DISTS = ('uniform', 'seq', 'skewed')
+# Workloads supported by the engines which are not pts_lbsearch*.
+ENGINE_WORKLOADS = {
+    'lbsearch': ('point', 'prefix', 'range'),
+    'python': ('point', 'range'),
+    'bisect': ('point',),
+}
+BISECT_KEY = 'gcc\377'  # Hardcoded in bisect.c.
+
+
+def parse_size(s):
+  """Parses a size like 512, 64k or 16m."""
+  s = s.strip().lower()
+  for suffix, shift in (('k', 10), ('m', 20), ('g', 30)):
+    if s.endswith(suffix):
+      return int(s[:-1]) << shift
+  return int(s)
+
+
+def format_size(n):
+  for suffix, shift in (('g', 30), ('m', 20), ('k', 10)):
+    if n >= 1 << shift and not n & ((1 << shift) - 1):
+      return '%d%s' % (n >> shift, suffix)
+  return str(n)
+
+
+def generate_keys(dist, count, rng):
+  """Returns count (not necessarily distinct) keys of the distribution."""
+  if dist == 'uniform':  # E.g. hashes.
+    return ['%032x' % rng.getrandbits(128) for _ in range(count)]
+  if dist == 'seq':  # E.g. timestamps in a log file, with gaps.
+    t, keys = 1500000000000, []
+    for _ in range(count):
+      t += int(rng.expovariate(0.01)) + 1
+      keys.append('%d' % t)
+    return keys
+  if dist == 'skewed':  # Long runs of duplicates and common prefixes.
+    return ['%08x%04x' % (int(rng.paretovariate(0.8)), rng.randrange(16))
+            for _ in range(count)]
+  raise ValueError('unknown distribution: %s' % dist)
+
+
+def generate_file(pathname, size, line_size, dist, rng):
+  """Writes a sorted file of about size bytes, returns the list of keys."""
+  count = max(1, size // line_size)
+  keys = generate_keys(dist, count, rng)
+  keys.sort()
+  f = open(pathname + '.tmp', 'w')
+  try:
+    for key in keys:
+      pad = line_size - len(key) - 2
+      f.write(key + '\t' + 'x' * max(pad, 0) + '\n')
+  finally:
+    f.close()
+  os.rename(pathname + '.tmp', pathname)
+  return keys
+
+
+def generate_queries(keys, count, rng):
+  """Returns count (x, prefix, y) queries, half of them hits in keys."""
+  queries = []
+  random_keys = generate_keys('uniform', count, rng)
+  for i in range(count):
+    if i & 1:  # Random, most probably a miss.
+      x = random_keys[i][:len(keys[0])]
+    else:
+      x = rng.choice(keys)
+    y = rng.choice(keys)
+    if y < x:
+      x, y = y, x
+    queries.append((x, x[:max(1, len(x) // 2)], y))
+  return queries
+
+
+def run(argv, stdin_data='', env=None, cwd=None):
+  """Runs argv, returns (stdout, stderr, wall_seconds, syscr, rchar).
+
+  The I/O counters are read from /proc/<pid>/io after the process has
+  exited, but before it is reaped (os.waitid with WNOWAIT).
+  """
+  fin = tempfile.TemporaryFile()
+  fout = tempfile.TemporaryFile()
+  ferr = tempfile.TemporaryFile()
+  try:
+    fin.write(os.fsencode(stdin_data))
+    fin.seek(0)
+    start = time.perf_counter()
+    p = subprocess.Popen(argv, stdin=fin, stdout=fout, stderr=ferr, env=env,
+                         cwd=cwd)
+    os.waitid(os.P_PID, p.pid, os.WEXITED | os.WNOWAIT)
+    wall = time.perf_counter() - start
+    syscr = rchar = 0
+    try:
+      for line in open('/proc/%d/io' % p.pid):
+        name, value = line.split(':')
+        if name == 'syscr':
+          syscr = int(value)
+        elif name == 'rchar':
+          rchar = int(value)
+    except IOError:
+      pass
+    p.wait()
+    fout.seek(0)
+    ferr.seek(0)
+    return (fout.read().decode('latin-1'), ferr.read().decode('latin-1'),
+            wall, syscr, rchar)
+  finally:
+    fin.close()
+    fout.close()
+    ferr.close()
+
+
+def parse_stats(stderr):
+  """Returns the dict of the -v statistics line of pts_lbsearch."""
+  for line in stderr.splitlines():
+    if line.startswith('stats: '):
+      return dict((k, int(v)) for k, v in
+                  (item.split('=') for item in line[7:].split()))
+  return {}
+
+
+def drop_cache(pathname):
+  fd = os.open(pathname, os.O_RDONLY)
+  try:
+    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+  finally:
+    os.close(fd)
+
+
+def percentile(values, p):
+  values = sorted(values)
+  return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+class Engine(object):
+  """Runs queries with one of ENGINES."""
+
+  def __init__(self, name, argv0, flags='', cwd=None):
+    self.name = name
+    self.argv0 = argv0  # List of arguments before the flags.
+    self.flags = flags
+    self.cwd = cwd
+    self.is_pts = name.startswith('pts_lbsearch')
+    self.workloads = WORKLOADS if self.is_pts else ENGINE_WORKLOADS[name]
+    # I/O of a process which fails with a usage error (or, for bisect,
+    # which doesn't find ./db).
+    self.base_syscr, self.base_rchar = run(
+        argv0, cwd=name == 'bisect' and tempfile.gettempdir() or cwd)[3:]
+
+  def argv(self, workload, pathname, query):
+    """Returns the command line of a query (x, prefix, y)."""
+    if self.name == 'bisect':
+      return self.argv0
+    flags = '-' + self.flags + ('v' if self.is_pts else '')
+    if workload == 'batch':  # The queries are on stdin.
+      return self.argv0 + [flags + 'toB', pathname]
+    x, prefix, y = query
+    if workload == 'point':
+      return self.argv0 + [flags + 'to', pathname, x]
+    if workload == 'prefix':
+      return self.argv0 + [flags + 'po', pathname, prefix]
+    return self.argv0 + [flags + 'eo', pathname, x, y]
+
+
+class Result(object):
+  """Measurements of a workload with an engine."""
+
+  def __init__(self):
+    self.walls = []
+    self.probes = self.syscr = self.rchar = self.mismatches = 0
+    self.is_probes = False
+    self.count = 0  # Number of queries.
+
+  def add(self, engine, stdout, stderr, wall, syscr, rchar, count=1):
+    self.walls.append(wall / count)
+    self.syscr += syscr - engine.base_syscr
+    self.rchar += rchar - engine.base_rchar
+    stats = parse_stats(stderr)
+    if 'probes' in stats:
+      self.is_probes = True
+      self.probes += stats['probes']
+    self.count += count
+
+
+def run_workload(engine, workload, pathname, queries, cache, env, expected):
+  """Returns the Result of workload on pathname with engine.
+
+  expected is a dict from query results to the first engine's output,
+  updated when this is the first engine.
+  """
+  result = Result()
+  if workload == 'batch':
+    if cache == 'cold':
+      drop_cache(pathname)
+    stdin_data = ''.join(q[0] + '\n' for q in queries)
+    out = run(engine.argv(workload, pathname, None), stdin_data, env=env)
+    result.add(engine, *out, count=len(queries))
+    for query, line in zip(queries, out[0].splitlines()):
+      if expected.setdefault(('point', query), line + '\n') != line + '\n':
+        result.mismatches += 1
+    return result
+  for query in queries:
+    if cache == 'cold':
+      drop_cache(pathname)
+    out = run(engine.argv(workload, pathname, query), env=env,
+              cwd=engine.cwd)
+    result.add(engine, *out)
+    if engine.name != 'bisect':
+      if expected.setdefault((workload, query), out[0]) != out[0]:
+        result.mismatches += 1
+  return result
+
+
+def find_python2(python):
+  """Returns the argv0 list of a working Python 2 interpreter, or None."""
+  for name in ([python] if python else ['python2.7', 'python2', 'python']):
+    try:
+      out = run([name, '-c', 'import sys; print(sys.version_info[0])'])[0]
+    except OSError:
+      continue
+    if out.strip() == '2':
+      return [name]
+  return None
+
+
+def build(srcdir, workdir, cc):
+  """Compiles the C implementations in workdir, returns dict of pathnames."""
+  binaries = {}
+  for name in ('pts_lbsearch', 'lbsearch', 'bisect'):
+    pathname = os.path.join(workdir, name)
+    argv = (cc.split() + ['-O2', '-DNDEBUG', '-o', pathname,
+                          os.path.join(srcdir, name + '.c')])
+    if name != 'bisect':
+      argv.insert(1, '-ansi')
+    if subprocess.call(argv) == 0:
+      binaries[name] = pathname
+    else:
+      sys.stderr.write('warning: build failed, skipping: %s\n' % name)
+  return binaries
+
+
+def main(argv):
+  parser = optparse.OptionParser(usage='%prog [<option> ...]',
+                                 description=__doc__.split('\n\n')[0])
+  parser.add_option('--dir', help='work directory for the generated files '
+                    'and binaries (default: a temporary one, removed)')
+  parser.add_option('--sizes', default='1m,16m',
+                    help='file sizes, e.g. 1m,16m')
+  parser.add_option('--line-sizes', default='40,200',
+                    help='average line sizes in bytes')
+  parser.add_option('--dists', default=','.join(DISTS),
+                    help='key distributions: ' + ', '.join(DISTS))
+  parser.add_option('--engines', default=','.join(DEFAULT_ENGINES),
+                    help='engines (default: all but lbsearch): ' +
+                    ', '.join(ENGINES))
+  parser.add_option('--workloads', default=','.join(WORKLOADS),
+                    help='workloads: ' + ', '.join(WORKLOADS))
+  parser.add_option('--block-sizes', default='8k,64k',
+                    help='PTS_LBSEARCH_BLOCK_SIZE values for pts_lbsearch')
+  parser.add_option('--caches', default='warm,cold',
+                    help='page cache states: warm, cold')
+  parser.add_option('--queries', type='int', default=50,
+                    help='number of queries per workload')
+  parser.add_option('--seed', type='int', default=42)
+  parser.add_option('--pts-lbsearch', metavar='PATHNAME',
+                    help='use this pts_lbsearch binary instead of compiling '
+                    'one, e.g. for comparing with an older version')
+  parser.add_option('--python', metavar='PATHNAME',
+                    help='Python 2 interpreter for pts_line_bisect.py')
+  parser.add_option('--tsv', action='store_true',
+                    help='print tab-separated values, for diffing')
+  options, args = parser.parse_args(argv[1:])
+  if args:
+    parser.error('too many arguments')
+  srcdir = os.path.dirname(os.path.abspath(__file__))
+  workdir = options.dir or tempfile.mkdtemp(prefix='pts_lbsearch_bench.')
+  if not os.path.isdir(workdir):
+    os.makedirs(workdir)
+  try:
+    binaries = build(srcdir, workdir, os.getenv('CC') or 'gcc')
+    if options.pts_lbsearch:
+      binaries['pts_lbsearch'] = os.path.abspath(options.pts_lbsearch)
+    engines = []
+    for name in options.engines.split(','):
+      if name not in ENGINES:
+        parser.error('unknown engine: %s' % name)
+      if name == 'python':
+        argv0 = find_python2(options.python)
+        if argv0 is None:
+          sys.stderr.write('warning: no Python 2, skipping: python\n')
+          continue
+        argv0.append(os.path.join(srcdir, 'pts_line_bisect.py'))
+        engines.append(Engine(name, argv0))
+      elif binaries.get(name.split('-')[0]):
+        engines.append(Engine(name, [binaries[name.split('-')[0]]],
+                              flags=name.partition('-')[2], cwd=srcdir))
+    workloads = options.workloads.split(',')
+    block_sizes = [parse_size(s) for s in options.block_sizes.split(',')]
+    rng = random.Random(options.seed)
+    files = [('db', os.path.join(srcdir, 'db'), None)]
+    for dist in options.dists.split(','):
+      for size in [parse_size(s) for s in options.sizes.split(',')]:
+        for line_size in [int(s) for s in options.line_sizes.split(',')]:
+          name = '%s-%s-%d' % (dist, format_size(size), line_size)
+          pathname = os.path.join(workdir, name + '.txt')
+          files.append((name, pathname, generate_file(
+              pathname, size, line_size, dist, rng)))
+    columns = ('file', 'engine', 'block', 'cache', 'workload', 'queries',
+               'p50_ms', 'p90_ms', 'p99_ms', 'max_ms', 'probes', 'syscalls',
+               'bytes', 'mismatches')
+    row_format = ('%s\t' * len(columns))[:-1] if options.tsv else (
+        '%-18s %-14s %5s %4s %-6s %7s %6s %6s %6s %6s %6s %8s %9s %5s')
+    print(row_format % columns)
+    for name, pathname, keys in files:
+      if keys is None:  # The sample file, its keys are its lines.
+        keys = [os.fsdecode(line) for line in
+                open(pathname, 'rb').read().splitlines()]
+      queries = generate_queries(keys, options.queries, rng)
+      expected = {}
+      for engine in engines:
+        if engine.name == 'bisect' and name != 'db':
+          continue  # bisect only searches db.
+        for block_size in (block_sizes if engine.is_pts else [None]):
+          env = dict(os.environ)
+          if block_size:
+            env['PTS_LBSEARCH_BLOCK_SIZE'] = str(block_size)
+          for cache in options.caches.split(','):
+            for workload in workloads:
+              if workload not in engine.workloads:
+                continue
+              qs = queries
+              if engine.name == 'bisect':
+                qs = [(BISECT_KEY, BISECT_KEY, BISECT_KEY)]
+              r = run_workload(engine, workload, pathname, qs, cache, env,
+                               expected)
+              print(row_format % (
+                  name, engine.name,
+                  block_size and format_size(block_size) or '-', cache,
+                  workload, r.count,
+                  '%.3f' % (percentile(r.walls, 50) * 1000),
+                  '%.3f' % (percentile(r.walls, 90) * 1000),
+                  '%.3f' % (percentile(r.walls, 99) * 1000),
+                  '%.3f' % (max(r.walls) * 1000),
+                  r.is_probes and '%.1f' % (float(r.probes) / r.count) or '-',
+                  '%.1f' % (float(r.syscr) / r.count),
+                  '%d' % (r.rchar // r.count), r.mismatches))
+              sys.stdout.flush()
+  finally:
+    if not options.dir:
+      shutil.rmtree(workdir)
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
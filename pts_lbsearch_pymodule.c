@@ -0,0 +1,292 @@
+/*
+ * pts_lbsearch_pymodule.c: Python extension module _pts_lbsearch, which
+ * calls libptslbsearch (pts_lbsearch.h) to search sorted text files.
+ *
+ * License: GNU GPL v2 or newer, at your choice.
+ *
+ * Build it with compile_pymodule.sh, for Python 2.6, 2.7 or 3.x. It's used
+ * by pts_line_bisect.bisect_many if it can be imported, see that for the
+ * Python API. Functions (handle is the return value of open):
+ *
+ * * open(pathname, flags=0, block_size=0) -> handle: lbs_open. The handle
+ *   is closed when it's garbage collected, or with close.
+ * * close(handle): lbs_close. Subsequent calls with handle fail.
+ * * size(handle) -> int: lbs_get_size.
+ * * search(handle, mode, key, lo=0, hi=-1, hint=-1) -> int: lbs_search_from.
+ * * search_many(handle, mode, keys) -> list of int: lbs_search for each key,
+ *   done in sorted key order, galloping from the previous result (like
+ *   pts_lbsearch -B), without the GIL.
+ * * range(handle, mode, x, y=None) -> (start, end): lbs_range.
+ *
+ * The constants (LE, LT, LP, and the flags, e.g. MMAP) are the ones in
+ * pts_lbsearch.h without the LBS_ prefix. Errors raise IOError (OSError),
+ * MemoryError or ValueError. A handle must not be used by multiple Python
+ * threads at the same time.
+ */
+
+#define PY_SSIZE_T_CLEAN 1
+#include <Python.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pts_lbsearch.h"
+
+#define HANDLE_NAME "_pts_lbsearch.handle"
+
+/* The object in the capsule, lbf is NULL after close. */
+struct handle {
+  lbs_file *lbf;
+};
+
+static void handle_destroy(PyObject *capsule) {
+  struct handle *h = (struct handle*)PyCapsule_GetPointer(
+      capsule, HANDLE_NAME);
+  if (h) {
+    lbs_close(h->lbf);
+    free(h);
+  }
+}
+
+/* Returns the open lbs_file of capsule, or NULL with an exception set. */
+static lbs_file *get_lbf(PyObject *capsule) {
+  struct handle *h = (struct handle*)PyCapsule_GetPointer(
+      capsule, HANDLE_NAME);
+  if (!h) return NULL;
+  if (!h->lbf) PyErr_SetString(PyExc_ValueError, "handle is closed");
+  return h->lbf;
+}
+
+/* Sets the Python exception for the lbs_error err of lbf. Returns NULL. */
+static PyObject *set_error(lbs_file *lbf, int err, const char *pathname) {
+  int errnum = lbf ? lbs_errno(lbf) : 0;
+  if (err == LBS_ERR_NOMEM) return PyErr_NoMemory();
+  if (err == LBS_ERR_ARG) {
+    PyErr_SetString(PyExc_ValueError, lbs_strerror(err));
+  } else if (errnum) {
+    errno = errnum;
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)pathname);
+  } else {
+    PyErr_SetString(PyExc_IOError, lbs_strerror(err));
+  }
+  return NULL;
+}
+
+static PyObject *py_open(PyObject *self, PyObject *args) {
+  const char *pathname;
+  unsigned flags = 0;
+  int block_size = 0, err;
+  lbs_file *lbf;
+  struct handle *h;
+  PyObject *capsule;
+  (void)self;
+  if (!PyArg_ParseTuple(args, "s|Ii:open", &pathname, &flags, &block_size)) {
+    return NULL;
+  }
+  if (!(h = (struct handle*)malloc(sizeof(*h)))) return PyErr_NoMemory();
+  Py_BEGIN_ALLOW_THREADS
+  err = lbs_open(&lbf, pathname, flags, block_size);
+  Py_END_ALLOW_THREADS
+  if (err) {
+    set_error(lbf, err, pathname);
+    lbs_close(lbf);
+    free(h);
+    return NULL;
+  }
+  h->lbf = lbf;
+  if (!(capsule = PyCapsule_New(h, HANDLE_NAME, handle_destroy))) {
+    lbs_close(lbf);
+    free(h);
+  }
+  return capsule;
+}
+
+static PyObject *py_close(PyObject *self, PyObject *args) {
+  PyObject *capsule;
+  struct handle *h;
+  (void)self;
+  if (!PyArg_ParseTuple(args, "O:close", &capsule)) return NULL;
+  if (!(h = (struct handle*)PyCapsule_GetPointer(capsule, HANDLE_NAME))) {
+    return NULL;
+  }
+  lbs_close(h->lbf);
+  h->lbf = NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *py_size(PyObject *self, PyObject *args) {
+  PyObject *capsule;
+  lbs_file *lbf;
+  (void)self;
+  if (!PyArg_ParseTuple(args, "O:size", &capsule)) return NULL;
+  if (!(lbf = get_lbf(capsule))) return NULL;
+  return PyLong_FromLongLong(lbs_get_size(lbf));
+}
+
+static PyObject *py_search(PyObject *self, PyObject *args) {
+  PyObject *capsule;
+  lbs_file *lbf;
+  int mode, err;
+  const char *key;
+  Py_ssize_t key_size;
+  PY_LONG_LONG lo = 0, hi = -1, hint = -1;
+  lbs_off_t ofs;
+  (void)self;
+  if (!PyArg_ParseTuple(args, "Ois#|LLL:search", &capsule, &mode, &key,
+                        &key_size, &lo, &hi, &hint)) {
+    return NULL;
+  }
+  if (!(lbf = get_lbf(capsule))) return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  err = lbs_search_from(lbf, (lbs_mode)mode, key, key_size, lo, hi, hint,
+                        &ofs);
+  Py_END_ALLOW_THREADS
+  if (err) return set_error(lbf, err, NULL);
+  return PyLong_FromLongLong(ofs);
+}
+
+/* A key of search_many. */
+struct query {
+  const char *key;
+  size_t key_size;
+  Py_ssize_t i;  /* Index in the result list. */
+  lbs_off_t ofs;
+};
+
+static int compare_queries(const void *a, const void *b) {
+  const struct query *qa = (const struct query*)a;
+  const struct query *qb = (const struct query*)b;
+  size_t n = qa->key_size < qb->key_size ? qa->key_size : qb->key_size;
+  int c = memcmp(qa->key, qb->key, n);
+  if (c) return c;
+  return qa->key_size < qb->key_size ? -1 : qa->key_size > qb->key_size;
+}
+
+static PyObject *py_search_many(PyObject *self, PyObject *args) {
+  PyObject *capsule, *keys, *seq, *result = NULL, *item;
+  lbs_file *lbf;
+  int mode, err = LBS_OK;
+  Py_ssize_t n, i;
+  struct query *queries;
+  lbs_off_t hint = -1;
+  char *key;
+  Py_ssize_t key_size;
+  (void)self;
+  if (!PyArg_ParseTuple(args, "OiO:search_many", &capsule, &mode, &keys)) {
+    return NULL;
+  }
+  if (!(lbf = get_lbf(capsule))) return NULL;
+  if (!(seq = PySequence_Fast(keys, "keys must be iterable"))) return NULL;
+  n = PySequence_Fast_GET_SIZE(seq);
+  if (!(queries = (struct query*)malloc(
+      (n ? n : 1) * sizeof(*queries)))) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+  for (i = 0; i < n; ++i) {  /* seq keeps the key bytes alive. */
+#if PY_MAJOR_VERSION >= 3
+    if (PyBytes_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i), &key,
+                                &key_size) < 0) goto done;
+#else
+    if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i), &key,
+                                 &key_size) < 0) goto done;
+#endif
+    queries[i].key = key;
+    queries[i].key_size = key_size;
+    queries[i].i = i;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  qsort(queries, n, sizeof(*queries), compare_queries);
+  for (i = 0; i < n && !err; ++i) {
+    err = lbs_search_from(lbf, (lbs_mode)mode, queries[i].key,
+                          queries[i].key_size, 0, -1, hint, &queries[i].ofs);
+    hint = queries[i].ofs;
+  }
+  Py_END_ALLOW_THREADS
+  if (err) {
+    set_error(lbf, err, NULL);
+    goto done;
+  }
+  if (!(result = PyList_New(n))) goto done;
+  for (i = 0; i < n; ++i) {
+    if (!(item = PyLong_FromLongLong(queries[i].ofs))) {
+      Py_DECREF(result);
+      result = NULL;
+      goto done;
+    }
+    PyList_SET_ITEM(result, queries[i].i, item);
+  }
+ done:
+  free(queries);
+  Py_DECREF(seq);
+  return result;
+}
+
+static PyObject *py_range(PyObject *self, PyObject *args) {
+  PyObject *capsule;
+  lbs_file *lbf;
+  int mode, err;
+  const char *x, *y = NULL;
+  Py_ssize_t xsize, ysize = 0;
+  lbs_off_t start, end;
+  (void)self;
+  if (!PyArg_ParseTuple(args, "Ois#|z#:range", &capsule, &mode, &x, &xsize,
+                        &y, &ysize)) {
+    return NULL;
+  }
+  if (!(lbf = get_lbf(capsule))) return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  err = lbs_range(lbf, (lbs_mode)mode, x, xsize, y, ysize, &start, &end);
+  Py_END_ALLOW_THREADS
+  if (err) return set_error(lbf, err, NULL);
+  return Py_BuildValue("(LL)", (PY_LONG_LONG)start, (PY_LONG_LONG)end);
+}
+
+static PyMethodDef methods[] = {
+  {"open", py_open, METH_VARARGS, "Opens a sorted text file for searching."},
+  {"close", py_close, METH_VARARGS, "Closes a handle."},
+  {"size", py_size, METH_VARARGS, "Returns the searchable size."},
+  {"search", py_search, METH_VARARGS, "Returns the offset of a key."},
+  {"search_many", py_search_many, METH_VARARGS,
+   "Returns the list of offsets of keys."},
+  {"range", py_range, METH_VARARGS, "Returns the range between keys."},
+  {NULL, NULL, 0, NULL}
+};
+
+static int add_constants(PyObject *m) {
+  return PyModule_AddIntConstant(m, "LE", LBS_LE) ||
+      PyModule_AddIntConstant(m, "LT", LBS_LT) ||
+      PyModule_AddIntConstant(m, "LP", LBS_LP) ||
+      PyModule_AddIntConstant(m, "MMAP", LBS_MMAP) ||
+      PyModule_AddIntConstant(m, "DIRECT", LBS_DIRECT) ||
+      PyModule_AddIntConstant(m, "INDEX", LBS_INDEX) ||
+      PyModule_AddIntConstant(m, "IGNORE_INCOMPLETE", LBS_IGNORE_INCOMPLETE) ||
+      PyModule_AddIntConstant(m, "LINE_CACHE", LBS_LINE_CACHE) ||
+      PyModule_AddIntConstant(m, "LINE_INDEX", LBS_LINE_INDEX) ||
+      PyModule_AddIntConstant(m, "INTERPOLATE", LBS_INTERPOLATE) ||
+      PyModule_AddIntConstant(m, "BLOCK_ALIGNED", LBS_BLOCK_ALIGNED);
+}
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef module_def = {
+  PyModuleDef_HEAD_INIT, "_pts_lbsearch", NULL, -1, methods,
+  NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__pts_lbsearch(void);  /* For -Wmissing-declarations. */
+PyMODINIT_FUNC PyInit__pts_lbsearch(void) {
+  PyObject *m = PyModule_Create(&module_def);
+  if (m && add_constants(m)) {
+    Py_DECREF(m);
+    m = NULL;
+  }
+  return m;
+}
+#else
+PyMODINIT_FUNC init_pts_lbsearch(void);  /* For -Wmissing-declarations. */
+PyMODINIT_FUNC init_pts_lbsearch(void) {
+  PyObject *m = Py_InitModule("_pts_lbsearch", methods);
+  if (m) (void)add_constants(m);
+}
+#endif
@@ -25,9 +25,164 @@ please use the C implementation instead in pts_lbsearch.c, which does less
 IO (i.e. fewer calls to lseek(2) and read(2)), is faster, has more features
 (i.e. more command-line flags).
 
+For searching from Python, wrap the file in a BlockReader (which keeps the
+recently read blocks, so nearby probes don't read again), and use
+bisect_many for many keys, which calls the C implementation if the
+_pts_lbsearch extension module (compile_pymodule.sh) can be imported.
+
 TODO(pts): Add setup.py and upload to PyPi.
 """
 
+import os
+
+try:
+  import _pts_lbsearch
+except ImportError:
+  _pts_lbsearch = None
+
+
+class BlockReader(object):
+  """Read-only, seekable file-like object with a cache of blocks.
+
+  A Python file object discards its read buffer on each f.seek, so each probe
+  of _read_and_compare costs an lseek(2) and a read(2). This class reads
+  aligned blocks of block_size bytes (with os.pread if available, otherwise
+  with os.lseek and os.read), and keeps the last cache_size of them, so the
+  last few probes of a bisection (which are close to each other), and the
+  top-of-tree probes of subsequent bisections don't read again.
+
+  If use_mmap is true, the file is mapped to memory instead (with mmap.mmap,
+  if it's not empty), and the page cache does the caching.
+
+  The size of the file is determined when the BlockReader is created, bytes
+  appended later are not visible.
+
+  Args:
+    f: Filename, or a file object (with f.fileno()), which is not closed by
+      self.close().
+    block_size: Size of the blocks, a power of 2.
+    cache_size: Maximum number of blocks kept, at least 1.
+    use_mmap: If true, use mmap.mmap instead of reading blocks.
+  """
+
+  def __init__(self, f, block_size=8192, cache_size=32, use_mmap=False):
+    assert block_size > 0 and not block_size & (block_size - 1), block_size
+    assert cache_size >= 1, cache_size
+    if getattr(f, 'fileno', None):
+      self._file = None
+    else:
+      f = self._file = open(f, 'rb')
+    self._fd = f.fileno()
+    self._size = os.fstat(self._fd).st_size
+    self._ofs = 0
+    self._block_size = block_size
+    self._cache_size = cache_size
+    self._blocks = {}  # Maps block index to block data.
+    self._lru = []  # Block indexes in self._blocks, most recently used last.
+    self._mmap = None
+    if use_mmap and self._size:
+      import mmap
+      self._mmap = mmap.mmap(self._fd, self._size, access=mmap.ACCESS_READ)
+
+  def close(self):
+    if self._mmap is not None:
+      self._mmap.close()
+      self._mmap = None
+    self._blocks.clear()
+    del self._lru[:]
+    if self._file is not None:
+      self._file.close()
+      self._file = None
+
+  def fileno(self):
+    return self._fd
+
+  def tell(self):
+    return self._ofs
+
+  def seek(self, ofs, whence=0):
+    if whence == 1:
+      ofs += self._ofs
+    elif whence == 2:
+      ofs += self._size
+    if ofs < 0:
+      raise IOError('negative seek offset: %d' % ofs)
+    self._ofs = ofs
+
+  def _read_block(self, i):
+    """Returns the data of block i (shorter at EOF) from the cache."""
+    data = self._blocks.get(i)
+    if data is None:
+      if len(self._lru) >= self._cache_size:
+        del self._blocks[self._lru.pop(0)]
+      ofs = i * self._block_size
+      size, parts = min(self._block_size, self._size - ofs), []
+      while size > 0:  # Regular files have short reads only at EOF.
+        if getattr(os, 'pread', None):
+          part = os.pread(self._fd, size, ofs)
+        else:
+          os.lseek(self._fd, ofs, 0)
+          part = os.read(self._fd, size)
+        if not part:
+          break
+        parts.append(part)
+        ofs += len(part)
+        size -= len(part)
+      data = self._blocks[i] = ''.join(parts)
+    else:
+      self._lru.remove(i)
+    self._lru.append(i)
+    return data
+
+  def _read(self, size, is_line):
+    """Reads at most size bytes, up to and including the first '\\n' if
+    is_line is true."""
+    ofs = self._ofs
+    if size < 0 or ofs + size > self._size:
+      size = max(0, self._size - ofs)
+    if self._mmap is not None:
+      end = ofs + size
+      if is_line:
+        i = self._mmap.find('\n', ofs, end)
+        if i >= 0:
+          end = i + 1
+      self._ofs = end
+      return self._mmap[ofs : end]
+    parts, bs = [], self._block_size
+    while size > 0:
+      data = self._read_block(ofs // bs)
+      j = ofs % bs
+      end = min(len(data), j + size)
+      if end <= j:
+        break  # The file got truncated.
+      if is_line:
+        i = data.find('\n', j, end)
+        if i >= 0:
+          end = i + 1
+          size = end - j  # Stop after this part.
+      parts.append(data[j : end])
+      ofs += end - j
+      size -= end - j
+    self._ofs = ofs
+    return ''.join(parts)
+
+  def read(self, size=-1):
+    return self._read(size, False)
+
+  def readline(self):
+    ofs = self._ofs
+    if self._mmap is None:  # Fast path: the line is within a cached block.
+      i, j = divmod(ofs, self._block_size)
+      if self._lru and self._lru[-1] == i:
+        data = self._blocks[i]
+      else:
+        data = self._read_block(i)
+      k = data.find('\n', j)
+      if k >= 0:
+        self._ofs = ofs + k + 1 - j
+        return data[j : k + 1]
+    return self._read(-1, True)
+
 
 def _read_and_compare(cache, ofs, f, size, tester):
   """Read a line from f at ofs, and test it.
@@ -206,6 +361,58 @@ def bisect_interval(f, x, y=None, is_open=False, size=None):
     return bisect_way(f, x, True, end), end
 
 
+def bisect_many(f, xs, is_left=True, size=None):
+  """Return the list of bisect_way(f, x, is_left, size) for each x in xs.
+
+  The keys are searched in sorted order, so subsequent bisections find the
+  top-of-tree lines in the cache of a BlockReader. If f is a filename, size
+  is None, and the _pts_lbsearch extension module can be imported, the
+  searches are done by the C implementation in pts_lbsearch.c instead (each
+  one galloping from the previous result, like pts_lbsearch -B), which is
+  about as fast as running that.
+
+  Args:
+    f: Filename (opened as a BlockReader, unless _pts_lbsearch is used), or
+      a seekable file object or file-like object to search in, see
+      bisect_way. Wrap file objects in a BlockReader for speed.
+    xs: Sequence of lines to search for. Each must not contain '\\n', except
+      for maybe a trailing one, which will be ignored if present.
+    is_left: If true, emulate bisect_left, otherwise bisect_right.
+    size: Size limit for reading. Bytes in f after offset `size' will be
+      ignored. If None, then no limit.
+  Returns:
+    List of byte offsets, in the order of xs.
+  """
+  xs = [x.rstrip('\n') for x in xs]
+  if getattr(f, 'seek', None):
+    g = None
+  elif _pts_lbsearch and size is None:
+    if is_left:
+      mode = _pts_lbsearch.LE
+    else:
+      mode = _pts_lbsearch.LT
+    h = _pts_lbsearch.open(f)
+    try:
+      return _pts_lbsearch.search_many(h, mode, xs)
+    finally:
+      _pts_lbsearch.close(h)
+  else:
+    f = g = BlockReader(f)
+  try:
+    if size is None:
+      f.seek(0, 2)
+      size = f.tell()
+    result = [0] * len(xs)
+    order = range(len(xs))
+    order.sort(key=xs.__getitem__)
+    for i in order:
+      result[i] = bisect_way(f, xs[i], is_left, size)
+    return result
+  finally:
+    if g is not None:
+      g.close()
+
+
 def main(argv):
   """Command-line tool for binary search in a line-sorted text file.
 
@@ -266,7 +473,7 @@ def main(argv):
     usage_error('flag -a needs -eo and no <key-y>')
   if is_open and do_print_contents and y is None:
     usage_error('single-key contents is always empty')
-  f = open(filename)
+  f = BlockReader(filename)
   try:
     if is_open and not do_print_contents and y is None:
       sys.stdout.write('%d\n' % bisect_way(f, x, is_leftstart))
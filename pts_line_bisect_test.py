@@ -11,6 +11,8 @@ exec python -- "$0" ${1+"$@"}; exit 1
 """
 
 import cStringIO
+import os
+import tempfile
 import unittest
 
 import pts_line_bisect
@@ -154,5 +156,81 @@ class PtsLineBisect42Test(PtsLineBisect0Test):
   EXTRA_LEN = 42
 
 
+class BlockReaderTest(unittest.TestCase):
+  DATA = '\n10ten\n20twenty\n30\n30\n30\n30\n30\n40forty\n5\n6incomplete'
+  KEYS = ('', '1', '10ten', '15', '20twenty', '25', '30', '31', '40forty',
+          '5', '6', '6incomplete', '6z', '7')
+
+  def setUp(self):
+    fd, self.filename = tempfile.mkstemp()
+    os.write(fd, self.DATA)
+    os.close(fd)
+
+  def tearDown(self):
+    os.remove(self.filename)
+
+  def readers(self):
+    for block_size in (1, 2, 4, 8, 8192):
+      for cache_size in (1, 2, 8):
+        yield pts_line_bisect.BlockReader(self.filename, block_size, cache_size)
+    yield pts_line_bisect.BlockReader(self.filename, use_mmap=True)
+
+  def testReadline(self):
+    for f in self.readers():
+      g = cStringIO.StringIO(self.DATA)
+      for ofs in range(len(self.DATA) + 2):
+        f.seek(ofs)
+        g.seek(ofs)
+        self.assertEqual(f.readline(), g.readline())
+        self.assertEqual(f.tell(), g.tell())
+        self.assertEqual(f.read(3), g.read(3))
+        self.assertEqual(f.read(), g.read())
+      f.seek(-2, 2)
+      self.assertEqual(f.read(), 'te')
+      f.close()
+
+  def testBisectInterval(self):
+    g = cStringIO.StringIO(self.DATA)
+    for f in self.readers():
+      for x in self.KEYS:
+        for y in self.KEYS:
+          for is_open in (False, True):
+            self.assertEqual(
+                pts_line_bisect.bisect_interval(f, x, y, is_open),
+                pts_line_bisect.bisect_interval(g, x, y, is_open))
+      f.close()
+
+  def testBisectMany(self):
+    g = cStringIO.StringIO(self.DATA)
+    xs = list(self.KEYS) + ['30\n', '25'] + list(reversed(self.KEYS))
+    for is_left in (True, False):
+      expected = [pts_line_bisect.bisect_way(g, x, is_left) for x in xs]
+      self.assertEqual(
+          pts_line_bisect.bisect_many(self.filename, xs, is_left), expected)
+      self.assertEqual(pts_line_bisect.bisect_many(g, xs, is_left), expected)
+      self.assertEqual(pts_line_bisect.bisect_many(g, xs, is_left, 17),
+                       [pts_line_bisect.bisect_way(g, x, is_left, 17)
+                        for x in xs])
+    self.assertEqual(pts_line_bisect.bisect_many(self.filename, []), [])
+
+  def testExtension(self):
+    ext = pts_line_bisect._pts_lbsearch
+    if ext is None:
+      return  # Not compiled, run compile_pymodule.sh.
+    g = cStringIO.StringIO(self.DATA)
+    h = ext.open(self.filename)
+    self.assertEqual(ext.size(h), len(self.DATA))
+    for x in self.KEYS:
+      self.assertEqual(ext.search(h, ext.LE, x),
+                       pts_line_bisect.bisect_way(g, x, True))
+      self.assertEqual(ext.search(h, ext.LT, x),
+                       pts_line_bisect.bisect_way(g, x, False))
+      self.assertEqual(ext.range(h, ext.LT, x, '7'),
+                       pts_line_bisect.bisect_interval(g, x, '7'))
+    ext.close(h)
+    self.assertRaises(ValueError, ext.size, h)
+    self.assertRaises(IOError, ext.open, self.filename + '.missing')
+
+
 if __name__ == '__main__':
   unittest.main()